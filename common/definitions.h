@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 /**
  * Author: Ryan Steinwert
  * 
@@ -16,20 +18,87 @@
 #define COMMAND_SIZE 2
 #define ERR_CODE_SIZE 2
 #define STR_LEN_SIZE 2
+#define REQUEST_ID_SIZE 4
+#define DTYPE_SIZE 1
+#define UPLOAD_SIZE_SIZE 8
+#define SESSION_TOKEN_SIZE 16
+
+// protocol v2 lengths, sizes, codes and request IDs are LEB128 varints,
+// at most this long for a 64 bit value
+#define MAX_VARINT_SIZE 10
+
+// GET replies stream item data as length prefixed chunks of at most this size,
+// its v2 varint length still fits in STR_LEN_SIZE
+#define MAX_CHUNK_SIZE 16382
+
+// request bodies smaller than this gain too little from compression to be worth it
+#define COMPRESS_THRESHOLD 256
 
 #define MAX_COLLECTION_NAME_SIZE 64
 #define MAX_ITEM_NAME_SIZE 64
 #define MAX_LOGIN_FIELD_SIZE 128
+// every account's uid is this many characters
+#define DEFAULT_UID_LEN 32
 #define MAX_PATH_SIZE 2048
 
+// operations carried by one BATCH frame
+#define MAX_BATCH_OPS 64
+
+
+
+/**
+ * Protocol versions. Connections start on v1, a HELLO carrying a one byte
+ * version and a byte of CAPABILITY bits asks for a newer one and is answered
+ * with the error code, the version chosen, which every later frame in both
+ * directions uses, and the capabilities granted.
+ *
+ * A v1 frame is a 4 byte session ID and a 2 byte command with the flags in
+ * its middle nibbles, then a 4 byte request ID if flagged, then fields with
+ * 2 byte lengths. A v2 frame is a version byte, the command and a flags word
+ * as varints, the 4 byte session ID, or 16 byte session token under
+ * CAP_WIDE_SESSION, a varint request ID if flagged, then
+ * fields with varint lengths. Replies mirror the request's framing, their
+ * error code is 2 bytes under v1 and a varint under v2, as are the lengths
+ * of GET chunks. One byte fields such as permissions stay one byte.
+ */
+enum PROTOCOL {
+   PROTOCOL_V1 = 1,
+   PROTOCOL_V2 = 2
+};
 
+/**
+ * Capabilities asked for in a HELLO, granted only along with v2.
+ * CAP_DEFLATE lets requests carry V2_COMPRESSED bodies, a varint body size
+ * and varint compressed size followed by a zlib stream deflated with
+ * POST_DICTIONARY as its preset dictionary.
+ * CAP_WIDE_SESSION carries a 128 bit session token, big endian, in place of
+ * the session ID. GET_SESSION_ID then creates a session with a random token,
+ * a session created with a 32 bit ID keeps working as the token 0:ID.
+ */
+enum CAPABILITY {
+   CAP_DEFLATE = 0x01,
+   CAP_WIDE_SESSION = 0x02
+};
 
 enum CMD {
    GET_SESSION_ID = 0x1001,
    CREATE_ACCOUNT = 0x1002,
    LOGIN = 0x1003,
+   HELLO = 0x1004,
    GET = 0x2001,
-   POST = 0x2002
+   POST = 0x2002,
+   BATCH = 0x2003
+};
+
+/**
+ * Operations of a BATCH. Its body is a one byte count, then each operation
+ * as an op byte followed by its fields, for BATCH_POST the resource flags,
+ * the perm, the path and the data, for BATCH_DELETE the path. The reply
+ * carries the error code, the count and one code per operation, in order.
+ */
+enum BATCH_OP {
+   BATCH_POST = 1,
+   BATCH_DELETE = 2
 };
 
 enum FLAGS {
@@ -41,6 +110,31 @@ enum FLAGS {
    AUDIO_STREAM_RESOURCE = 0x06
 };
 
+/**
+ * Header flags, set in the flag bits of the command. A request carrying
+ * HAS_REQUEST_ID has a request ID after the header, its reply echoes
+ * both and may arrive out of order. A POST carrying STREAM_UPLOAD has an
+ * 8 byte data size in place of the length prefixed data, and the data
+ * follows unframed
+ */
+enum HEADER_FLAGS {
+   STREAM_UPLOAD = 0x40,
+   HAS_REQUEST_ID = 0x80
+};
+
+/**
+ * Bits of the v2 flags word. The resource type of a POST has bits of its
+ * own instead of sharing the flag nibbles, a streamed upload's data size is
+ * a varint of up to 64 bits
+ */
+enum FLAGS_V2 {
+   V2_HAS_REQUEST_ID = 0x01,
+   V2_STREAM_UPLOAD = 0x02,
+   V2_COMPRESSED = 0x04,
+   V2_RESOURCE_SHIFT = 4,
+   V2_RESOURCE_MASK = 0xF0
+};
+
 enum ERROR {
     SUCCESS = 0,
   	PARSE = 1,
@@ -60,7 +154,9 @@ enum ERROR {
   	DUPLICATE_ACCOUNT = 15,
     BAD_LOGIN = 16,
     COMMAND_FORMAT = 17,
-    TYPE_INVAL = 18
+    TYPE_INVAL = 18,
+    SERVER_BUSY = 19,
+    RATE_LIMITED = 20
 };
 
 enum PERM {
@@ -87,3 +183,26 @@ typedef struct request_info_t {
 	const char* perms;
 	bool isAdmin = false;
 } request_info_s;
+
+/**
+ * 128 bit session token. The low 32 bits are the session's ID, a session
+ * created without CAP_WIDE_SESSION has a token of just its ID.
+ */
+typedef struct session_token_t {
+	uint64_t hi;
+	uint64_t lo;
+} session_token_s;
+
+/**
+ * Struct for one operation of a database batch, result is set once applied
+ * and ops whose result is already set are skipped
+ */
+typedef struct batch_op_t {
+	BATCH_OP op;
+	const char* path;
+	const void* data;
+	size_t dataSize;
+	DTYPE type;
+	PERM perm;
+	int result;
+} batch_op_s;
@@ -0,0 +1,38 @@
+#pragma once
+
+/**
+ * Author: Ryan Steinwert
+ *
+ * Preset dictionary for compressed request bodies, shared by client and server
+ */
+
+
+
+/**
+ * Preset deflate dictionary of text common in posts. Both sides must hold the
+ * same bytes, zlib checks the dictionary's Adler-32 before inflating with it.
+ * Strings used most sit at the end, where matches against them are shortest.
+ */
+static const char POST_DICTIONARY[] =
+   "https://www. .com/ .org/ .net/ http:// @ # :) :( :D <3 lol lmao omg idk tbh imo btw "
+   "photo video audio stream live update news today tonight tomorrow yesterday weekend "
+   "morning afternoon evening night week month year birthday holiday family friends "
+   "school work home game music movie show song album book food coffee dinner lunch "
+   "breakfast party trip travel weather rain snow sun summer winter spring fall "
+   "Monday Tuesday Wednesday Thursday Friday Saturday Sunday January February March "
+   "April May June July August September October November December "
+   "congratulations happy birthday thank you so much thanks everyone love you all "
+   "can't wait to see you soon! check out my new post! what do you think? "
+   "I don't know I can't believe I just I really I think I love I hope I want I need "
+   "it's that's there's here's what's don't doesn't didn't won't wouldn't couldn't "
+   "shouldn't isn't aren't wasn't weren't haven't hasn't I'm I've I'll I'd you're "
+   "they're we're let's "
+   "about after again also always another any anyone anything around because been "
+   "before being best better both came come could day did does down each even ever "
+   "every first from get give going good got great had has have her here him his how "
+   "into just know last like little long look made make many more most much must "
+   "never new next nice now off old one only other our out over people really right "
+   "said same say see she should some something still such take than that the their "
+   "them then there these they thing think this those time too two under until very "
+   "want was way well were what when where which while who why will with would year "
+   "you your a an and are as at be but by for if in is it not of on or so to up we ";
@@ -5,10 +5,11 @@
  */
 
 #define DEFAULT_TABLE_SIZE 64
-#define DEFAULT_UID_LEN 32
 
 #define PARSE_BUF_SIZE 2048
 #define STR_BUF_SIZE 1024
+// salt and hex sha-256 digest of a stored password, with terminator
+#define PASSHASH_BUF_SIZE 68
 
 #define ACCOUNTS_FOLDER "accounts"
 #define ACCOUNTS_FILE "accounts/accounts"
@@ -107,14 +108,6 @@ int AccountManager::createAccount(const char* username, const char* email, const
 {
 	int uidLen, usernameLen, emailLen, passwordLen, ret;
 
-	// check whether account exists
-	for(auto accountInfo : _infoList)
-	{
-		if(!strcmp(accountInfo->username, username) || !strcmp(accountInfo->email, email)) {
-			return ERROR::DUPLICATE_ACCOUNT;
-		}
-	}
-
 	uidLen = DEFAULT_UID_LEN;
 	usernameLen = strlen(username);
 	emailLen = strlen(email);
@@ -131,16 +124,31 @@ int AccountManager::createAccount(const char* username, const char* email, const
 
 	//printf("Generated uid: %s\n", account->uid);
 
+	// hashed before taking the lock, only the table lookup and insert hold it
 	account->passhash = genHashString(password);
 	account->next = nullptr;
 
 	//printf("Password hash: %s\n", account->passhash);
 
-	if((ret = insertNode(account)) != 0) {
-		freeNode(account);
-		return ret;
+	_mutex.lock();
+
+	// check whether account exists
+	for(auto accountInfo : _infoList)
+	{
+		if(!strcmp(accountInfo->username, username) || !strcmp(accountInfo->email, email)) {
+			_mutex.unlock();
+			freeNode(account);
+			return ERROR::DUPLICATE_ACCOUNT;
+		}
 	}
 
+	// frees the node if it is not inserted
+	ret = insertNode(account);
+
+	_mutex.unlock();
+
+	if(ret != 0) return ret;
+
 	//writeNewAccount(account);
 	writeAccounts();
 
@@ -259,9 +267,17 @@ void AccountManager::writeNewAccount(account_node_s* account)
 void AccountManager::writeAccounts()
 {
 	FILE* file;
-	mkdir(ACCOUNTS_FOLDER, S_IRWXU);
+	FILE* stream;
+	char* data = nullptr;
+	size_t dataSize = 0;
 
-	file = fopen(ACCOUNTS_FILE, "w+");
+	// writers go one at a time, each copies the table after every insert before it
+	std::lock_guard<std::mutex> writeLock(_writeMutex);
+
+	if((stream = open_memstream(&data, &dataSize)) == nullptr) return;
+
+	// only the copy holds the table lock, the disk write does not
+	_mutex.lock();
 
 	for(uint16_t i = 0; i < _tableSize; ++i)
 	{
@@ -270,12 +286,23 @@ void AccountManager::writeAccounts()
 
 		while(node != nullptr) 
 		{
-			fprintf(file, "%s %s %s %s\n", node->uid, node->username, node->email, node->passhash);
+			fprintf(stream, "%s %s %s %s\n", node->uid, node->username, node->email, node->passhash);
 			node = node->next;
 		}
 	}
 
-	fclose(file);
+	_mutex.unlock();
+
+	fclose(stream);
+
+	mkdir(ACCOUNTS_FOLDER, S_IRWXU);
+
+	if((file = fopen(ACCOUNTS_FILE, "w+")) != nullptr) {
+		fwrite(data, 1, dataSize, file);
+		fclose(file);
+	}
+
+	free(data);
 }
 
 
@@ -288,7 +315,9 @@ char* AccountManager::genRandString(int length)
 {
 	char* ret = (char*) malloc (length+1);
 
+	_randomMutex.lock();
 	std::default_random_engine e(r());
+	_randomMutex.unlock();
 
 	uint8_t numValidUidChars = sizeof(validUidChars)-1;
 
@@ -317,6 +346,9 @@ char* AccountManager::genRandString(int length)
 int AccountManager::insertAccount(const char* uid, const char* username, const char* email, const char* passhash)
 {
 	int uidLen, usernameLen, emailLen, passhashLen;
+
+	std::lock_guard<std::mutex> lock(_mutex);
+
 	uidLen = strlen(uid);
 	usernameLen = strlen(username);
 	emailLen = strlen(email);
@@ -346,6 +378,8 @@ int AccountManager::insertAccount(const char* uid, const char* username, const c
  */
 int AccountManager::deleteAccount(const char* uid)
 {
+	std::lock_guard<std::mutex> lock(_mutex);
+
 	uint16_t hashPos = elfHash(reinterpret_cast<const unsigned char*>(uid)) % _tableSize;
 
 	account_node_s* prev = nullptr;
@@ -383,6 +417,8 @@ int AccountManager::deleteAccount(const char* uid)
  */
 int AccountManager::getUsername(const char* uid, void* buf, size_t bufSize)
 {
+	std::lock_guard<std::mutex> lock(_mutex);
+
 	account_node_s* node = getNode(uid);
 
 	if(!node) return ERROR::NO_ACCOUNT;
@@ -402,6 +438,8 @@ int AccountManager::getUsername(const char* uid, void* buf, size_t bufSize)
  */
 int AccountManager::getUidFromUsername(const char* username, void* buf, size_t bufSize)
 {
+	std::lock_guard<std::mutex> lock(_mutex);
+
 	for(auto accountInfo : _infoList)
 	{
 		if(!strcmp(accountInfo->username, username)) {
@@ -421,6 +459,8 @@ int AccountManager::getUidFromUsername(const char* username, void* buf, size_t b
  */
 int AccountManager::getUidFromEmail(const char* email, void* buf, size_t bufSize)
 {
+	std::lock_guard<std::mutex> lock(_mutex);
+
 	for(auto accountInfo : _infoList)
 	{
 		if(!strcmp(accountInfo->email, email)) {
@@ -438,6 +478,8 @@ int AccountManager::getUidFromEmail(const char* email, void* buf, size_t bufSize
  */
 bool AccountManager::accountExists(const char* uid)
 {
+	std::lock_guard<std::mutex> lock(_mutex);
+
 	return getNode(uid);
 }
 
@@ -452,10 +494,14 @@ account_info_s* AccountManager::login(const char* username, const char* password
 {
 	account_info_s* infoPointer;
 	account_node_s* accountNode;
+	char passhash[PASSHASH_BUF_SIZE];
+
+	_mutex.lock();
 
 	infoPointer = getAccountInfo(username);
 
 	if(!infoPointer) {
+		_mutex.unlock();
 		*error = NO_ACCOUNT;
 		return nullptr;
 	}
@@ -464,11 +510,18 @@ account_info_s* AccountManager::login(const char* username, const char* password
 	accountNode = getNode(infoPointer->uid);
 
 	if(!accountNode) {
+		_mutex.unlock();
 		*error = NO_ACCOUNT;
 		return nullptr;
 	}
 
-	if(!matchPassWithHash(password, accountNode->passhash)) {
+	// the hash is checked on a copy, outside the lock
+	strncpy(passhash, accountNode->passhash, PASSHASH_BUF_SIZE);
+	passhash[PASSHASH_BUF_SIZE-1] = 0;
+
+	_mutex.unlock();
+
+	if(!matchPassWithHash(password, passhash)) {
 		*error = BAD_LOGIN;
 		return nullptr;
 	}
@@ -7,6 +7,7 @@
 
 
 #include <cstdint>
+#include <mutex>
 #include <random>
 #include <vector>
 
@@ -26,6 +27,11 @@ typedef struct account_info_t {
 } account_info_s;
 
 
+/**
+ * Account table, safe to call from any thread. The table is guarded by the
+ * manager's mutex, password hashing and the accounts file write happen
+ * outside it so lookups never wait on them.
+ */
 class AccountManager {
 public:
 	AccountManager();
@@ -52,6 +58,10 @@ private:
 
 	std::random_device r;
 
+	std::mutex _mutex;
+	std::mutex _writeMutex;
+	std::mutex _randomMutex;
+
 	int insertNode(account_node_s* node);
 	void freeNode(account_node_s* node);
 
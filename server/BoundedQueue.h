@@ -0,0 +1,170 @@
+#pragma once
+/**
+ * Author: Ryan Steinwert
+ *
+ * Bounded lock-free multi-producer multi-consumer queue
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+
+/**
+ * Fixed size ring of cells, each cell carries a sequence number that tells
+ * producers and consumers whose turn it is. Depth is rounded up to a power of two.
+ */
+template <typename T>
+class BoundedQueue {
+public:
+	BoundedQueue(size_t depth);
+	~BoundedQueue();
+
+	BoundedQueue(const BoundedQueue&) = delete;
+	BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+	bool push(const T& value);
+	bool pop(T* value);
+
+	size_t size();
+	size_t capacity();
+
+private:
+	typedef struct cell_t {
+		std::atomic<size_t> sequence;
+		T data;
+	} cell_s;
+
+	cell_s* _buffer;
+	size_t _mask;
+
+	alignas(64) std::atomic<size_t> _enqueuePos;
+	alignas(64) std::atomic<size_t> _dequeuePos;
+};
+
+
+
+/**
+ * Create queue with room for at least the given number of entries
+ * @param depth Minimum number of entries, rounded up to a power of two
+ */
+template <typename T>
+BoundedQueue<T>::BoundedQueue(size_t depth) :
+	_enqueuePos(0),
+	_dequeuePos(0)
+{
+	size_t cap = 2;
+	while(cap < depth) cap <<= 1;
+
+	_mask = cap - 1;
+	_buffer = (cell_s*) malloc (sizeof(cell_s) * cap);
+
+	for(size_t i = 0; i < cap; i++)
+	{
+		new (&_buffer[i].sequence) std::atomic<size_t>(i);
+		new (&_buffer[i].data) T();
+	}
+}
+
+
+template <typename T>
+BoundedQueue<T>::~BoundedQueue()
+{
+	for(size_t i = 0; i <= _mask; i++)
+	{
+		_buffer[i].data.~T();
+	}
+
+	free(_buffer);
+}
+
+
+/**
+ * Push a value onto the queue
+ * @param value Value to copy into the queue
+ * @return True if pushed, false if the queue is full
+ */
+template <typename T>
+bool BoundedQueue<T>::push(const T& value)
+{
+	cell_s* cell;
+	size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+
+	while(true) {
+		cell = &_buffer[pos & _mask];
+		size_t seq = cell->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if(diff == 0) {
+			// cell free, claim it
+			if(_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+		} else if(diff < 0) {
+			return false;
+		} else {
+			pos = _enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	cell->data = value;
+	cell->sequence.store(pos + 1, std::memory_order_release);
+
+	return true;
+}
+
+
+/**
+ * Pop the oldest value from the queue
+ * @param value Container for the popped value
+ * @return True if a value was popped, false if the queue is empty
+ */
+template <typename T>
+bool BoundedQueue<T>::pop(T* value)
+{
+	cell_s* cell;
+	size_t pos = _dequeuePos.load(std::memory_order_relaxed);
+
+	while(true) {
+		cell = &_buffer[pos & _mask];
+		size_t seq = cell->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if(diff == 0) {
+			// cell filled, claim it
+			if(_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+		} else if(diff < 0) {
+			return false;
+		} else {
+			pos = _dequeuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	*value = cell->data;
+	cell->sequence.store(pos + _mask + 1, std::memory_order_release);
+
+	return true;
+}
+
+
+/**
+ * Approximate number of entries, exact when no push or pop is in flight
+ * @return Number of queued entries
+ */
+template <typename T>
+size_t BoundedQueue<T>::size()
+{
+	size_t enq = _enqueuePos.load(std::memory_order_relaxed);
+	size_t deq = _dequeuePos.load(std::memory_order_relaxed);
+
+	return enq > deq ? enq - deq : 0;
+}
+
+
+/**
+ * @return Maximum number of entries the queue holds
+ */
+template <typename T>
+size_t BoundedQueue<T>::capacity()
+{
+	return _mask + 1;
+}
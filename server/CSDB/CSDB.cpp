@@ -110,14 +110,28 @@ bool CSDB::itemExists(const char* path)
  * @param type Pointer to item type, filled with the type of the returned item data
  * @param bufSize The maximum size to write to the buffer
  * @param offset The offset to open the file with
- * @return The number of bytes written
+ * @return The number of bytes written, 0 past the end of the item, negative error code if unsuccessful
  */
-size_t CSDB::getItemData(const char* path, void* returnBuffer, DTYPE* type, size_t bufSize, size_t offset)
+ssize_t CSDB::getItemData(const char* path, void* returnBuffer, DTYPE* type, size_t bufSize, size_t offset)
 {
     return _collectionTree.getItemData(path, returnBuffer, type, bufSize, offset); 
 }
 
 
+/**
+ * Open the file backing the item at a given path
+ * @param path The path of the item
+ * @param fd Pointer to the descriptor of the opened file
+ * @param size Pointer to the size of the file
+ * @param type Pointer to item type, filled with the type of the item
+ * @return 0 if successful, error code if not
+ */
+int CSDB::openItemFile(const char* path, int* fd, size_t* size, DTYPE* type)
+{
+    return _collectionTree.openItemFile(path, fd, size, type);
+}
+
+
 
 
 
@@ -140,6 +154,46 @@ int CSDB::replaceItem(const char* path, const void* data, size_t dataSize, DTYPE
 }
 
 
+/**
+ * Open a temp file to stream the data of an item into
+ * @param path The path of the item
+ * @param fd Pointer to the descriptor of the opened temp file
+ * @param tempPath Buffer to store the temp file path in
+ * @param tempPathSize Size of the temp path buffer
+ * @return 0 if successful, error code if not
+ */
+int CSDB::openUpload(const char* path, int* fd, char* tempPath, size_t tempPathSize)
+{
+    return _collectionTree.openUpload(path, fd, tempPath, tempPathSize);
+}
+
+
+/**
+ * Commit a streamed item, replacing the item at the given path
+ * @param path The path of the item
+ * @param tempPath The temp file the data was streamed into
+ * @param dataSize The size in bytes of the streamed data
+ * @param type The type of item
+ * @param owner The owner of the item
+ * @param perm The permission status of this item
+ * @return 0 if successful, error code if not
+ */
+int CSDB::commitUpload(const char* path, const char* tempPath, size_t dataSize, DTYPE type, const char* owner, PERM perm)
+{
+    return _collectionTree.commitUpload(path, tempPath, dataSize, type, owner, perm);
+}
+
+
+/**
+ * Remove the temp file of an abandoned upload
+ * @param tempPath The temp file to remove
+ */
+void CSDB::abortUpload(const char* tempPath)
+{
+    _collectionTree.abortUpload(tempPath);
+}
+
+
 /**
  * Delete the item at the given path
  * @param path The path of the item
@@ -151,6 +205,20 @@ int CSDB::deleteItem(const char* path)
 }
 
 
+/**
+ * Apply a batch of item replacements and deletions, writing each touched
+ * collection's manifest once
+ * @param ops The ops to apply, each one's result is set
+ * @param numOps Number of ops
+ * @param owner The owner of replaced items
+ * @return 0 if every op was applied, error code of the first one that was not
+ */
+int CSDB::applyBatch(batch_op_s* ops, size_t numOps, const char* owner)
+{
+    return _collectionTree.applyBatch(ops, numOps, owner);
+}
+
+
 /**
  * Get the owner of the item at a given path
  * @param path The path of the item
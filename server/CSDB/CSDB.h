@@ -32,10 +32,17 @@ public:
 
     int deleteItem(const char* path);
 
+    int applyBatch(batch_op_s* ops, size_t numOps, const char* owner = nullptr);
+
+    int openUpload(const char* path, int* fd, char* tempPath, size_t tempPathSize);
+    int commitUpload(const char* path, const char* tempPath, size_t dataSize, DTYPE type, const char* owner = nullptr, PERM perm = PERM::PRIVATE);
+    void abortUpload(const char* tempPath);
+
     int getOwner(const char* path, void* buf, size_t bufSize);
     int getPerm(const char* path, PERM* permPointer);
 
-    size_t getItemData(const char* path, void* returnBuffer, DTYPE* type, size_t bufSize, size_t offset = 0);
+    ssize_t getItemData(const char* path, void* returnBuffer, DTYPE* type, size_t bufSize, size_t offset = 0);
+    int openItemFile(const char* path, int* fd, size_t* size, DTYPE* type);
 
     bool collectionExists(const char* path);
     bool itemExists(const char* path);
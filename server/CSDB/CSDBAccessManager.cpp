@@ -24,12 +24,16 @@ CSDBAccessManager::CSDBAccessManager()
  */
 CSDBAccessManager::~CSDBAccessManager()
 {
+	for(auto lock : locks) delete lock;
+
 	dbs.clear();
 	rms.clear();
+	locks.clear();
 }
 
 /**
- * Adds a database with the given name to the current list
+ * Adds a database with the given name to the current list, only called at
+ * startup before any request is served since the list itself is not locked
  * @param name The name of the new db to add
  * @param rulesFile The rules file to associate with this db
  * @return 0 if successfully added, error code if not
@@ -58,6 +62,7 @@ int CSDBAccessManager::addDB(const char* name, const char* rulesFile)
 
 	dbs.push_back(new CSDB(name));
 	rms.push_back(rm);
+	locks.push_back(new std::mutex());
 
 	return 0;
 }
@@ -74,10 +79,13 @@ int CSDBAccessManager::addCollection(const char* dbName, const char* path, reque
 {
 	CSDB* db;
 	CSDBRuleManager* rm;
+	std::mutex* lock;
 
 	requestInfo.perms = "w";
 
-	if(!getDBPair(dbName, &db, &rm)) return ERROR::NO_DB;
+	if(!getDBPair(dbName, &db, &rm, &lock)) return ERROR::NO_DB;
+
+	std::lock_guard<std::mutex> guard(*lock);
 
 	// check whether has access permissions
 	if(!rm->hasPerms(path, requestInfo)) return ERROR::NO_PERMS;
@@ -99,10 +107,13 @@ int CSDBAccessManager::deleteCollection(const char* dbName, const char* path, re
 {
 	CSDB* db;
 	CSDBRuleManager* rm;
+	std::mutex* lock;
 
 	requestInfo.perms = "w";
 
-	if(!getDBPair(dbName, &db, &rm)) return ERROR::NO_DB;
+	if(!getDBPair(dbName, &db, &rm, &lock)) return ERROR::NO_DB;
+
+	std::lock_guard<std::mutex> guard(*lock);
 
 	if(!rm->hasPerms(path, requestInfo)) return ERROR::NO_PERMS;
 
@@ -124,10 +135,13 @@ int CSDBAccessManager::replaceItem(const char* dbName, const char* path, request
 {
 	CSDB* db;
 	CSDBRuleManager* rm;
+	std::mutex* lock;
 
 	requestInfo.perms = "w";
 
-	if(!getDBPair(dbName, &db, &rm)) return ERROR::NO_DB;
+	if(!getDBPair(dbName, &db, &rm, &lock)) return ERROR::NO_DB;
+
+	std::lock_guard<std::mutex> guard(*lock);
 
 	if(!rm->hasPerms(path, requestInfo)) return ERROR::NO_PERMS;
 
@@ -149,9 +163,12 @@ int CSDBAccessManager::replaceItem(const char* dbName, const char* path, request
 {
 	CSDB* db;
 	CSDBRuleManager* rm;
+	std::mutex* lock;
 	requestInfo.perms = "w";
 
-	if(!getDBPair(dbName, &db, &rm)) return ERROR::NO_DB;
+	if(!getDBPair(dbName, &db, &rm, &lock)) return ERROR::NO_DB;
+
+	std::lock_guard<std::mutex> guard(*lock);
 
 	if(!rm->hasPerms(path, requestInfo)) return ERROR::NO_PERMS;
 
@@ -167,35 +184,163 @@ int CSDBAccessManager::replaceItem(const char* dbName, const char* path, request
  * @param type Pointer to item type to store
  * @param bufSize Maximum size to write to buffer
  * @param offset Offset to open file at
- * @return Number of bytes written if successfully, 0 if no bytes available or unsuccessful
+ * @return Number of bytes written, 0 past the end of the item, negative error code if unsuccessful
  */
-size_t CSDBAccessManager::getItemData(const char* dbName, const char* path, request_info_s requestInfo, void* buf, DTYPE* type, size_t bufSize, size_t offset)
+ssize_t CSDBAccessManager::getItemData(const char* dbName, const char* path, request_info_s requestInfo, void* buf, DTYPE* type, size_t bufSize, size_t offset)
 {
-	PERM perm;
-	char nameBuf[NAME_BUF_SIZE];
 	CSDB* db;
 	CSDBRuleManager* rm;
+	std::mutex* lock;
+	int err;
 
-	requestInfo.perms = "r";
+	if(!getDBPair(dbName, &db, &rm, &lock)) return -ERROR::NO_DB;
+
+	std::lock_guard<std::mutex> guard(*lock);
+
+	if((err = canRead(db, rm, path, requestInfo)) != 0) return -err;
+
+	return db->getItemData(path, buf, type, bufSize, offset);
+
+}
+
+
+/**
+ * Open the file backing the item at a given path, should the user have access permissions
+ * @param dbName The name of the database
+ * @param path The path of the item to access
+ * @param requestInfo Info for the database request
+ * @param fd Pointer to the descriptor of the opened file
+ * @param size Pointer to the size of the file
+ * @param type Pointer to item type to store
+ * @return 0 if successful, error code if not
+ */
+int CSDBAccessManager::openItemFile(const char* dbName, const char* path, request_info_s requestInfo, int* fd, size_t* size, DTYPE* type)
+{
+	CSDB* db;
+	CSDBRuleManager* rm;
+	std::mutex* lock;
+	int err;
+
+	if(!getDBPair(dbName, &db, &rm, &lock)) return ERROR::NO_DB;
+
+	std::lock_guard<std::mutex> guard(*lock);
+
+	if((err = canRead(db, rm, path, requestInfo)) != 0) return err;
 
-	if(!getDBPair(dbName, &db, &rm)) return 0;
+	return db->openItemFile(path, fd, size, type);
+}
 
-	if(!rm->hasPerms(path, requestInfo)) return 0;
 
-	if(!db->itemExists(path)) return 0;
+/**
+ * Check whether an item can be read, by the rules and by the item's own perm status
+ * @param db The database holding the item
+ * @param rm The rule manager for the database
+ * @param path The path of the item
+ * @param requestInfo Info for the database request
+ * @return 0 if the item exists and may be read, PATH_INVAL if it does not
+ * exist, NO_PERMS if it may not be read
+ */
+int CSDBAccessManager::canRead(CSDB* db, CSDBRuleManager* rm, const char* path, request_info_s requestInfo)
+{
+	PERM perm;
+	char nameBuf[NAME_BUF_SIZE];
+
+	requestInfo.perms = "r";
+
+	if(!rm->hasPerms(path, requestInfo)) return ERROR::NO_PERMS;
+
+	if(!db->itemExists(path)) return ERROR::PATH_INVAL;
 
 	// check the perm status of the item, and whether this is the owner
-	if(db->getPerm(path, &perm) != 0) return 0;
+	if(db->getPerm(path, &perm) != 0) return ERROR::PATH_INVAL;
 
 
 	if(perm == PERM::PRIVATE) {
-		if(db->getOwner(path, nameBuf, NAME_BUF_SIZE) != 0) return 0;
+		if(db->getOwner(path, nameBuf, NAME_BUF_SIZE) != 0) return ERROR::NO_PERMS;
 	
-		if(strcmp(requestInfo.uid, nameBuf) != 0) return 0;
+		if(strcmp(requestInfo.uid, nameBuf) != 0) return ERROR::NO_PERMS;
 	}
 
-	return db->getItemData(path, buf, type, bufSize, offset);
+	return 0;
+}
+
+
+/**
+ * Open a temp file to stream the data of an item into, should the user have write permissions
+ * @param dbName The name of the database
+ * @param path The path of the item
+ * @param requestInfo Info for this request
+ * @param fd Pointer to the descriptor of the opened temp file
+ * @param tempPath Buffer to store the temp file path in
+ * @param tempPathSize Size of the temp path buffer
+ * @return 0 if successful, error code if not
+ */
+int CSDBAccessManager::openUpload(const char* dbName, const char* path, request_info_s requestInfo, int* fd, char* tempPath, size_t tempPathSize)
+{
+	CSDB* db;
+	CSDBRuleManager* rm;
+	std::mutex* lock;
+
+	requestInfo.perms = "w";
 
+	if(!getDBPair(dbName, &db, &rm, &lock)) return ERROR::NO_DB;
+
+	std::lock_guard<std::mutex> guard(*lock);
+
+	if(!rm->hasPerms(path, requestInfo)) return ERROR::NO_PERMS;
+
+	return db->openUpload(path, fd, tempPath, tempPathSize);
+}
+
+
+/**
+ * Commit a streamed item opened with openUpload
+ * @param dbName The name of the database
+ * @param path The path of the item
+ * @param requestInfo Info for this request
+ * @param tempPath The temp file the data was streamed into
+ * @param dataSize The size in bytes of the streamed data
+ * @param type The type of the item
+ * @param perm The permission status to give this item
+ * @return 0 if successful, error code if not
+ */
+int CSDBAccessManager::commitUpload(const char* dbName, const char* path, request_info_s requestInfo, const char* tempPath, size_t dataSize, DTYPE type, PERM perm)
+{
+	CSDB* db;
+	CSDBRuleManager* rm;
+	std::mutex* lock;
+
+	requestInfo.perms = "w";
+
+	if(!getDBPair(dbName, &db, &rm, &lock)) return ERROR::NO_DB;
+
+	std::lock_guard<std::mutex> guard(*lock);
+
+	if(!rm->hasPerms(path, requestInfo)) {
+		db->abortUpload(tempPath);
+		return ERROR::NO_PERMS;
+	}
+
+	return db->commitUpload(path, tempPath, dataSize, type, requestInfo.uid, perm);
+}
+
+
+/**
+ * Remove the temp file of an abandoned upload
+ * @param dbName The name of the database
+ * @param tempPath The temp file to remove
+ */
+void CSDBAccessManager::abortUpload(const char* dbName, const char* tempPath)
+{
+	CSDB* db;
+	CSDBRuleManager* rm;
+	std::mutex* lock;
+
+	if(!getDBPair(dbName, &db, &rm, &lock)) return;
+
+	std::lock_guard<std::mutex> guard(*lock);
+
+	db->abortUpload(tempPath);
 }
 
 
@@ -210,10 +355,13 @@ int CSDBAccessManager::deleteItem(const char* dbName, const char* path, request_
 {
 	CSDB* db;
 	CSDBRuleManager* rm;
+	std::mutex* lock;
 
 	requestInfo.perms = "w";
 
-	if(!getDBPair(dbName, &db, &rm)) return ERROR::NO_DB;
+	if(!getDBPair(dbName, &db, &rm, &lock)) return ERROR::NO_DB;
+
+	std::lock_guard<std::mutex> guard(*lock);
 
 	if(!rm->hasPerms(path, requestInfo)) return ERROR::NO_PERMS;
 
@@ -221,6 +369,41 @@ int CSDBAccessManager::deleteItem(const char* dbName, const char* path, request_
 }
 
 
+/**
+ * Apply a batch of item replacements and deletions in one pass, each op is
+ * checked against the rules on its own and ops without write permissions
+ * fail with NO_PERMS, the rest are applied with one manifest write per
+ * collection
+ * @param dbName The name of the database
+ * @param requestInfo Info about this request
+ * @param ops The ops to apply, each one's result is set
+ * @param numOps Number of ops
+ * @return 0 if every op was applied, error code if not
+ */
+int CSDBAccessManager::applyBatch(const char* dbName, request_info_s requestInfo, batch_op_s* ops, size_t numOps)
+{
+	CSDB* db;
+	CSDBRuleManager* rm;
+	std::mutex* lock;
+
+	requestInfo.perms = "w";
+
+	if(!getDBPair(dbName, &db, &rm, &lock)) {
+		for(size_t i = 0; i < numOps; i++) ops[i].result = ERROR::NO_DB;
+		return ERROR::NO_DB;
+	}
+
+	std::lock_guard<std::mutex> guard(*lock);
+
+	for(size_t i = 0; i < numOps; i++)
+	{
+		if(ops[i].result == 0 && !rm->hasPerms(ops[i].path, requestInfo)) ops[i].result = ERROR::NO_PERMS;
+	}
+
+	return db->applyBatch(ops, numOps, requestInfo.uid);
+}
+
+
 /**
  * Returns whether collection exists in the given db
  * @param dbName The name of the database to check
@@ -232,10 +415,13 @@ bool CSDBAccessManager::collectionExists(const char* dbName, const char* path, r
 {
 	CSDB* db;
 	CSDBRuleManager* rm;
+	std::mutex* lock;
 
 	requestInfo.perms = "r";
 
-	if(!getDBPair(dbName, &db, &rm)) return ERROR::NO_DB;
+	if(!getDBPair(dbName, &db, &rm, &lock)) return ERROR::NO_DB;
+
+	std::lock_guard<std::mutex> guard(*lock);
 
 	if(!rm->hasPerms(path, requestInfo)) return ERROR::NO_PERMS;
 
@@ -254,10 +440,13 @@ bool CSDBAccessManager::itemExists(const char* dbName, const char* path, request
 {
 	CSDB* db;
 	CSDBRuleManager* rm;
+	std::mutex* lock;
 
 	requestInfo.perms = "r";
 
-	if(!getDBPair(dbName, &db, &rm)) return ERROR::NO_DB;
+	if(!getDBPair(dbName, &db, &rm, &lock)) return ERROR::NO_DB;
+
+	std::lock_guard<std::mutex> guard(*lock);
 
 	if(!rm->hasPerms(path, requestInfo)) return ERROR::NO_PERMS;
 
@@ -267,18 +456,22 @@ bool CSDBAccessManager::itemExists(const char* dbName, const char* path, request
 
 
 /**
- * Fills the db and rm pointers for the given db name
+ * Fills the db and rm pointers for the given db name, along with the mutex
+ * that serializes requests on that db. Neither CSDB nor the rule manager
+ * lock internally, so it must be held around every use of the pair.
  * @param dbName The name of the database to retrieve
  * @param db Pointer to database pointer to fill
  * @param rm Pointer to rule manager pointer to fill
+ * @param lock Pointer to mutex pointer to fill
  * @return True if successfully filled pointers, false if not
  */
-bool CSDBAccessManager::getDBPair(const char* dbName, CSDB** db, CSDBRuleManager** rm)
+bool CSDBAccessManager::getDBPair(const char* dbName, CSDB** db, CSDBRuleManager** rm, std::mutex** lock)
 {
 	char nameBuf[NAME_BUF_SIZE];
 
 	*db = nullptr;
 	*rm = nullptr;
+	*lock = nullptr;
 
 	for(unsigned long i = 0; i < dbs.size(); i++) 
 	{
@@ -286,6 +479,7 @@ bool CSDBAccessManager::getDBPair(const char* dbName, CSDB** db, CSDBRuleManager
 		if(strcmp(nameBuf, dbName) == 0) {
 			*db = dbs[i];
 			*rm = rms[i];
+			*lock = locks[i];
 			return true;
 		}
 	}
@@ -6,6 +6,7 @@
  * Definition of access manager for Common Sense database
  */
 
+#include <mutex>
 #include <vector>
 
 #include "../definitions.h"
@@ -16,7 +17,8 @@
 
 
 /**
- * CSDBAccessManager class
+ * CSDBAccessManager class, safe to call from any thread. Requests on one
+ * database are serialized by that database's mutex.
  */
 class CSDBAccessManager {
 public:
@@ -33,7 +35,14 @@ public:
 
 	int deleteItem(const char* dbName, const char* path, request_info_s requestInfo);
 
-	size_t getItemData(const char* dbName, const char* path, request_info_s requestInfo, void* buf, DTYPE* type, size_t bufSize, size_t offset = 0);
+	int applyBatch(const char* dbName, request_info_s requestInfo, batch_op_s* ops, size_t numOps);
+
+	int openUpload(const char* dbName, const char* path, request_info_s requestInfo, int* fd, char* tempPath, size_t tempPathSize);
+	int commitUpload(const char* dbName, const char* path, request_info_s requestInfo, const char* tempPath, size_t dataSize, DTYPE type, PERM perm = PERM::PRIVATE);
+	void abortUpload(const char* dbName, const char* tempPath);
+
+	ssize_t getItemData(const char* dbName, const char* path, request_info_s requestInfo, void* buf, DTYPE* type, size_t bufSize, size_t offset = 0);
+	int openItemFile(const char* dbName, const char* path, request_info_s requestInfo, int* fd, size_t* size, DTYPE* type);
 
 	bool collectionExists(const char* dbName, const char* path, request_info_s requestInfo);
 	bool itemExists(const char* dbName, const char* path, request_info_s requestInfo);
@@ -43,5 +52,8 @@ private:
 
 	std::vector<CSDBRuleManager*> rms;
 
-	bool getDBPair(const char* dbName, CSDB** db, CSDBRuleManager** rm);
+	std::vector<std::mutex*> locks;
+
+	bool getDBPair(const char* dbName, CSDB** db, CSDBRuleManager** rm, std::mutex** lock);
+	int canRead(CSDB* db, CSDBRuleManager* rm, const char* path, request_info_s requestInfo);
 };
\ No newline at end of file
@@ -11,8 +11,13 @@
 #define COLLECTIONS_CHILDREN_SIZE 4
 #define COLLECTIONS_ITEMS_SIZE 8
 
+// manifest entries hold the item name, owner uid, perm, type, times and size
+#define MANIFEST_ENTRY_SIZE 512
+#define MANIFEST_ENTRY_FORMAT "%511s"
+
 #define BUF_SIZE 4096
 
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <cstring>
@@ -130,7 +135,7 @@ void CollectionTree::setupCollectionManifest(collection_s* collection)
 {
     int fd, colonIndex;
     FILE* file;
-    char buf[MAX_COLLECTION_NAME_SIZE + COLLECTIONS_ITEMS_SIZE + 2];
+    char buf[MANIFEST_ENTRY_SIZE];
     string manifestName(collection->path);
     manifestName.push_back('/');
     manifestName.append("Manifest");
@@ -155,7 +160,7 @@ void CollectionTree::setupCollectionManifest(collection_s* collection)
         return;
     }
 
-    if(fscanf(file, "%s", buf) < 1) {
+    if(fscanf(file, MANIFEST_ENTRY_FORMAT, buf) < 1) {
         // write size 0 to manifest
         fprintf(file, "size:0 ");
         collection->numItems = 0;
@@ -184,7 +189,7 @@ void CollectionTree::setupCollectionManifest(collection_s* collection)
     // TODO: add items to collection
     for(unsigned long long i = 0; i < collection->numItems; i++)
     {
-        if(fscanf(file, "%s", buf) < 1) {
+        if(fscanf(file, MANIFEST_ENTRY_FORMAT, buf) < 1) {
             // not enough items
             cerr << "Error: Not enough items in manifest at path: " << manifestName << ", buffer: " << buf << endl;
             cerr << "Expected %llu items" << collection->numItems << ", got " <<  i << endl;
@@ -616,12 +621,92 @@ int CollectionTree::replaceItem(const char* path, const char* text, const char*
 int CollectionTree::replaceItem(const char* path, const void* data, size_t dataSize, DTYPE type, const char* owner, PERM perm)
 {
     int ret;
-    Item* item;
     collection_s* parent;
+
+    if((ret = placeItem(path, data, dataSize, type, owner, perm, &parent)) != 0) return ret;
+
+    return updateManifest(parent);
+}
+
+
+/**
+ * Apply a batch of item replacements and deletions. Item files are written
+ * as each op is applied, the manifest of each collection touched is written
+ * once after all of them. Ops are applied in order and independently, ops in
+ * a collection whose manifest could not be written get that error.
+ * @param ops The ops to apply, each one's result is set
+ * @param numOps Number of ops
+ * @param owner The owner of replaced items
+ * @return 0 if every op was applied, error code of the first one that was not
+ */
+int CollectionTree::applyBatch(batch_op_s* ops, size_t numOps, const char* owner)
+{
+    int ret = 0;
+    std::vector<collection_s*> collections(numOps, nullptr);
+    std::vector<collection_s*> touched;
+
+    for(size_t i = 0; i < numOps; i++)
+    {
+        if(ops[i].result != 0) continue;
+
+        switch(ops[i].op) {
+        case BATCH_OP::BATCH_POST:
+            ops[i].result = placeItem(ops[i].path, ops[i].data, ops[i].dataSize, ops[i].type, owner, ops[i].perm, &collections[i]);
+            break;
+        case BATCH_OP::BATCH_DELETE:
+            ops[i].result = removeItem(ops[i].path, &collections[i]);
+            break;
+        default:
+            ops[i].result = ERROR::PARAM_INVAL;
+            break;
+        }
+
+        // an item placed whose file failed to write is still listed
+        if(collections[i] != nullptr && std::find(touched.begin(), touched.end(), collections[i]) == touched.end()) {
+            touched.push_back(collections[i]);
+        }
+    }
+
+    for(collection_s* collection : touched)
+    {
+        int err = updateManifest(collection);
+
+        if(err == 0) continue;
+
+        for(size_t i = 0; i < numOps; i++)
+        {
+            if(collections[i] == collection && ops[i].result == 0) ops[i].result = err;
+        }
+    }
+
+    for(size_t i = 0; i < numOps && ret == 0; i++)
+    {
+        ret = ops[i].result;
+    }
+
+    return ret;
+}
+
+
+/**
+ * Add or replace an item and write its file, without writing the manifest
+ * @param path The path of the item
+ * @param data The buffer for data to store in the item
+ * @param dataSize The size in bytes of the data to store
+ * @param type The type of item
+ * @param owner The owner of the item
+ * @param perm The permission status of this item
+ * @param parent Pointer to the collection the item was placed in
+ * @return 0 if succesfully placed, error code if not
+ */
+int CollectionTree::placeItem(const char* path, const void* data, size_t dataSize, DTYPE type, const char* owner, PERM perm, collection_s** parent)
+{
+    int ret;
+    Item* item;
     const char* name;
     std::string parentPath(path);
 
-    if(!validItemPath(path)) return -1;
+    if(!validItemPath(path)) return ERROR::PATH_INVAL;
 
     name = strrchr(path, '/');
     if(name == nullptr) return ERROR::PATH_INVAL;
@@ -632,28 +717,158 @@ int CollectionTree::replaceItem(const char* path, const void* data, size_t dataS
 
 
     // find parent collection
-    parent = getCollection(parentPath.c_str());
-    if(parent == nullptr) return ERROR::PATH_INVAL;
+    *parent = getCollection(parentPath.c_str());
+    if(*parent == nullptr) return ERROR::PATH_INVAL;
 
-    item = new Item(name, owner, perm, type, parent, data, dataSize);
+    item = new Item(name, owner, perm, type, *parent, data, dataSize);
 
     if((ret = addItemToParent(item)) != 0) {
     	delete item;
         return ret;        
     }
 
-    if((ret = writeItem(item)) != 0) return ret;
+    std::string itemPath((*parent)->path);
+    itemPath.push_back('/');
+    itemPath.append(item->name());
+
+    return item->writeItem(itemPath.c_str());
+}
+
+
+/**
+ * Open a temp file in the parent collection of an item to stream its data into,
+ * the item is only replaced once the upload is committed
+ * @param path The path of the item
+ * @param fd Pointer to the descriptor of the opened temp file
+ * @param tempPath Buffer to store the temp file path in
+ * @param tempPathSize Size of the temp path buffer
+ * @return 0 if successful, error code if not
+ */
+int CollectionTree::openUpload(const char* path, int* fd, char* tempPath, size_t tempPathSize)
+{
+    collection_s* parent;
+    const char* name;
+    std::string parentPath(path);
+
+    if(!validItemPath(path)) return ERROR::PATH_INVAL;
+
+    name = strrchr(path, '/');
+    if(name == nullptr) return ERROR::PATH_INVAL;
+
+    parentPath = parentPath.substr(0, name - path);
+
+    name++;
+
+    parent = getCollection(parentPath.c_str());
+    if(parent == nullptr) return ERROR::PATH_INVAL;
+
+    // '#' is not a valid path character, so temp files never collide with items
+    std::string tempString(parent->path);
+    tempString.push_back('/');
+    tempString.append(name);
+    tempString.append("#XXXXXX");
+
+    if(tempString.length() >= tempPathSize) return ERROR::PATH_INVAL;
+
+    strncpy(tempPath, tempString.c_str(), tempPathSize);
+
+    if((*fd = mkstemp(tempPath)) < 0) return ERROR::FILE_OPEN;
 
     return 0;
 }
 
 
+/**
+ * Commit a streamed item, moving its temp file into place and replacing the item
+ * @param path The path of the item
+ * @param tempPath The temp file the data was streamed into
+ * @param dataSize The size in bytes of the streamed data
+ * @param type The type of item
+ * @param owner The owner of the item
+ * @param perm The permission status of this item
+ * @return 0 if successfully committed, error code if not, the temp file is removed either way
+ */
+int CollectionTree::commitUpload(const char* path, const char* tempPath, size_t dataSize, DTYPE type, const char* owner, PERM perm)
+{
+    int ret;
+    Item* item;
+    collection_s* parent;
+    const char* name;
+    std::string parentPath(path);
+
+    if(!validItemPath(path)) {
+        abortUpload(tempPath);
+        return ERROR::PATH_INVAL;
+    }
+
+    name = strrchr(path, '/');
+    parentPath = parentPath.substr(0, name - path);
+
+    name++;
+
+    parent = getCollection(parentPath.c_str());
+    if(parent == nullptr) {
+        abortUpload(tempPath);
+        return ERROR::PATH_INVAL;
+    }
+
+    std::string itemPath(parent->path);
+    itemPath.push_back('/');
+    itemPath.append(name);
+
+    // readers see either the old data or the new, never a partial file
+    if(rename(tempPath, itemPath.c_str()) != 0) {
+        abortUpload(tempPath);
+        return ERROR::FILE_WRITE;
+    }
+
+    // data stays on disk until it is read
+    item = new Item(name, owner, perm, type, parent, dataSize);
+
+    if((ret = addItemToParent(item)) != 0) {
+        delete item;
+        return ret;
+    }
+
+    return updateManifest(parent);
+}
+
+
+/**
+ * Remove the temp file of an upload that will not be committed
+ * @param tempPath The temp file to remove
+ */
+void CollectionTree::abortUpload(const char* tempPath)
+{
+    unlink(tempPath);
+}
+
+
 /**
  * Delete the item at the given path
  * @param path The path of the item
  * @return 0 if successfully deleted, error code if not
  */
 int CollectionTree::deleteItem(const char* path)
+{
+    int ret;
+    collection_s* collection;
+
+    if((ret = removeItem(path, &collection)) != 0) return ret;
+
+    updateManifest(collection);
+
+    return 0;
+}
+
+
+/**
+ * Remove the item at the given path and its file, without writing the manifest
+ * @param path The path of the item
+ * @param parent Pointer to the collection the item was removed from
+ * @return 0 if successfully removed, error code if not
+ */
+int CollectionTree::removeItem(const char* path, collection_s** parent)
 {
     if(!validItemPath(path)) return ERROR::PATH_INVAL;
 
@@ -709,8 +924,7 @@ int CollectionTree::deleteItem(const char* path)
 
     delete item;
 
-    updateManifest(collection);
-
+    *parent = collection;
 
     return 0;
 }
@@ -807,23 +1021,27 @@ int CollectionTree::getPerm(const char* path, PERM* permPointer)
  * @param type Pointer to item type, filled with the type of the returned item data
  * @param bufSize The maximum size to write to the buffer
  * @param offset The offset to open the file with
- * @return The number of bytes written
+ * @return The number of bytes written, 0 past the end of the item, negative error code if unsuccessful
  */
-size_t CollectionTree::getItemData(const char* path, void* returnBuffer, DTYPE* type, size_t bufSize, size_t offset)
+ssize_t CollectionTree::getItemData(const char* path, void* returnBuffer, DTYPE* type, size_t bufSize, size_t offset)
 {
     Item* item;
     char* buf = (char*)returnBuffer;
     char* itemData;
+    int err;
 
-    if(!validItemPath(path)) return 0;
+    if(!validItemPath(path)) return -ERROR::PATH_INVAL;
 
     // get the item
     item = getItem(path);
 
-    if(item == nullptr) return 0;
+    if(item == nullptr) return -ERROR::PATH_INVAL;
 
     // load item into memory
-    if(!item->loaded() && loadItem(item) != 0) return 0;
+    if(!item->loaded() && (err = loadItem(item)) != 0) return -err;
+
+    // set even for an empty item
+    *type = item->type();
 
     if(offset >= item->dataSize()) return 0;
 
@@ -835,11 +1053,50 @@ size_t CollectionTree::getItemData(const char* path, void* returnBuffer, DTYPE*
         buf[i-offset] = itemData[i];
     }
 
+    return i-offset;
+}
+
+/**
+ * Open the file backing an item, for sending it without loading it into memory
+ * @param path The path of the item
+ * @param fd Pointer to the descriptor of the opened file
+ * @param size Pointer to the size of the file
+ * @param type Pointer to item type, filled with the type of the item
+ * @return 0 if successful, error code if not
+ */
+int CollectionTree::openItemFile(const char* path, int* fd, size_t* size, DTYPE* type)
+{
+    Item* item;
+    collection_s* collection;
+    struct stat fileStat;
+
+    if(!validItemPath(path)) return ERROR::PATH_INVAL;
+
+    item = getItem(path);
+
+    if(item == nullptr) return ERROR::PATH_INVAL;
+
+    collection = (collection_s*)item->collection();
+
+    std::string itemPath(collection->path);
+    itemPath.push_back('/');
+    itemPath.append(item->name());
+
+    if((*fd = open(itemPath.c_str(), O_RDONLY)) < 0) return ERROR::FILE_OPEN;
+
+    // a replaced item is renamed over the old file, this descriptor keeps the old data
+    if(fstat(*fd, &fileStat) != 0) {
+        close(*fd);
+        return ERROR::FILE_READ;
+    }
+
+    *size = fileStat.st_size;
     *type = item->type();
 
-    return offset-i;
+    return 0;
 }
 
+
 /**
  * Load item data from file structure into memory
  * @param item Item to load
@@ -47,10 +47,19 @@ public:
 
     int deleteItem(const char* path);
 
+    // replacements and deletions sharing one manifest write per collection
+    int applyBatch(batch_op_s* ops, size_t numOps, const char* owner = nullptr);
+
+    // streamed items, written to a temp file then committed in one rename
+    int openUpload(const char* path, int* fd, char* tempPath, size_t tempPathSize);
+    int commitUpload(const char* path, const char* tempPath, size_t dataSize, DTYPE type, const char* owner = nullptr, PERM perm = PERM::PRIVATE);
+    void abortUpload(const char* tempPath);
+
     int getOwner(const char* path, void* buf, size_t bufSize);
     int getPerm(const char* path, PERM* permPointer);
 
-    size_t getItemData(const char* path, void* returnBuffer, DTYPE* type, size_t bufSize, size_t offset = 0);
+    ssize_t getItemData(const char* path, void* returnBuffer, DTYPE* type, size_t bufSize, size_t offset = 0);
+    int openItemFile(const char* path, int* fd, size_t* size, DTYPE* type);
 
 
     int loadItem(Item* item);
@@ -72,6 +81,8 @@ private:
 
     int addItemToParent(Item* item);
     int writeItem(Item* item);
+    int placeItem(const char* path, const void* data, size_t dataSize, DTYPE type, const char* owner, PERM perm, collection_s** parent);
+    int removeItem(const char* path, collection_s** parent);
     int updateManifest(collection_s* collection);
 
     // recursive helpers
@@ -6,6 +6,8 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <limits.h>
 
 #include "../CSDB/CSDB.h"
 #include "../CSDB/CSDBRuleManager.h"
@@ -28,6 +30,8 @@ int itemDeletionTests();
 int itemExistanceTests2();
 int textItemRetrievalTests();
 int ownerAndPermsTests();
+int uploadTests();
+int batchTests();
 
 
 int ruleLoadTests();
@@ -83,6 +87,12 @@ int main()
     printf("Item ownership and permissions tests: ");
     printResult(stdout, ownerAndPermsTests());
 
+    printf("Streamed item upload tests: ");
+    printResult(stdout, uploadTests());
+
+    printf("Batch tests: ");
+    printResult(stdout, batchTests());
+
     printf("------------- End CSDB Tests -------------\n");
 
     
@@ -232,22 +242,113 @@ int itemExistanceTests2()
 
 int textItemRetrievalTests()
 {
-    size_t ret;
+    ssize_t ret;
     DTYPE type;
     char buf[BUF_SIZE];
 
-    if((ret = db.getItemData("test1/item2", buf, &type, BUF_SIZE)) == 0) return -1;
+    if((ret = db.getItemData("test1/item2", buf, &type, BUF_SIZE)) <= 0) return -1;
     if(strcmp("A basic text item", buf) != 0) return -10;
     
-    if((ret = db.getItemData("test3/item2", buf, &type, BUF_SIZE)) == 0) return -2;
+    if((ret = db.getItemData("test3/item2", buf, &type, BUF_SIZE)) <= 0) return -2;
     if(strcmp("A basic text item", buf) != 0) return -11;
 
-    if((ret = db.getItemData("test3/item3", buf, &type, BUF_SIZE)) == 0) return -3;
+    if((ret = db.getItemData("test3/item3", buf, &type, BUF_SIZE)) <= 0) return -3;
     if(strcmp("A basic text item", buf) != 0) return -12;
 
     return 0;
 }
 
+int uploadTests()
+{
+    int ret, fd;
+    DTYPE type;
+    char tempPath[PATH_MAX];
+    char buf[BUF_SIZE];
+    const char* data = "Streamed item data";
+
+    // left over from an earlier run
+    db.deleteItem("test1/item5");
+
+    if((ret = db.openUpload("test1/item5", &fd, tempPath, PATH_MAX)) != 0) return ret;
+    if(write(fd, data, strlen(data)) != (ssize_t)strlen(data)) return -1;
+    close(fd);
+
+    // not visible until committed
+    if(db.itemExists("test1/item5")) return -2;
+
+    if((ret = db.commitUpload("test1/item5", tempPath, strlen(data), DTYPE::VIDEO)) != 0) return ret;
+    if(access(tempPath, F_OK) == 0) return -3;
+
+    if(db.getItemData("test1/item5", buf, &type, BUF_SIZE) != (ssize_t)strlen(data)) return -4;
+    if(type != DTYPE::VIDEO || memcmp(buf, data, strlen(data)) != 0) return -5;
+
+    // media can be sent straight from its file
+    size_t size;
+    if((ret = db.openItemFile("test1/item5", &fd, &size, &type)) != 0) return ret;
+    close(fd);
+    if(size != strlen(data) || type != DTYPE::VIDEO) return -9;
+
+    // an aborted upload leaves nothing behind
+    if((ret = db.openUpload("test1/item6", &fd, tempPath, PATH_MAX)) != 0) return ret;
+    close(fd);
+    db.abortUpload(tempPath);
+
+    if(access(tempPath, F_OK) == 0) return -6;
+    if(db.itemExists("test1/item6")) return -7;
+
+    if(db.openUpload("test9/item1", &fd, tempPath, PATH_MAX) == 0) return -8;
+
+    // an empty item reads as no data, not as a failure
+    db.deleteItem("test1/item7");
+
+    if((ret = db.openUpload("test1/item7", &fd, tempPath, PATH_MAX)) != 0) return ret;
+    close(fd);
+    if((ret = db.commitUpload("test1/item7", tempPath, 0, DTYPE::IMAGE)) != 0) return ret;
+
+    type = DTYPE::NONE;
+    if(db.getItemData("test1/item7", buf, &type, BUF_SIZE) != 0 || type != DTYPE::IMAGE) return -10;
+    if(db.getItemData("test1/missing", buf, &type, BUF_SIZE) != -ERROR::PATH_INVAL) return -11;
+
+    db.deleteItem("test1/item7");
+
+    return 0;
+}
+
+
+int batchTests()
+{
+    DTYPE type;
+    char buf[BUF_SIZE];
+    batch_op_s ops[4] = {};
+
+    db.replaceItem("test1/item7", "Deleted by the batch");
+
+    ops[0] = { BATCH_OP::BATCH_POST, "test1/item8", "First batched item", 19, DTYPE::TEXT, PERM::PUBLIC, 0 };
+    ops[1] = { BATCH_OP::BATCH_POST, "test3/item8", "Second batched item", 20, DTYPE::TEXT, PERM::PRIVATE, 0 };
+    ops[2] = { BATCH_OP::BATCH_DELETE, "test1/item7", nullptr, 0, DTYPE::NONE, PERM::PRIVATE, 0 };
+    ops[3] = { BATCH_OP::BATCH_POST, "test9/item1", "No such collection", 19, DTYPE::TEXT, PERM::PRIVATE, 0 };
+
+    // applied independently, the failed op does not undo the others
+    if(db.applyBatch(ops, 4) != ERROR::PATH_INVAL) return -1;
+    if(ops[0].result != 0 || ops[1].result != 0 || ops[2].result != 0) return -2;
+    if(ops[3].result != ERROR::PATH_INVAL) return -3;
+
+    if(db.getItemData("test1/item8", buf, &type, BUF_SIZE) != 19 || strcmp(buf, "First batched item") != 0) return -4;
+    if(db.getItemData("test3/item8", buf, &type, BUF_SIZE) != 20 || strcmp(buf, "Second batched item") != 0) return -5;
+    if(db.itemExists("test1/item7")) return -6;
+
+    // the manifests written once at the end list the batch's items
+    FILE* manifest = fopen("db/test1/Manifest", "r");
+    if(manifest == nullptr) return -7;
+    size_t size = fread(buf, 1, BUF_SIZE - 1, manifest);
+    fclose(manifest);
+    buf[size] = 0;
+    if(strstr(buf, " item8:") == nullptr || strstr(buf, " item7:") != nullptr) return -8;
+
+    return 0;
+}
+
+
 int ownerAndPermsTests()
 {
     int ret;
@@ -379,19 +480,22 @@ int accessManagerItemRetrievalTests()
     request_info_s requestInfo;
     requestInfo.uid = "myuid";
 
-    if(accessManager.getItemData("db1", "users/myuid/text1", requestInfo, buf, &type, BUF_SIZE) == 0) return -1;
+    if(accessManager.getItemData("db1", "users/myuid/text1", requestInfo, buf, &type, BUF_SIZE) <= 0) return -1;
     if(strcmp(buf, "A basic text item") != 0) return -10;
 
-    if(accessManager.getItemData("db2", "users/myuid/text2", requestInfo, buf, &type, BUF_SIZE) == 0) return -2;
+    if(accessManager.getItemData("db2", "users/myuid/text2", requestInfo, buf, &type, BUF_SIZE) <= 0) return -2;
     if(strcmp(buf, "A basic text item") != 0) return -20;
 
-    if(accessManager.getItemData("db1", "users/myuid/text3", requestInfo, buf, &type, BUF_SIZE) == 0) return -3;
+    if(accessManager.getItemData("db1", "users/myuid/text3", requestInfo, buf, &type, BUF_SIZE) <= 0) return -3;
     if(strcmp(buf, "A basic text item") != 0) return -30;
 
+    // failures carry their error code
+    if(accessManager.getItemData("db1", "users/myuid/missing", requestInfo, buf, &type, BUF_SIZE) != -ERROR::PATH_INVAL) return -5;
+
     // rule test
     requestInfo.uid = "notmyuid";
 
-    if(accessManager.getItemData("db1", "users/myuid/text1", requestInfo, buf, &type, BUF_SIZE) == 0) return -4;
+    if(accessManager.getItemData("db1", "users/myuid/text1", requestInfo, buf, &type, BUF_SIZE) <= 0) return -4;
     if(strcmp(buf, "A basic text item") != 0) return -40;
 
     return 0;
@@ -421,4 +525,4 @@ void printResult(FILE* file, int result)
     }
 
     fprintf(file, "FAILURE: %d\n", result);
-}
\ No newline at end of file
+}
@@ -9,61 +9,317 @@
 
 #define DEFAULT_DB "db"
 
+#define DEFAULT_BACKLOG SOMAXCONN
+
+#define SESSION_ID_CONTEXT "CSServer"
+#define SESSION_CACHE_SIZE 65536
+#define SESSION_TIMEOUT 86400
+#define NUM_SESSION_TICKETS 2
+
+#define MAX_REJECTING 256
+#define MAX_ADOPT_PER_TURN 64
+
+// edge triggered while parsing, level triggered output only while a GET streams
+#define CLIENT_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+#define STREAM_EVENTS (EPOLLOUT)
+
 #include <err.h>
 #include <pthread.h>
 #include <unistd.h>
 
 #include <thread>
-#include <iostream>
+#include <chrono>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cmath>
+#include <ctime>
 #include <memory>
 
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
+#include <openssl/crypto.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
 
+#include <zlib.h>
 
 #include "CSServer.h"
 #include "definitions.h"
+#include "dictionary.h"
 
 using namespace std;
 
 
+/**
+ * Monotonic clock reading in nanoseconds
+ * @return Current monotonic time
+ */
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/**
+ * Monotonic clock reading in milliseconds, the resolution of deadlines
+ * @return Current monotonic time
+ */
+static uint64_t nowMs()
+{
+    return nowNs() / 1000000;
+}
+
+
+/**
+ * Inflater of the calling thread, created on first use and reset after every body
+ * @return The calling thread's inflater, null if zlib could not allocate it
+ */
+static z_stream* threadInflater()
+{
+    thread_local z_stream* stream = nullptr;
+
+    if(stream != nullptr) return stream;
+
+    stream = (z_stream*) calloc (1, sizeof(z_stream));
+
+    if(inflateInit(stream) != Z_OK) {
+        free(stream);
+        stream = nullptr;
+    }
+
+    return stream;
+}
+
+
+/**
+ * Whether records on a connection are encrypted by the kernel
+ * @param ssl The connection's ssl
+ * @return True if kernel TLS handles sending, false if OpenSSL does
+ */
+static bool ktlsSend(SSL* ssl)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+    (void)ssl;
+    return false;
+#endif
+}
+
+
+/**
+ * Fill in the address of a unix socket
+ * @param path Path of the socket
+ * @param addr Address to fill in
+ * @return 0 if successful, -1 if the path is too long
+ */
+static int unixAddress(const char* path, struct sockaddr_un* addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if(strlen(path) >= sizeof(addr->sun_path)) return -1;
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+
+/**
+ * Pass descriptors over a unix socket
+ * @param sock Connected unix socket
+ * @param fds Descriptors to pass
+ * @param numFds Number of descriptors, at most MAX_HANDOFF_FDS
+ * @return 0 if sent, -1 if not
+ */
+static int sendFds(int sock, const int* fds, int numFds)
+{
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_FDS)];
+        struct cmsghdr align;
+    } control;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+
+    // descriptors ride along with a single byte of data
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * numFds);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * numFds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * numFds);
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+
+/**
+ * Receive descriptors passed over a unix socket
+ * @param sock Connected unix socket
+ * @param fds Container for the descriptors, MAX_HANDOFF_FDS long
+ * @return Number of descriptors received, -1 if none could be
+ */
+static int recvFds(int sock, int* fds)
+{
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_FDS)];
+        struct cmsghdr align;
+    } control;
+
+    memset(&msg, 0, sizeof(msg));
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) return -1;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) return -1;
+
+    int numFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * numFds);
+
+    return numFds;
+}
+
+
 /**
  * Constructor for Common Sense Social server, starts main 
  * server loop.
- * @param numThreads Number of threads in the thread pool
+ * @param options Thread, queue and listener settings for this server
  */
-CSServer::CSServer(int numThreads) :
-    _numThreads(numThreads), 
+CSServer::CSServer(server_options_s options) :
+    _numThreads(options.numThreads), 
+    _maxConnections(options.maxConnections),
+    _reusePort(options.reusePort),
+    _ktls(options.ktls),
     _port(DEFAULT_PORT),
     _shouldExit(false),
-    _threadPool(nullptr)
+    _threadPool(nullptr),
+    _pending(options.queueDepth),
+    _queueStats(),
+    _tlsStats(),
+    _outputStats(),
+    _timeoutStats(),
+    _compressionStats(),
+    _localPath(options.localPath),
+    _localSock(-1),
+    _numAdminUids(options.numAdminUids),
+    _statsPath(options.statsPath),
+    _statsSock(-1),
+    _handoffPath(options.handoffPath),
+    _handoffSock(-1),
+    _handedOff(false),
+    _argv(options.argv),
+    _listenSock(-1),
+    _signalFd(-1),
+    _draining(false),
+    _drainDeadline(0),
+    _liveThreads(options.numThreads),
+    _numTaskThreads(options.numTaskThreads),
+    _tasks(DEFAULT_TASK_QUEUE_DEPTH),
+    _tasksInFlight(0),
+    _nextSweepMs(0),
+    _persistStopped(false)
 {
+    memcpy(_adminUids, options.adminUids, sizeof(_adminUids));
+
+    _sm.setLimits(options.sessionTtl, options.maxSessions);
+    _sm.setSnapshotPath(options.sessionPath);
+
+    for(int i = 0; i < NUM_RATE_CLASSES; i++) {
+        _limiter.setLimit((RATE_CLASS)i, options.rateLimits[i].rate, options.rateLimits[i].burst);
+    }
 
-    if(sem_init(&_mutex, 0, 0) != 0) err(2, "sem_init for main mutex");
+    struct epoll_event event;
+    long numCores = sysconf(_SC_NPROCESSORS_ONLN);
 
+    // signalled whenever a connection is queued for the workers
+    if((_pendingEvent = eventfd(0, EFD_NONBLOCK)) < 0) err(2, "eventfd for pending queue");
+
+    if((_acceptor.epfd = epoll_create1(0)) < 0) err(2, "epoll_create1 for acceptor");
+    _acceptor.numConnections = 0;
+    _acceptor.listenSock = -1;
+    _acceptor.connections = nullptr;
+    _acceptor.core = -1;
+    _acceptor.completions = nullptr;
+    _acceptor.completionEvent = -1;
+    _acceptor.timers = new TimerWheel(nowMs());
+
+    // each task is one count, so a read wakes exactly one task thread
+    if((_taskEvent = eventfd(0, EFD_SEMAPHORE)) < 0) err(2, "eventfd for task pool");
 
     // initialize the thread pool
     _threadPool = (Thread*) malloc (sizeof(Thread) * _numThreads);
 
     for(int i = 0; i < _numThreads; i++) {
-        // init mutex for each, set client to 0
+        // each worker runs its own reactor
         Thread* t = _threadPool + i;
 
-        if(sem_init(&(t->mutex), 0, 0) != 0) err(2, "sem_init for thread");
+        if((t->epfd = epoll_create1(0)) < 0) err(2, "epoll_create1 for thread");
+
+        t->numConnections = 0;
+        t->listenSock = -1;
+        t->connections = nullptr;
+        t->core = (options.pinThreads && numCores > 0) ? i % numCores : -1;
+        t->timers = new TimerWheel(nowMs());
+
+        // deep enough for every task in flight, so completing never blocks
+        t->completions = new BoundedQueue<Task*>(_tasks.capacity());
+        if((t->completionEvent = eventfd(0, EFD_NONBLOCK)) < 0) err(2, "eventfd for task completions");
 
-        t->cl = 0;
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = &t->completionEvent;
+        if(epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->completionEvent, &event) != 0) err(2, "epoll_ctl for task completions");
+
+        // sharded workers accept tcp clients for themselves, listeners are added
+        // at startup, but still take local clients from the queue.
+        // Only one worker is woken per signal
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = &_pendingEvent;
+        if(epoll_ctl(t->epfd, EPOLL_CTL_ADD, _pendingEvent, &event) != 0) err(2, "epoll_ctl for pending queue");
 
         // start up this thread
         new std::thread(&CSServer::start, this, t);
     }
 
+    for(int i = 0; i < _numTaskThreads; i++) {
+        new std::thread(&CSServer::runTasks, this, nullptr);
+    }
+
     request_info_t requestInfo;
     requestInfo.uid = nullptr;
     requestInfo.perms = "rw";
@@ -80,7 +336,15 @@ CSServer::CSServer(int numThreads) :
  */
 CSServer::~CSServer()
 {
-    if(_threadPool != nullptr) free(_threadPool);
+    if(_threadPool != nullptr) {
+        for(int i = 0; i < _numThreads; i++) {
+            delete _threadPool[i].completions;
+            delete _threadPool[i].timers;
+        }
+        free(_threadPool);
+    }
+
+    delete _acceptor.timers;
 }
 
 
@@ -90,570 +354,3679 @@ CSServer::~CSServer()
  */
 void CSServer::startup()
 {
-    int sock;
+    int fds[MAX_HANDOFF_FDS];
+    int numFds;
+    size_t numRestored;
+    sigset_t signals;
+    struct epoll_event event;
+    struct epoll_event events[MAX_EVENTS];
 
     initOpenSSL();
 
     // create and configure ssl context
     _ctx = createContext();
     configureContext(_ctx);
-    
-    // set up port
-    struct hostent *hent = gethostbyname(DEFAULT_SERVER_NAME);
-    struct sockaddr_in addr;
 
-    // set server settings
-    memcpy(&addr.sin_addr.s_addr, hent->h_addr, hent->h_length);
-    addr.sin_port = htons(_port);
-    addr.sin_family = AF_INET;
+    // a running server hands over its listeners instead of new ones being bound
+    numFds = takeListeners(fds);
 
-    // create socket
-    sock = socket(AF_INET, SOCK_STREAM, 0);
+    // a predecessor snapshots its sessions before saying the listeners are
+    // ours, they are back before any listener is served
+    if((numRestored = _sm.restore(_numThreads)) > 0) LOG_INFO("Restored %lu sessions", numRestored);
+    if(_sm.snapshot() != 0) LOG_WARN("Could not write session snapshot");
 
+    // the periodic flushes and snapshots wait on the disk, not the acceptor
+    new std::thread(&CSServer::persistSessions, this, nullptr);
 
-    int enable = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
-    bind(sock, (struct sockaddr *)&addr, sizeof(addr));
-
-    while(!_shouldExit) {
-        // listen on socket for new clients
-        listen(sock, 0);
-        int cl = accept(sock, NULL, NULL);
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = nullptr;
 
-        // look for available thread
+    if(_reusePort) {
+        // one listener per worker, the kernel spreads connections between them
         for(int i = 0; i < _numThreads; i++) {
             Thread* t = _threadPool + i;
 
-            if(t->cl == 0) {
-                // found available thread, set client and start
-                t->cl = cl;
-                if(sem_post(&(t->mutex)) != 0) err(2, "sem_post starting worker thread");
-                break;
+            t->listenSock = i < numFds ? fds[i] : createListener(true);
+            if(epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->listenSock, &event) != 0) err(2, "epoll_ctl for shard listener");
+        }
+
+        for(int i = _numThreads; i < numFds; i++) close(fds[i]);
+    } else {
+        _listenSock = numFds > 0 ? fds[0] : createListener(false);
+        if(epoll_ctl(_acceptor.epfd, EPOLL_CTL_ADD, _listenSock, &event) != 0) err(2, "epoll_ctl for listener");
+
+        for(int i = 1; i < numFds; i++) close(fds[i]);
+    }
+
+    if(numFds > 0) LOG_INFO("Took over %d listeners", numFds);
+
+    if(_localPath != nullptr) {
+        _localSock = createUnixListener(_localPath, LOCAL_SOCKET_MODE);
+
+        event.data.ptr = &_localSock;
+        if(epoll_ctl(_acceptor.epfd, EPOLL_CTL_ADD, _localSock, &event) != 0) err(2, "epoll_ctl for local listener");
+    }
+
+    if(_statsPath != nullptr) {
+        _statsSock = createUnixListener(_statsPath, 0600);
+
+        event.data.ptr = &_statsSock;
+        if(epoll_ctl(_acceptor.epfd, EPOLL_CTL_ADD, _statsSock, &event) != 0) err(2, "epoll_ctl for stats listener");
+    }
+
+    if(_handoffPath != nullptr) {
+        _handoffSock = createUnixListener(_handoffPath, 0600);
+
+        event.data.ptr = &_handoffSock;
+        if(epoll_ctl(_acceptor.epfd, EPOLL_CTL_ADD, _handoffSock, &event) != 0) err(2, "epoll_ctl for handoff listener");
+    }
+
+    // blocked by main before any thread started, so they only arrive here
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGCHLD);
+
+    if((_signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) err(2, "signalfd");
+
+    event.data.ptr = &_signalFd;
+    if(epoll_ctl(_acceptor.epfd, EPOLL_CTL_ADD, _signalFd, &event) != 0) err(2, "epoll_ctl for signals");
+
+    while(!_shouldExit) {
+        int numEvents = epoll_wait(_acceptor.epfd, events, MAX_EVENTS, pollTimeout(&_acceptor));
+
+        if(numEvents < 0) {
+            if(errno == EINTR) continue;
+            err(2, "epoll_wait on listener");
+        }
+
+        for(int i = 0; i < numEvents; i++) {
+            // edge triggered, accept everything that is pending
+            if(events[i].data.ptr == nullptr) {
+                if(_listenSock >= 0) acceptClients(_listenSock, nullptr);
+                continue;
+            }
+
+            if(events[i].data.ptr == &_localSock) {
+                acceptLocalClients();
+                continue;
+            }
+
+            if(events[i].data.ptr == &_statsSock) {
+                serveStats();
+                continue;
+            }
+
+            if(events[i].data.ptr == &_handoffSock) {
+                handOff();
+                continue;
+            }
+
+            if(events[i].data.ptr == &_signalFd) {
+                handleSignals();
+                continue;
             }
+
+            serviceConnection(&_acceptor, (Connection*)events[i].data.ptr, events[i].events);
+        }
+
+        expireDeadlines(&_acceptor);
+
+        // expired sessions are hidden from lookups, sweeping a few shards a tick frees their slots
+        if(nowMs() >= _nextSweepMs) {
+            _sm.sweep();
+            _nextSweepMs = nowMs() + SESSION_SWEEP_MS;
+        }
+
+        // done once every worker has closed its last connection
+        if(_draining.load(memory_order_relaxed)) {
+            drainThread(&_acceptor);
+            if(_acceptor.numConnections == 0 && _liveThreads.load(memory_order_acquire) == 0) _shouldExit = true;
         }
     }
 
     // cleanup on server close
-    close(sock);
+    LOG_INFO("Drained, exiting");
+    if(!_handedOff) finalSnapshot();
+    Logger::flush();
+    dumpStats(stdout);
+    close(_acceptor.epfd);
+    close(_signalFd);
+    if(_statsSock >= 0) {
+        close(_statsSock);
+        // after a handoff the path belongs to the successor
+        if(!_handedOff) unlink(_statsPath);
+    }
     SSL_CTX_free(_ctx);
     cleanupOpenSSL();
 }
 
+
+/**
+ * Create a non-blocking listening socket on the server port
+ * @param reusePort Whether to bind with SO_REUSEPORT so several sockets share the port
+ * @return The listening socket
+ */
+int CSServer::createListener(bool reusePort)
+{
+    int sock;
+    int enable = 1;
+
+    // set up port
+    struct hostent *hent = gethostbyname(DEFAULT_SERVER_NAME);
+    struct sockaddr_in addr;
+
+    // set server settings
+    memcpy(&addr.sin_addr.s_addr, hent->h_addr, hent->h_length);
+    addr.sin_port = htons(_port);
+    addr.sin_family = AF_INET;
+
+    // create non-blocking socket, accepts are driven by readiness
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if(reusePort && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0) err(2, "SO_REUSEPORT");
+
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) err(2, "bind");
+    if(listen(sock, DEFAULT_BACKLOG) != 0) err(2, "listen");
+
+    return sock;
+}
+
+
 /**
- * OpenSSL initialization step
+ * Create a non-blocking unix socket for the local, stats and handoff endpoints
+ * @param path Path to bind, replacing whatever is there
+ * @param mode Permissions of the socket file, who may connect
+ * @return The listening socket
  */
-void CSServer::initOpenSSL()
+int CSServer::createUnixListener(const char* path, mode_t mode)
 {
-    SSL_load_error_strings();
-    OpenSSL_add_ssl_algorithms();
+    int sock;
+    struct sockaddr_un addr;
+
+    if(unixAddress(path, &addr) != 0) errx(2, "socket path too long: %s", path);
+
+    // left behind by an earlier run, or still bound by the server being replaced
+    unlink(path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(sock < 0) err(2, "socket for %s", path);
+
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) err(2, "bind %s", path);
+    if(chmod(path, mode) != 0) err(2, "chmod %s", path);
+    if(listen(sock, DEFAULT_BACKLOG) != 0) err(2, "listen on %s", path);
+
+    return sock;
 }
 
+
 /**
- * OpenSSL cleanup step
+ * Write the current stats to every pending stats client and hang up
  */
-void CSServer::cleanupOpenSSL()
+void CSServer::serveStats()
 {
-    EVP_cleanup();
+    char* text;
+    size_t size, sent;
+    ssize_t ret;
+    FILE* file;
+    struct timeval timeout = { STATS_SEND_TIMEOUT_S, 0 };
+
+    while(true) {
+        int cl = accept4(_statsSock, NULL, NULL, SOCK_CLOEXEC);
+
+        if(cl < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4 on stats socket");
+            return;
+        }
+
+        // a client that stops reading cannot hold up the acceptor for long
+        setsockopt(cl, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        text = nullptr;
+        size = 0;
+
+        if((file = open_memstream(&text, &size)) != nullptr) {
+            dumpStats(file);
+            fclose(file);
+
+            for(sent = 0; sent < size; sent += ret) {
+                ret = write(cl, text + sent, size - sent);
+                if(ret < 0 && errno == EINTR) ret = 0;
+                else if(ret <= 0) break;
+            }
+        }
+
+        free(text);
+        close(cl);
+    }
 }
 
+
 /**
- * Create SSL context
- * @return A new SSL context
+ * Take the listeners of a running server through the handoff socket. They
+ * are acknowledged as soon as they arrive, the predecessor then stops
+ * accepting, snapshots its sessions and says so. A predecessor that gives
+ * up before that is still serving, so this server exits.
+ * @param fds Container for the listeners, MAX_HANDOFF_FDS long
+ * @return Number of listeners taken, 0 for a cold start
  */
-SSL_CTX* CSServer::createContext()
+int CSServer::takeListeners(int* fds)
 {
-    const SSL_METHOD *method;
-    SSL_CTX* ctx;
+    int sock, numFds;
+    char ack = 0;
+    struct sockaddr_un addr;
+    struct timeval timeout = { HANDOFF_TIMEOUT_S, 0 };
+    struct timeval noTimeout = { 0, 0 };
 
-    method = SSLv23_server_method();
+    if(_handoffPath == nullptr || unixAddress(_handoffPath, &addr) != 0) return 0;
 
-    ctx = SSL_CTX_new(method);
-    if (!ctx) {
-	perror("Unable to create SSL context");
-	ERR_print_errors_fp(stderr);
-	exit(EXIT_FAILURE);
+    if((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) err(2, "socket for handoff");
+
+    // nothing is listening, no server to replace
+    if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return 0;
     }
 
-    return ctx;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if((numFds = recvFds(sock, fds)) <= 0) {
+        LOG_WARN("Handoff from running server failed, binding new listeners");
+        close(sock);
+        return 0;
+    }
+
+    if(write(sock, &ack, 1) != 1) err(2, "write handoff ack");
+
+    // once acknowledged the predecessor drains, however long its snapshot
+    // takes, and closes the socket if it gave up on the handoff instead
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &noTimeout, sizeof(noTimeout));
+
+    if(read(sock, &ack, 1) != 1) {
+        Logger::flush();
+        errx(2, "Running server abandoned the handoff, it is still serving");
+    }
+
+    close(sock);
+
+    return numFds;
 }
 
+
 /**
- * Configure SSL context
- * @param ctx Pointer to SSL context to configure
+ * Pass the listeners to a replacement server connecting on the handoff socket,
+ * then drain once it acknowledges them. The sessions are snapshotted once
+ * this server has stopped accepting, the replacement restores them before
+ * serving the listeners. A replacement that does not acknowledge in time has
+ * the socket closed on it, which makes it exit, so only one server ever
+ * serves the listeners.
  */
-void CSServer::configureContext(SSL_CTX *ctx)
+void CSServer::handOff()
 {
-    SSL_CTX_set_ecdh_auto(ctx, 1);
+    int fds[MAX_HANDOFF_FDS];
+    int numFds = 0;
+    char ack;
+    struct timeval timeout = { HANDOFF_TIMEOUT_S, 0 };
+
+    while(_handoffSock >= 0) {
+        int cl = accept4(_handoffSock, NULL, NULL, SOCK_CLOEXEC);
+
+        if(cl < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4 on handoff socket");
+            return;
+        }
 
-    /* Set the key and cert */
-    if (SSL_CTX_use_certificate_file(ctx, "sslcerts/certchain.pem", SSL_FILETYPE_PEM) <= 0) {
-        ERR_print_errors_fp(stderr);
-	    exit(EXIT_FAILURE);
+        // a replacement that stalls cannot hold up the acceptor for long
+        setsockopt(cl, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(cl, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        numFds = 0;
+        if(_listenSock >= 0) fds[numFds++] = _listenSock;
+
+        for(int i = 0; i < _numThreads && numFds < MAX_HANDOFF_FDS; i++) {
+            if(_threadPool[i].listenSock >= 0) fds[numFds++] = _threadPool[i].listenSock;
+        }
+
+        if(numFds == 0 || sendFds(cl, fds, numFds) != 0 || read(cl, &ack, 1) != 1) {
+            LOG_WARN("Handoff to replacement server failed, still serving");
+            close(cl);
+            continue;
+        }
+
+        LOG_INFO("Handed %d listeners to replacement server", numFds);
+
+        _handedOff = true;
+        startDrain();
+
+        // nothing is accepted anymore, so no session is created after this
+        // but on connections already open
+        finalSnapshot();
+
+        if(write(cl, &ack, 1) != 1) perror("write handoff snapshot notice");
+
+        close(cl);
     }
+}
 
-    if (SSL_CTX_use_PrivateKey_file(ctx, "sslcerts/key.pem", SSL_FILETYPE_PEM) <= 0 ) {
-        ERR_print_errors_fp(stderr);
-	    exit(EXIT_FAILURE);
+
+/**
+ * Session persister thread, appends session changes to the delta every
+ * SESSION_FLUSH_MS and snapshots the whole table every SESSION_SNAPSHOT_MS,
+ * until a final snapshot stops it
+ * @param arg Unused
+ */
+void* CSServer::persistSessions(void* arg)
+{
+    uint64_t nextSnapshotMs = nowMs() + SESSION_SNAPSHOT_MS;
+
+    (void)arg;
+
+    while(true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(SESSION_FLUSH_MS));
+
+        std::lock_guard<std::mutex> lock(_persistMutex);
+
+        if(_persistStopped) break;
+
+        if(nowMs() >= nextSnapshotMs) {
+            if(_sm.snapshot() != 0) LOG_WARN("Could not write session snapshot");
+            nextSnapshotMs = nowMs() + SESSION_SNAPSHOT_MS;
+        } else if(_sm.flushChanges() != 0) {
+            LOG_WARN("Could not write session changes");
+        }
     }
+
+    return 0;
 }
 
 
+/**
+ * Write the last session snapshot inline, once the persister is done with
+ * any write it had started, and stop it. After a handoff the session files
+ * belong to the successor, so nothing is written after this.
+ */
+void CSServer::finalSnapshot()
+{
+    std::lock_guard<std::mutex> lock(_persistMutex);
+
+    if(_persistStopped) return;
+    _persistStopped = true;
+
+    if(_sm.snapshot() != 0) LOG_WARN("Could not write session snapshot");
+}
+
 
 /**
- * Function for starting thread, waits on semaphore before client is accepted
- * @param arg Thread struct argument expected
+ * Handle signals queued on the signal descriptor. SIGTERM and SIGINT drain
+ * the server, a second one closes what is left at once. SIGUSR2 starts a
+ * replacement that takes over the listeners.
  */
-void* CSServer::start(void* arg)
+void CSServer::handleSignals()
 {
-    Thread* thread = (Thread*)arg;
+    struct signalfd_siginfo info;
+
+    while(read(_signalFd, &info, sizeof(info)) == sizeof(info)) {
+        switch(info.ssi_signo) {
+        case SIGUSR2:
+            restart();
+            break;
+        case SIGCHLD:
+            // reap a replacement that failed to start
+            while(waitpid(-1, nullptr, WNOHANG) > 0);
+            break;
+        default:
+            if(_draining.load(memory_order_relaxed)) _drainDeadline.store(0, memory_order_relaxed);
+            startDrain();
+            break;
+        }
+    }
+}
+
+
+/**
+ * Start a new copy of the server from the same command line, it takes over
+ * the listeners through the handoff socket and this server drains
+ */
+void CSServer::restart()
+{
+    pid_t pid;
+
+    if(_handoffSock < 0 || _argv == nullptr) {
+        LOG_WARN("Ignoring restart, no handoff socket to pass the listeners through");
+        return;
+    }
+
+    if((pid = fork()) < 0) {
+        perror("fork replacement server");
+        return;
+    }
+
+    if(pid == 0) {
+        // only async signal safe calls until exec, other threads' locks may be held
+        close_range(3, ~0U, 0);
+        execvp(_argv[0], _argv);
+        _exit(127);
+    }
+
+    LOG_INFO("Started replacement server %d", pid);
+}
+
+
+/**
+ * Stop accepting and have every reactor close its connections as they go
+ * idle. Called on the acceptor.
+ */
+void CSServer::startDrain()
+{
+    uint64_t signal = 1;
+
+    if(_handoffSock >= 0) {
+        close(_handoffSock);
+        _handoffSock = -1;
+        if(!_handedOff) unlink(_handoffPath);
+    }
+
+    if(_draining.load(memory_order_relaxed)) return;
+
+    LOG_INFO("Draining connections");
+
+    // whatever already reached the backlog is still served
+    if(_listenSock >= 0) {
+        acceptClients(_listenSock, nullptr);
+        epoll_ctl(_acceptor.epfd, EPOLL_CTL_DEL, _listenSock, nullptr);
+        close(_listenSock);
+        _listenSock = -1;
+    }
+
+    // a replacement binds the path again, it is only removed when none takes over
+    if(_localSock >= 0) {
+        acceptLocalClients();
+        epoll_ctl(_acceptor.epfd, EPOLL_CTL_DEL, _localSock, nullptr);
+        close(_localSock);
+        _localSock = -1;
+        if(!_handedOff) unlink(_localPath);
+    }
+
+    _drainDeadline.store(nowMs() + DRAIN_TIMEOUT_MS, memory_order_relaxed);
+    _draining.store(true, memory_order_release);
+
+    // the completion event doubles as a doorbell, each worker wakes to start draining
+    for(int i = 0; i < _numThreads; i++) {
+        if(write(_threadPool[i].completionEvent, &signal, sizeof(signal)) < 0) perror("write to task completion event");
+    }
+}
+
+
+/**
+ * Close a draining reactor's listener and every connection that is idle,
+ * or every connection once DRAIN_TIMEOUT_MS has passed
+ * @param thread The draining reactor
+ * @return True once the reactor has nothing left to serve
+ */
+bool CSServer::drainThread(Thread* thread)
+{
+    Connection* conn;
+    Connection* next;
+    bool expired = nowMs() >= _drainDeadline.load(memory_order_relaxed);
+
+    if(thread->listenSock >= 0) {
+        acceptClients(thread->listenSock, thread);
+        epoll_ctl(thread->epfd, EPOLL_CTL_DEL, thread->listenSock, nullptr);
+        close(thread->listenSock);
+        thread->listenSock = -1;
+    }
+
+    for(conn = thread->connections; conn != nullptr; conn = next) {
+        next = conn->next;
+
+        if(expired) LOG_WARN("Client %d still busy after draining, closing", conn->cl);
+        if(expired || idleClient(conn)) closeClient(thread, conn);
+    }
+
+    return thread->numConnections == 0 && _tasksInFlight.load(memory_order_relaxed) == 0 && _pending.size() == 0;
+}
+
+
+/**
+ * Whether a connection can be closed without cutting off a request: its
+ * handshake is done, no frame is part way in, nothing runs for it and every
+ * reply has been written
+ * @param conn The connection to check
+ * @return True if idle
+ */
+bool CSServer::idleClient(Connection* conn)
+{
+    return conn->state == CONN_STATE::ACTIVE && conn->inLen == 0 && !conn->handler
+           && conn->stream == nullptr && conn->upload == nullptr
+           && conn->inFlight == 0 && conn->deferred == nullptr && conn->outLen == 0;
+}
+
+
+/**
+ * Epoll timeout for a reactor, shortened while draining so idle connections
+ * are noticed, and on the acceptor so sessions are swept
+ * @param thread The reactor about to wait
+ * @return Timeout in milliseconds, -1 to wait indefinitely
+ */
+int CSServer::pollTimeout(Thread* thread)
+{
+    int timeout = thread->timers->timeout();
+
+    if(_draining.load(memory_order_relaxed) && (timeout < 0 || timeout > DRAIN_POLL_MS)) timeout = DRAIN_POLL_MS;
+
+    // the acceptor wakes to sweep sessions
+    if(thread == &_acceptor && (timeout < 0 || timeout > SESSION_SWEEP_MS)) timeout = SESSION_SWEEP_MS;
+
+    return timeout;
+}
+
+
+/**
+ * Accept clients from the listening socket until none are pending
+ * @param sock Non-blocking listening socket
+ * @param shard Worker that owns this listener in sharded mode, null to use the pending queue
+ */
+void CSServer::acceptClients(int sock, Thread* shard)
+{
+    while(true) {
+        int cl = accept4(sock, NULL, NULL, SOCK_NONBLOCK);
+
+        if(cl < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4");
+            return;
+        }
+
+        Connection* conn = createConnection(cl, false);
+
+        if(shard == nullptr) {
+            dispatchClient(conn);
+            continue;
+        }
+
+        // sharded worker keeps its own clients, over capacity they are only told busy
+
+        if(shard->numConnections >= _maxConnections) {
+            _queueStats.rejected.fetch_add(1, memory_order_relaxed);
+            conn->rejected = true;
+
+            if(shard->numConnections >= _maxConnections + MAX_REJECTING) {
+                freeClient(conn);
+                continue;
+            }
+        }
+
+        attachClient(shard, conn);
+    }
+}
+
+
+/**
+ * Accept clients from the local socket until none are pending. Their peer
+ * credentials decide whether requests run as admin.
+ */
+void CSServer::acceptLocalClients()
+{
+    struct ucred cred;
+    socklen_t credLen;
+    Connection* conn;
+
+    while(true) {
+        int cl = accept4(_localSock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if(cl < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4 on local socket");
+            return;
+        }
+
+        conn = createConnection(cl, true);
+
+        credLen = sizeof(cred);
+        if(getsockopt(cl, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) == 0) {
+            for(int i = 0; i < _numAdminUids; i++) {
+                if(_adminUids[i] == cred.uid) conn->isAdmin = true;
+            }
+
+            LOG_INFO("Handling local client: %d, pid %d uid %d%s", cl, (int)cred.pid, (int)cred.uid, conn->isAdmin ? " (admin)" : "");
+        } else {
+            perror("SO_PEERCRED");
+        }
+
+        _queueStats.local.fetch_add(1, memory_order_relaxed);
+
+        dispatchClient(conn);
+    }
+}
+
+
+/**
+ * Create connection state for a new client
+ * @param cl Accepted non-blocking client descriptor
+ * @param local Whether the client came in on the local socket, which skips TLS
+ * @return The new connection, ready for the TLS handshake or active if local
+ */
+Connection* CSServer::createConnection(int cl, bool local)
+{
+    Connection* conn;
+    int enable = 1;
+
+    conn = (Connection*) calloc (1, sizeof(Connection));
+    conn->cl = cl;
+    conn->queuedAt = nowNs();
+    conn->version = PROTOCOL::PROTOCOL_V1;
+
+    // trusted and on the same host, frames are exchanged in the clear
+    if(local) {
+        conn->state = CONN_STATE::ACTIVE;
+        return conn;
+    }
+
+    // replies are coalesced before writing, so nagle would only add delay
+    if(setsockopt(cl, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) != 0) perror("TCP_NODELAY");
+
+    conn->state = CONN_STATE::HANDSHAKE;
+
+    conn->ssl = SSL_new(_ctx);
+    SSL_set_fd(conn->ssl, cl);
+    SSL_set_mode(conn->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    return conn;
+}
+
+
+/**
+ * Register a connection with a reactor
+ * @param thread The reactor taking the connection
+ * @param conn The connection to register
+ * @return 0 if registered, -1 if the connection was closed instead
+ */
+int CSServer::attachClient(Thread* thread, Connection* conn)
+{
+    struct epoll_event event;
+
+    event.events = CLIENT_EVENTS;
+    event.data.ptr = conn;
+    conn->thread = thread;
+
+    if(epoll_ctl(thread->epfd, EPOLL_CTL_ADD, conn->cl, &event) != 0) {
+        perror("epoll_ctl adding client");
+        freeClient(conn);
+        return -1;
+    }
+
+    thread->numConnections++;
+
+    conn->prev = nullptr;
+    conn->next = thread->connections;
+    if(conn->next != nullptr) conn->next->prev = conn;
+    thread->connections = conn;
+
+    conn->timer.data = conn;
+
+    // local clients have no handshake, they start out idle
+    if(conn->state == CONN_STATE::ACTIVE) {
+        conn->deadline = DEADLINE::IDLE_DEADLINE;
+        conn->lastActive = nowMs();
+        thread->timers->arm(&conn->timer, conn->lastActive + IDLE_TIMEOUT_MS);
+        return 0;
+    }
+
+    // a client that never finishes its handshake is dropped
+    conn->deadline = DEADLINE::HANDSHAKE_DEADLINE;
+    thread->timers->arm(&conn->timer, nowMs() + HANDSHAKE_TIMEOUT_MS);
+
+    return 0;
+}
+
+
+/**
+ * Queue a new client for the workers, turning it away with a busy code if
+ * the queue is full
+ * @param conn The new client's connection
+ */
+void CSServer::dispatchClient(Connection* conn)
+{
+    uint64_t depth, maxDepth;
+    uint64_t signal = 1;
+
+    if(!_pending.push(conn)) {
+        rejectClient(conn);
+        return;
+    }
+
+    _queueStats.enqueued.fetch_add(1, memory_order_relaxed);
+
+    depth = _pending.size();
+    maxDepth = _queueStats.maxDepth.load(memory_order_relaxed);
+    while(depth > maxDepth && !_queueStats.maxDepth.compare_exchange_weak(maxDepth, depth, memory_order_relaxed));
+
+    if(write(_pendingEvent, &signal, sizeof(signal)) < 0 && errno != EAGAIN) perror("write to pending queue event");
+}
+
+
+/**
+ * Serve a connection from the acceptor reactor only long enough to answer
+ * its first command with a busy code
+ * @param conn Connection that could not be queued
+ */
+void CSServer::rejectClient(Connection* conn)
+{
+    _queueStats.rejected.fetch_add(1, memory_order_relaxed);
+
+    conn->rejected = true;
+
+    // past this point even answering is too expensive, drop the client
+    if(_acceptor.numConnections >= MAX_REJECTING) {
+        freeClient(conn);
+        return;
+    }
+
+    attachClient(&_acceptor, conn);
+}
+
+
+/**
+ * Take queued connections into a worker reactor while it has capacity
+ * @param thread The worker taking the connections
+ */
+void CSServer::adoptClients(Thread* thread)
+{
+    Connection* conn;
+    uint64_t waitNs, maxWaitNs;
+    uint64_t signal = 1;
+    int adopted = 0;
+
+    while(thread->numConnections < _maxConnections && adopted < MAX_ADOPT_PER_TURN) {
+        if(!_pending.pop(&conn)) return;
+
+        waitNs = nowNs() - conn->queuedAt;
+        _queueStats.dequeued.fetch_add(1, memory_order_relaxed);
+        _queueStats.totalWaitNs.fetch_add(waitNs, memory_order_relaxed);
+
+        maxWaitNs = _queueStats.maxWaitNs.load(memory_order_relaxed);
+        while(waitNs > maxWaitNs && !_queueStats.maxWaitNs.compare_exchange_weak(maxWaitNs, waitNs, memory_order_relaxed));
+
+        attachClient(thread, conn);
+        adopted++;
+    }
+
+    // leave the rest for another worker
+    if(_pending.size() > 0 && write(_pendingEvent, &signal, sizeof(signal)) < 0 && errno != EAGAIN) {
+        perror("write to pending queue event");
+    }
+}
+
+
+/**
+ * Print the pending queue counters
+ * @param file File to print to
+ */
+void CSServer::dumpQueueStats(FILE* file)
+{
+    uint64_t dequeued = _queueStats.dequeued.load(memory_order_relaxed);
+    uint64_t totalWaitNs = _queueStats.totalWaitNs.load(memory_order_relaxed);
+
+    fprintf(file, "queue depth:%zu capacity:%zu max_depth:%lu enqueued:%lu dequeued:%lu rejected:%lu local:%lu avg_wait_us:%lu max_wait_us:%lu\n",
+            _pending.size(),
+            _pending.capacity(),
+            _queueStats.maxDepth.load(memory_order_relaxed),
+            _queueStats.enqueued.load(memory_order_relaxed),
+            dequeued,
+            _queueStats.rejected.load(memory_order_relaxed),
+            _queueStats.local.load(memory_order_relaxed),
+            dequeued ? totalWaitNs / dequeued / 1000 : 0,
+            _queueStats.maxWaitNs.load(memory_order_relaxed) / 1000);
+}
+
+
+/**
+ * Print every server counter and the request metrics
+ * @param file File to print to
+ */
+void CSServer::dumpStats(FILE* file)
+{
+    dumpQueueStats(file);
+    dumpTlsStats(file);
+    dumpOutputStats(file);
+    dumpTimeoutStats(file);
+    dumpCompressionStats(file);
+    _sm.dump(file);
+    Metrics::dump(file);
+}
+
+
+/**
+ * OpenSSL initialization step
+ */
+void CSServer::initOpenSSL()
+{
+    SSL_load_error_strings();
+    OpenSSL_add_ssl_algorithms();
+}
+
+/**
+ * OpenSSL cleanup step
+ */
+void CSServer::cleanupOpenSSL()
+{
+    EVP_cleanup();
+}
+
+/**
+ * Create SSL context
+ * @return A new SSL context
+ */
+SSL_CTX* CSServer::createContext()
+{
+    const SSL_METHOD *method;
+    SSL_CTX* ctx;
+
+    method = SSLv23_server_method();
+
+    ctx = SSL_CTX_new(method);
+    if (!ctx) {
+	perror("Unable to create SSL context");
+	ERR_print_errors_fp(stderr);
+	exit(EXIT_FAILURE);
+    }
+
+    return ctx;
+}
+
+/**
+ * Configure SSL context
+ * @param ctx Pointer to SSL context to configure
+ */
+void CSServer::configureContext(SSL_CTX *ctx)
+{
+    SSL_CTX_set_ecdh_auto(ctx, 1);
+
+    // pull as many records per socket read as are available
+    SSL_CTX_set_read_ahead(ctx, 1);
+
+    // kernel TLS lets item files go out with sendfile straight from the page cache
+#ifdef SSL_OP_ENABLE_KTLS
+    if(_ktls) SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+    if(_ktls) LOG_WARN("Kernel TLS is not supported by this OpenSSL build, sending items from user space");
+#endif
+
+    /* Set the key and cert */
+    if (SSL_CTX_use_certificate_file(ctx, "sslcerts/certchain.pem", SSL_FILETYPE_PEM) <= 0) {
+        ERR_print_errors_fp(stderr);
+	    exit(EXIT_FAILURE);
+    }
+
+    if (SSL_CTX_use_PrivateKey_file(ctx, "sslcerts/key.pem", SSL_FILETYPE_PEM) <= 0 ) {
+        ERR_print_errors_fp(stderr);
+	    exit(EXIT_FAILURE);
+    }
+
+    configureSessionResumption(ctx);
+}
+
+
+/**
+ * Enable session resumption, a server side session cache for TLS 1.2 session ids
+ * and rotating ticket keys for TLS 1.2 tickets and TLS 1.3 PSK resumption
+ * @param ctx Pointer to SSL context to configure
+ */
+void CSServer::configureSessionResumption(SSL_CTX* ctx)
+{
+    // the ticket callback finds the key ring through the context
+    SSL_CTX_set_app_data(ctx, this);
+
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char*)SESSION_ID_CONTEXT, strlen(SESSION_ID_CONTEXT));
+    SSL_CTX_sess_set_cache_size(ctx, SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, SESSION_TIMEOUT);
+
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+    SSL_CTX_set_num_tickets(ctx, NUM_SESSION_TICKETS);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, &CSServer::ticketKeyCallback);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, &CSServer::ticketKeyCallback);
+#endif
+}
+
+
+/**
+ * Session ticket key callback, encrypts new tickets with the current key and
+ * decrypts presented tickets with whichever ring key issued them
+ * @param ssl Connection the ticket belongs to
+ * @param keyName Ticket key name, filled when encrypting and read when decrypting
+ * @param iv Initialization vector, filled when encrypting
+ * @param cipherCtx Cipher context to initialize
+ * @param macCtx Mac context to initialize
+ * @param enc 1 when issuing a ticket, 0 when checking one
+ * @return 1 if the ticket key is usable, 2 if the client should be reissued a ticket, 0 if unknown, -1 on error
+ */
+int CSServer::ticketKeyCallback(SSL* ssl, unsigned char* keyName, unsigned char* iv,
+                                EVP_CIPHER_CTX* cipherCtx, ticket_mac_ctx* macCtx, int enc)
+{
+    unsigned char aesKey[TICKET_AES_KEY_SIZE];
+    unsigned char hmacKey[TICKET_HMAC_KEY_SIZE];
+    bool renew = false;
+    int ret = 1;
+
+    CSServer* server = (CSServer*)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+
+    if(enc) {
+        if(server->_ticketKeys.encryptionKey(keyName, aesKey, hmacKey) != 0) return -1;
+        if(RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) ret = -1;
+        else if(EVP_EncryptInit_ex(cipherCtx, EVP_aes_256_cbc(), NULL, aesKey, iv) != 1) ret = -1;
+    } else {
+        // unknown or expired key, fall back to a full handshake
+        if(server->_ticketKeys.decryptionKey(keyName, aesKey, hmacKey, &renew) != 0) return 0;
+        if(EVP_DecryptInit_ex(cipherCtx, EVP_aes_256_cbc(), NULL, aesKey, iv) != 1) ret = -1;
+        else if(renew) ret = 2;
+    }
+
+    if(ret != -1) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        OSSL_PARAM params[3];
+        params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, hmacKey, TICKET_HMAC_KEY_SIZE);
+        params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char*)"SHA256", 0);
+        params[2] = OSSL_PARAM_construct_end();
+
+        if(EVP_MAC_CTX_set_params(macCtx, params) != 1) ret = -1;
+#else
+        if(HMAC_Init_ex(macCtx, hmacKey, TICKET_HMAC_KEY_SIZE, EVP_sha256(), NULL) != 1) ret = -1;
+#endif
+    }
+
+    // the contexts hold their own copies, do not leave the keys on the stack
+    OPENSSL_cleanse(aesKey, sizeof(aesKey));
+    OPENSSL_cleanse(hmacKey, sizeof(hmacKey));
+
+    return ret;
+}
+
+
+/**
+ * Print the TLS handshake counters
+ * @param file File to print to
+ */
+void CSServer::dumpTlsStats(FILE* file)
+{
+    fprintf(file, "tls full_handshakes:%lu resumed_handshakes:%lu failed_handshakes:%lu ktls_send:%lu cached_sessions:%ld\n",
+            _tlsStats.fullHandshakes.load(memory_order_relaxed),
+            _tlsStats.resumedHandshakes.load(memory_order_relaxed),
+            _tlsStats.failedHandshakes.load(memory_order_relaxed),
+            _tlsStats.ktlsSend.load(memory_order_relaxed),
+            SSL_CTX_sess_number(_ctx));
+}
+
+
+
+/**
+ * Worker reactor loop, services readiness events for the connections assigned to it
+ * @param arg Thread struct argument expected
+ */
+void* CSServer::start(void* arg)
+{
+    Thread* thread = (Thread*)arg;
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t signal;
+    cpu_set_t cpus;
+
+    if(thread->core >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(thread->core, &cpus);
+        if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) perror("pthread_setaffinity_np");
+    }
+
+    while(true) {
+        int numEvents = epoll_wait(thread->epfd, events, MAX_EVENTS, pollTimeout(thread));
+
+        if(numEvents < 0) {
+            if(errno == EINTR) continue;
+            err(2, "epoll_wait on thread");
+        }
+
+        for(int i = 0; i < numEvents; i++) {
+            // tagged requests finished on the task pool
+            if(events[i].data.ptr == &thread->completionEvent) {
+                if(read(thread->completionEvent, &signal, sizeof(signal)) < 0 && errno != EAGAIN) perror("read task completion event");
+                completeTasks(thread);
+                continue;
+            }
+
+            // own listener in sharded mode
+            if(events[i].data.ptr == nullptr) {
+                if(thread->listenSock >= 0) acceptClients(thread->listenSock, thread);
+                continue;
+            }
+
+            // pending queue signalled, take what fits
+            if(events[i].data.ptr == &_pendingEvent) {
+                if(read(_pendingEvent, &signal, sizeof(signal)) < 0 && errno != EAGAIN) perror("read pending queue event");
+                adoptClients(thread);
+                continue;
+            }
+
+            serviceConnection(thread, (Connection*)events[i].data.ptr, events[i].events);
+        }
+
+        expireDeadlines(thread);
+
+        if(_draining.load(memory_order_acquire) && drainThread(thread)) break;
+    }
+
+    _liveThreads.fetch_sub(1, memory_order_release);
+
+    return 0;
+}
+
+
+/**
+ * Handle readiness events for a single connection
+ * @param thread The reactor owning this connection
+ * @param conn The connection that became ready
+ * @param events The epoll events reported for it
+ */
+void CSServer::serviceConnection(Thread* thread, Connection* conn, uint32_t events)
+{
+    if(events & EPOLLERR) {
+        closeClient(thread, conn);
+        return;
+    }
+
+    // pending output goes out first once the socket drains
+    if((events & EPOLLOUT) && conn->outLen > 0 && flushOutput(conn) != 0) {
+        closeClient(thread, conn);
+        return;
+    }
+
+    int ret = handleClient(conn) != 0 || pumpStream(conn) != 0 || drainInput(thread, conn) != 0 ? -1 : 0;
+
+    // replies staged while running frames go out together, once per turn
+    if(flushOutput(conn) != 0) ret = -1;
+
+    if(ret != 0) {
+        closeClient(thread, conn);
+        return;
+    }
+
+    updateDeadline(thread, conn);
+}
+
+
+/**
+ * Choose the deadline for a connection after it has been serviced. A frame
+ * has to arrive in full within READ_TIMEOUT_MS however slowly its bytes
+ * trickle in, otherwise the connection only has to show some activity every
+ * IDLE_TIMEOUT_MS. Streams and uploads count as activity as they progress.
+ * @param thread The reactor owning this connection
+ * @param conn The connection that was serviced
+ */
+void CSServer::updateDeadline(Thread* thread, Connection* conn)
+{
+    uint64_t now = nowMs();
+
+    conn->lastActive = now;
+
+    // handshake deadline stands until the handshake is done
+    if(conn->state != CONN_STATE::ACTIVE) return;
+
+    if((conn->inLen > 0 || conn->handler) && conn->stream == nullptr && conn->upload == nullptr) {
+        // armed once when the frame starts, trickling bytes do not extend it
+        if(conn->deadline != DEADLINE::READ_DEADLINE) {
+            conn->deadline = DEADLINE::READ_DEADLINE;
+            thread->timers->arm(&conn->timer, now + READ_TIMEOUT_MS);
+        }
+        return;
+    }
+
+    // activity is only recorded, the idle deadline is pushed back when it fires
+    if(conn->deadline != DEADLINE::IDLE_DEADLINE) {
+        conn->deadline = DEADLINE::IDLE_DEADLINE;
+        thread->timers->arm(&conn->timer, now + IDLE_TIMEOUT_MS);
+    }
+}
+
+
+/**
+ * Close every connection on a reactor whose deadline has passed
+ * @param thread The reactor to check
+ */
+void CSServer::expireDeadlines(Thread* thread)
+{
+    timer_entry_s* timer;
+    Connection* conn;
+    uint64_t now = nowMs();
+
+    while((timer = thread->timers->expire(now)) != nullptr) {
+        conn = (Connection*)timer->data;
+
+        switch(conn->deadline) {
+        case DEADLINE::IDLE_DEADLINE:
+            if(conn->lastActive + IDLE_TIMEOUT_MS > now) {
+                thread->timers->arm(timer, conn->lastActive + IDLE_TIMEOUT_MS);
+                continue;
+            }
+            _timeoutStats.idles.fetch_add(1, memory_order_relaxed);
+            break;
+        case DEADLINE::READ_DEADLINE:
+            _timeoutStats.reads.fetch_add(1, memory_order_relaxed);
+            break;
+        default:
+            _timeoutStats.handshakes.fetch_add(1, memory_order_relaxed);
+            break;
+        }
+
+        LOG_INFO("Client %d timed out", conn->cl);
+        closeClient(thread, conn);
+    }
+}
+
+
+/**
+ * Print the counters for connections closed by a deadline
+ * @param file File to print to
+ */
+void CSServer::dumpTimeoutStats(FILE* file)
+{
+    fprintf(file, "timeouts handshake:%lu read:%lu idle:%lu\n",
+            _timeoutStats.handshakes.load(memory_order_relaxed),
+            _timeoutStats.reads.load(memory_order_relaxed),
+            _timeoutStats.idles.load(memory_order_relaxed));
+}
+
+
+/**
+ * Advance the TLS state machine for a client, called on every readiness event
+ * @param conn The connection to advance
+ * @return 0 if the connection should stay open, -1 if it should be closed
+ */
+int CSServer::handleClient(Connection* conn)
+{
+    int ret;
+
+    if(conn->state != CONN_STATE::HANDSHAKE) return 0;
+
+    if((ret = SSL_accept(conn->ssl)) == 1) {
+        conn->state = CONN_STATE::ACTIVE;
+
+        if(SSL_session_reused(conn->ssl)) {
+            _tlsStats.resumedHandshakes.fetch_add(1, memory_order_relaxed);
+        } else {
+            _tlsStats.fullHandshakes.fetch_add(1, memory_order_relaxed);
+        }
+
+        if(ktlsSend(conn->ssl)) _tlsStats.ktlsSend.fetch_add(1, memory_order_relaxed);
+
+        LOG_INFO("Handling client: %d, SSL accepted%s", conn->cl, SSL_session_reused(conn->ssl) ? " (resumed)" : "");
+        return 0;
+    }
+
+    switch(SSL_get_error(conn->ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        // handshake resumes on the next readiness event
+        return 0;
+    default:
+        _tlsStats.failedHandshakes.fetch_add(1, memory_order_relaxed);
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+}
+
+
+/**
+ * Read every available TLS record for a client and run complete frames. Reads
+ * land in the thread buffer and frames are parsed where they lie, only a
+ * trailing partial frame is copied into a buffer owned by the connection.
+ * @param thread The worker thread owning this connection
+ * @param conn The connection to read from
+ * @return 0 if the connection should stay open, -1 if it should be closed
+ */
+int CSServer::drainInput(Thread* thread, Connection* conn)
+{
+    int bytesRead, ret;
+    char* dest;
+    size_t space;
+
+    if(conn->state != CONN_STATE::ACTIVE || conn->stream != nullptr) return 0;
+
+    // frames held back while a GET was streaming, or a handler waiting for the
+    // socket to drain
+    if(conn->inLen > 0 || conn->handler) {
+        ret = runFrames(conn);
+        retainInput(conn);
+
+        if(ret != 0) return -1;
+    }
+
+    // edge triggered, so read until the socket and ssl buffers are empty, until
+    // a GET stream holds back further frames, or until output backs up
+    while(conn->state == CONN_STATE::ACTIVE && conn->stream == nullptr && conn->outLen <= OUTPUT_HIGH_WATER) {
+        if(conn->inLen > 0) {
+            // partial frame held over, read straight in behind it
+            if(reserveInput(conn, SSL3_RT_MAX_PLAIN_LENGTH) != 0) return -1;
+            dest = conn->inBuf + conn->inLen;
+            space = conn->inCap - conn->inLen;
+        } else {
+            dest = thread->threadBuf;
+            space = THREAD_BUF_SIZE;
+        }
+
+        bytesRead = readClient(conn, dest, space);
+
+        if(bytesRead == 0) return 0;
+
+        if(bytesRead < 0) {
+            // clean shutdown or error
+            LOG_INFO("Client %d exited", conn->cl);
+            return -1;
+        }
+
+        if(conn->inLen == 0) {
+            // borrow the thread buffer, nothing to copy
+            conn->inBuf = thread->threadBuf;
+            conn->inCap = 0;
+        }
+
+        conn->inLen += bytesRead;
+
+        ret = runFrames(conn);
+        retainInput(conn);
+
+        if(ret != 0) return -1;
+    }
+
+    return conn->state == CONN_STATE::ACTIVE ? 0 : -1;
+}
+
+
+/**
+ * Parse and handle each complete frame in the input buffer, an incomplete
+ * frame is left in place, or its handler suspended, to resume once more
+ * bytes arrive
+ * @param conn The connection to run frames for
+ * @return 0 if every complete frame was handled, -1 if an invalid frame was received
+ */
+int CSServer::runFrames(Connection* conn)
+{
+    int ret;
+
+    while(conn->state == CONN_STATE::ACTIVE && conn->stream == nullptr) {
+        // a suspended handler continues its frame before anything else is parsed
+        if(conn->handler) {
+            if(!Handler::resume(conn->handler)) return 0;
+
+            ret = conn->handler.promise().result;
+            conn->handler.destroy();
+            conn->handler = nullptr;
+
+            if(ret != 0) {
+                LOG_WARN("Received invalid message from client");
+                return -1;
+            }
+
+            finishCommand(conn);
+            LOG_DEBUG("Handled command: 0x%x", conn->full_command & 0xF00F);
+            continue;
+        }
+
+        if(conn->inPos >= conn->inLen) break;
+
+        // data of a streamed post goes to disk as it arrives
+        if(conn->upload != nullptr) {
+            consumeUpload(conn);
+            continue;
+        }
+
+        size_t frameStart = conn->inPos;
+        ret = parseMessage(conn);
+
+        if(ret == INCOMPLETE_FRAME) {
+            conn->inPos = frameStart;
+            return 0;
+        }
+
+        conn->admitted = false;
+
+        if(ret != 0) {
+            LOG_WARN("Received invalid message from client");
+            return -1;
+        }
+
+        if(!conn->handler) LOG_DEBUG("Handled command: 0x%x", conn->full_command & 0xF00F);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Make room in the connection's own input buffer
+ * @param conn The connection holding a partial frame
+ * @param space Number of free bytes wanted after the buffered input
+ * @return 0 if successful, -1 if the frame would exceed MAX_INPUT_BUF_SIZE
+ */
+int CSServer::reserveInput(Connection* conn, size_t space)
+{
+    size_t newCap;
+    char* newBuf;
+
+    if(conn->inCap - conn->inLen >= space) return 0;
+
+    if(conn->inLen >= MAX_INPUT_BUF_SIZE) return -1;
+
+    newCap = conn->inCap ? conn->inCap : DEFAULT_BUF_SIZE;
+    while(newCap < conn->inLen + space) newCap *= 2;
+    if(newCap > MAX_INPUT_BUF_SIZE) newCap = MAX_INPUT_BUF_SIZE;
+
+    if((newBuf = (char*) realloc (conn->inBuf, newCap)) == nullptr) return -1;
+
+    conn->inBuf = newBuf;
+    conn->inCap = newCap;
+
+    return 0;
+}
+
+
+/**
+ * Drop parsed bytes and keep any partial frame, copying it out of the thread
+ * buffer if borrowed. Idle connections hold no buffer.
+ * @param conn The connection to compact
+ */
+void CSServer::retainInput(Connection* conn)
+{
+    size_t remaining = conn->inLen - conn->inPos;
+    bool borrowed = conn->inCap == 0;
+
+    if(remaining == 0) {
+        if(!borrowed) free(conn->inBuf);
+        conn->inBuf = nullptr;
+        conn->inLen = conn->inPos = conn->inCap = 0;
+        return;
+    }
+
+    if(borrowed) {
+        const char* src = conn->inBuf + conn->inPos;
+
+        conn->inBuf = nullptr;
+        conn->inLen = conn->inPos = 0;
+
+        if(reserveInput(conn, remaining) != 0) {
+            conn->state = CONN_STATE::CLOSING;
+            return;
+        }
+
+        memcpy(conn->inBuf, src, remaining);
+        conn->inLen = remaining;
+        return;
+    }
+
+    if(conn->inPos == 0) return;
+
+    memmove(conn->inBuf, conn->inBuf + conn->inPos, remaining);
+    conn->inLen = remaining;
+    conn->inPos = 0;
+}
+
+
+/**
+ * Shut down and free a client connection, freeing capacity for queued clients
+ * @param thread The reactor owning this connection
+ * @param conn The connection to close
+ */
+void CSServer::closeClient(Thread* thread, Connection* conn)
+{
+    thread->numConnections--;
+
+    if(conn->prev != nullptr) conn->prev->next = conn->next;
+    else thread->connections = conn->next;
+    if(conn->next != nullptr) conn->next->prev = conn->prev;
+    thread->timers->cancel(&conn->timer);
+    conn->deadline = DEADLINE::NO_DEADLINE;
+
+    if(conn->inFlight > 0) {
+        // tagged requests are still running, the last completion frees it
+        conn->state = CONN_STATE::CLOSING;
+        epoll_ctl(thread->epfd, EPOLL_CTL_DEL, conn->cl, nullptr);
+    } else {
+        freeClient(conn);
+    }
+
+    if(thread != &_acceptor) adoptClients(thread);
+}
+
+
+/**
+ * Shut down a client and free its connection state
+ * @param conn The connection to free
+ */
+void CSServer::freeClient(Connection* conn)
+{
+    conn->state = CONN_STATE::CLOSING;
+
+    // closing the descriptor also removes it from the epoll set
+    if(conn->ssl != nullptr) {
+        SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+    }
+    close(conn->cl);
+
+    if(conn->inCap > 0) free(conn->inBuf);
+    if(conn->outBuf != nullptr) free(conn->outBuf);
+    if(conn->handler) conn->handler.destroy();
+    if(conn->stream != nullptr) freeStream(conn->stream);
+    if(conn->upload != nullptr) freeUpload(conn->upload, true);
+
+    while(conn->deferred != nullptr) {
+        Task* task = conn->deferred;
+        conn->deferred = task->next;
+        freeTask(task);
+    }
+
+    free(conn);
+}
+
+
+/**
+ * Append bytes to a growable heap buffer
+ * @param buf Pointer to the buffer, allocated if null
+ * @param len Pointer to the number of bytes in use
+ * @param cap Pointer to the allocated capacity
+ * @param src Bytes to append
+ * @param size Number of bytes to append
+ * @return 0 if successful, -1 if allocation failed
+ */
+int CSServer::appendBytes(char** buf, size_t* len, size_t* cap, const void* src, size_t size)
+{
+    if(*len + size > *cap) {
+        size_t newCap = *cap ? *cap : DEFAULT_BUF_SIZE;
+        while(newCap < *len + size) newCap *= 2;
+
+        char* newBuf = (char*) realloc (*buf, newCap);
+        if(newBuf == nullptr) return -1;
+
+        *buf = newBuf;
+        *cap = newCap;
+    }
+
+    memcpy(*buf + *len, src, size);
+    *len += size;
+
+    return 0;
+}
+
+
+/**
+ * Make room at the end of the connection's out buffer
+ * @param conn The connection to write to
+ * @param space Number of free bytes wanted after the staged output
+ * @return 0 if successful, -1 if allocation failed
+ */
+int CSServer::reserveOutput(Connection* conn, size_t space)
+{
+    size_t newCap;
+    char* newBuf;
+
+    if(conn->outCap - conn->outLen >= space) return 0;
+
+    newCap = conn->outCap ? conn->outCap : DEFAULT_BUF_SIZE;
+    while(newCap < conn->outLen + space) newCap *= 2;
+
+    if((newBuf = (char*) realloc (conn->outBuf, newCap)) == nullptr) return -1;
+
+    conn->outBuf = newBuf;
+    conn->outCap = newCap;
+
+    return 0;
+}
+
+
+/**
+ * Stage bytes for a client, written out with everything else staged this turn
+ * once the connection has been serviced or the staged bytes fill a record
+ * @param conn The connection to write to
+ * @param buf Bytes to write
+ * @param size Number of bytes to write
+ * @return 0 if staged, -1 if the connection failed
+ */
+int CSServer::sendBytes(Connection* conn, const void* buf, int size)
+{
+    if(appendBytes(&conn->outBuf, &conn->outLen, &conn->outCap, buf, size) != 0) return -1;
+
+    _outputStats.responses.fetch_add(1, memory_order_relaxed);
+
+    if(conn->state != CONN_STATE::DETACHED && conn->outLen >= OUTPUT_FLUSH_THRESHOLD) return flushOutput(conn);
+
+    return 0;
+}
+
+
+/**
+ * Flush staged output to a client in a single write
+ * @param conn The connection to flush
+ * @return 0 if flushed or still waiting on the socket, -1 if the connection failed
+ */
+int CSServer::flushOutput(Connection* conn)
+{
+    int ret;
+
+    if(conn->outLen == 0 || conn->state == CONN_STATE::HANDSHAKE) return 0;
+
+    if((ret = writeClient(conn, conn->outBuf, conn->outLen)) < 0) return -1;
+
+    if((size_t)ret < conn->outLen) {
+        // retried with whatever has been staged since once writable
+        _outputStats.blockedFlushes.fetch_add(1, memory_order_relaxed);
+        if(ret == 0) return 0;
+
+        memmove(conn->outBuf, conn->outBuf + ret, conn->outLen - ret);
+    }
+
+    _outputStats.flushes.fetch_add(1, memory_order_relaxed);
+    _outputStats.bytes.fetch_add(ret, memory_order_relaxed);
+    conn->outLen -= ret;
+
+    return 0;
+}
+
+
+/**
+ * Read from a client, through TLS unless it is local
+ * @param conn The connection to read from
+ * @param buf Buffer to read into
+ * @param size Size of the buffer
+ * @return Number of bytes read, 0 if nothing is available, -1 if the client closed or failed
+ */
+int CSServer::readClient(Connection* conn, void* buf, size_t size)
+{
+    int ret;
+
+    if(conn->ssl == nullptr) {
+        while((ret = read(conn->cl, buf, size)) < 0 && errno == EINTR);
+
+        if(ret > 0) return ret;
+        if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        return -1;
+    }
+
+    if((ret = SSL_read(conn->ssl, buf, size)) > 0) return ret;
+
+    switch(SSL_get_error(conn->ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+
+/**
+ * Write to a client, through TLS unless it is local. TLS writes all or
+ * nothing, local writes may stop part way once the socket is full.
+ * @param conn The connection to write to
+ * @param buf Bytes to write
+ * @param size Number of bytes to write
+ * @return Number of bytes written, 0 if the socket is full, -1 if the connection failed
+ */
+int CSServer::writeClient(Connection* conn, const void* buf, size_t size)
+{
+    int ret;
+    size_t sent = 0;
+
+    if(conn->ssl == nullptr) {
+        while(sent < size) {
+            ret = send(conn->cl, (const char*)buf + sent, size - sent, MSG_NOSIGNAL);
+
+            if(ret > 0) {
+                sent += ret;
+            } else if(ret < 0 && errno == EINTR) {
+                continue;
+            } else if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                return -1;
+            }
+        }
+
+        return sent;
+    }
+
+    if((ret = SSL_write(conn->ssl, buf, size)) > 0) return ret;
+
+    switch(SSL_get_error(conn->ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+
+/**
+ * Print the output coalescing counters
+ * @param file File to print to
+ */
+void CSServer::dumpOutputStats(FILE* file)
+{
+    uint64_t responses = _outputStats.responses.load(memory_order_relaxed);
+    uint64_t flushes = _outputStats.flushes.load(memory_order_relaxed);
+
+    fprintf(file, "output responses:%lu flushes:%lu blocked_flushes:%lu bytes:%lu sendfile_bytes:%lu responses_per_flush:%.2f\n",
+            responses,
+            flushes,
+            _outputStats.blockedFlushes.load(memory_order_relaxed),
+            _outputStats.bytes.load(memory_order_relaxed),
+            _outputStats.sendfileBytes.load(memory_order_relaxed),
+            flushes ? (double)responses / flushes : 0.0);
+}
+
+
+/**
+ * Print the compressed request body counters
+ * @param file File to print to
+ */
+void CSServer::dumpCompressionStats(FILE* file)
+{
+    uint64_t wireBytes = _compressionStats.wireBytes.load(memory_order_relaxed);
+    uint64_t bodyBytes = _compressionStats.bodyBytes.load(memory_order_relaxed);
+
+    fprintf(file, "compression frames:%lu failed:%lu wire_bytes:%lu body_bytes:%lu ratio:%.2f\n",
+            _compressionStats.frames.load(memory_order_relaxed),
+            _compressionStats.failed.load(memory_order_relaxed),
+            wireBytes,
+            bodyBytes,
+            wireBytes ? (double)bodyBytes / wireBytes : 0.0);
+}
+
+
+/**
+ * Function for parsing and handling messages from client, resumable: returns
+ * INCOMPLETE_FRAME without side effects if the whole frame is not buffered yet
+ * @param conn The connection the message was received on
+ * @return 0 if successfully parsed and handled, INCOMPLETE_FRAME if more bytes are needed, error code if not
+ */
+int CSServer::parseMessage(Connection* conn)
+{
+    uint16_t command;
+    uint8_t flags;
+
+    if(conn->version == PROTOCOL::PROTOCOL_V2) {
+        int ret = parseHeaderV2(conn, &command, &flags);
+        if(ret != 0) return ret;
+    } else {
+        if(conn->inLen - conn->inPos < HEADER_SIZE) return INCOMPLETE_FRAME;
+
+        const char* header = conn->inBuf + conn->inPos;
+
+        conn->session_id = getInt(header, 0, 4);
+        conn->session_token = {0, conn->session_id};
+        command = getInt(header, 4, 2);
+        conn->full_command = command;
+        conn->inPos += HEADER_SIZE;
+
+        flags = (command & 0x0FF0) >> 4;
+        command = command & 0xF00F;
+
+        conn->hasRequestId = flags & HEADER_FLAGS::HAS_REQUEST_ID;
+
+        if(conn->hasRequestId) {
+            if(conn->inLen - conn->inPos < REQUEST_ID_SIZE) return INCOMPLETE_FRAME;
+
+            conn->requestId = getInt(conn->inBuf + conn->inPos, REQUEST_ID_SIZE);
+            conn->inPos += REQUEST_ID_SIZE;
+            flags &= ~HEADER_FLAGS::HAS_REQUEST_ID;
+        }
+    }
+
+    conn->startedNs = nowNs();
+
+    // turned away at accept, answer busy and hang up
+    if(conn->rejected) {
+        returnWithCode(conn, conn->session_id, conn->full_command, ERROR::SERVER_BUSY);
+        conn->state = CONN_STATE::CLOSING;
+        return 0;
+    }
+
+    // over its limit the request is read and dropped, only the reply goes out
+    if(!conn->admitted) {
+        int code = admitRequest(conn, command);
+
+        if(code == INCOMPLETE_FRAME) return code;
+
+        if(code != 0) {
+            // refusals are counted by their reply code, not timed
+            conn->startedNs = 0;
+
+            if(command == CMD::POST && (flags & HEADER_FLAGS::STREAM_UPLOAD)) {
+                return handleUpload(conn, flags & ~HEADER_FLAGS::STREAM_UPLOAD, code);
+            }
+
+            if(command == CMD::BATCH) return handleBatch(conn, code);
+
+            return startHandler(conn, refuseRequest(conn, requestFields(command), code));
+        }
+
+        conn->admitted = true;
+    }
+
+    // tagged requests may be answered out of order, slow ones leave the reactor
+    if(conn->hasRequestId) {
+        int ret = offloadRequest(conn, command, flags);
+        if(ret != RUN_INLINE) return ret;
+    }
+
+    int ret = runCommand(conn, command, flags);
+
+    // suspended handlers and streamed posts are timed once they finish
+    if(ret == 0 && !conn->handler && conn->upload == nullptr) finishCommand(conn);
+
+    return ret;
+}
+
+
+/**
+ * Parse a v2 frame header, a version byte, the command and flags word as
+ * varints, the session ID and a varint request ID if flagged. The flags word
+ * is mapped onto the v1 flag bits so handlers see the same flags either way.
+ * @param conn The connection with the header at its parse cursor
+ * @param command Container for the command without flag bits
+ * @param flags Container for the flags, HAS_REQUEST_ID cleared
+ * @return 0 if parsed, INCOMPLETE_FRAME if more bytes are needed, COMMAND_FORMAT if malformed
+ */
+int CSServer::parseHeaderV2(Connection* conn, uint16_t* command, uint8_t* flags)
+{
+    int used;
+    uint64_t value, word, requestId = 0;
+    size_t pos = conn->inPos;
+
+    if(pos >= conn->inLen) return INCOMPLETE_FRAME;
+    if((uint8_t)conn->inBuf[pos] != PROTOCOL::PROTOCOL_V2) return ERROR::COMMAND_FORMAT;
+    pos += 1;
+
+    if((used = getVarint(conn->inBuf + pos, conn->inLen - pos, &value)) <= 0) return used ? used : ERROR::COMMAND_FORMAT;
+    pos += used;
+
+    if((used = getVarint(conn->inBuf + pos, conn->inLen - pos, &word)) <= 0) return used ? used : ERROR::COMMAND_FORMAT;
+    pos += used;
+
+    // flags have a word of their own, the command's flag nibbles stay clear
+    if(value > 0xFFFF || (value & 0x0FF0) || (word & ~(uint64_t)(V2_RESOURCE_MASK | V2_COMPRESSED | V2_STREAM_UPLOAD | V2_HAS_REQUEST_ID))) {
+        return ERROR::COMMAND_FORMAT;
+    }
+
+    if(conn->capabilities & CAPABILITY::CAP_WIDE_SESSION) {
+        if(conn->inLen - pos < SESSION_TOKEN_SIZE) return INCOMPLETE_FRAME;
+
+        conn->session_token.hi = getInt(conn->inBuf + pos, 8);
+        conn->session_token.lo = getInt(conn->inBuf + pos + 8, 8);
+        conn->session_id = conn->session_token.lo;
+        pos += SESSION_TOKEN_SIZE;
+    } else {
+        if(conn->inLen - pos < IDENT_SIZE) return INCOMPLETE_FRAME;
+
+        conn->session_id = getInt(conn->inBuf + pos, IDENT_SIZE);
+        conn->session_token = {0, conn->session_id};
+        pos += IDENT_SIZE;
+    }
+
+    if(word & FLAGS_V2::V2_HAS_REQUEST_ID) {
+        if((used = getVarint(conn->inBuf + pos, conn->inLen - pos, &requestId)) <= 0) return used ? used : ERROR::COMMAND_FORMAT;
+        if(requestId > UINT32_MAX) return ERROR::COMMAND_FORMAT;
+        pos += used;
+    }
+
+    *command = value;
+    *flags = (word & V2_RESOURCE_MASK) >> V2_RESOURCE_SHIFT;
+    if(word & FLAGS_V2::V2_STREAM_UPLOAD) *flags |= HEADER_FLAGS::STREAM_UPLOAD;
+
+    conn->hasRequestId = word & FLAGS_V2::V2_HAS_REQUEST_ID;
+    conn->requestId = requestId;
+    conn->full_command = *command | (*flags | (conn->hasRequestId ? HEADER_FLAGS::HAS_REQUEST_ID : 0)) << 4;
+    conn->inPos = pos;
+
+    if(word & FLAGS_V2::V2_COMPRESSED) {
+        // streamed data goes to disk as it arrives, it is never compressed
+        if(word & FLAGS_V2::V2_STREAM_UPLOAD) return ERROR::COMMAND_FORMAT;
+
+        return inflateBody(conn, *command);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Inflate a compressed request body once all of it is buffered. The body is
+ * inflated into a new input buffer, with the bytes after the frame copied in
+ * behind it, so handlers parse it like any other body. It has to hold exactly
+ * the fields of its command, handlers never wait on the rest of an inflated body.
+ * @param conn The connection with the body size at its parse cursor
+ * @param command Command without flag bits
+ * @return 0 if inflated, INCOMPLETE_FRAME if more bytes are needed, COMMAND_FORMAT if malformed,
+ * SERVER_BUSY if there is no memory to inflate into
+ */
+int CSServer::inflateBody(Connection* conn, uint16_t command)
+{
+    int ret, used;
+    uint64_t bodySize, size;
+    size_t pos = conn->inPos, rest, measured;
+    z_stream* stream;
+    char* body;
+
+    if(!(conn->capabilities & CAPABILITY::CAP_DEFLATE)) return ERROR::COMMAND_FORMAT;
+
+    if((used = getVarint(conn->inBuf + pos, conn->inLen - pos, &bodySize)) <= 0) return used ? used : ERROR::COMMAND_FORMAT;
+    pos += used;
+
+    if((used = getVarint(conn->inBuf + pos, conn->inLen - pos, &size)) <= 0) return used ? used : ERROR::COMMAND_FORMAT;
+    pos += used;
+
+    if(bodySize == 0 || bodySize > MAX_INPUT_BUF_SIZE || size > MAX_INPUT_BUF_SIZE) return ERROR::COMMAND_FORMAT;
+
+    // tiny frames must not be able to claim large buffers
+    if(bodySize > size * MAX_INFLATE_RATIO) return ERROR::COMMAND_FORMAT;
+
+    if(conn->inLen - pos < size) return INCOMPLETE_FRAME;
+
+    if((stream = threadInflater()) == nullptr) return ERROR::SERVER_BUSY;
+
+    rest = conn->inLen - pos - size;
+    if((body = (char*) malloc (bodySize + rest)) == nullptr) return ERROR::SERVER_BUSY;
+
+    stream->next_in = (Bytef*)(conn->inBuf + pos);
+    stream->avail_in = size;
+    stream->next_out = (Bytef*)body;
+    stream->avail_out = bodySize;
+
+    ret = inflate(stream, Z_FINISH);
+
+    if(ret == Z_NEED_DICT) {
+        // fails unless the client deflated with the same dictionary
+        if(inflateSetDictionary(stream, (const Bytef*)POST_DICTIONARY, sizeof(POST_DICTIONARY) - 1) == Z_OK) {
+            ret = inflate(stream, Z_FINISH);
+        }
+    }
+
+    // the stream has to end exactly where both sizes say it does
+    if(ret != Z_STREAM_END || stream->avail_in != 0 || stream->avail_out != 0) ret = Z_DATA_ERROR;
+
+    inflateReset(stream);
+
+    if(ret == Z_DATA_ERROR) {
+        _compressionStats.failed.fetch_add(1, memory_order_relaxed);
+        free(body);
+        return ERROR::COMMAND_FORMAT;
+    }
+
+    memcpy(body + bodySize, conn->inBuf + pos + size, rest);
+
+    if(conn->inCap != 0) free(conn->inBuf);
+
+    _compressionStats.wireBytes.fetch_add(pos + size - conn->inPos, memory_order_relaxed);
+
+    conn->inBuf = body;
+    conn->inLen = bodySize + rest;
+    conn->inPos = 0;
+    conn->inCap = bodySize + rest;
+
+    if(measureBody(conn, command, &measured) != 0 || measured != bodySize) {
+        _compressionStats.failed.fetch_add(1, memory_order_relaxed);
+        return ERROR::COMMAND_FORMAT;
+    }
+
+    _compressionStats.frames.fetch_add(1, memory_order_relaxed);
+    _compressionStats.bodyBytes.fetch_add(bodySize, memory_order_relaxed);
+
+    return 0;
+}
+
+
+/**
+ * Record the latency of the command the connection just finished
+ * @param conn The connection, or detached request, that finished its command
+ */
+void CSServer::finishCommand(Connection* conn)
+{
+    if(conn->startedNs == 0) return;
+
+    Metrics::recordCommand(conn->full_command & 0xF00F, nowNs() - conn->startedNs);
+    conn->startedNs = 0;
+}
+
+
+/**
+ * Run the handler for a command whose header has been parsed
+ * @param conn The connection, or detached request, to run the command for
+ * @param command Command without flag bits
+ * @param flags Flags carried in the command
+ * @return 0 if successfully handled, INCOMPLETE_FRAME if more bytes are needed, error code if not
+ */
+int CSServer::runCommand(Connection* conn, uint16_t command, uint8_t flags)
+{
+    switch(command) {
+    case CMD::GET_SESSION_ID:
+        return handleGetSessionID(conn);
+    case CMD::HELLO:
+        return handleHello(conn);
+    case CMD::CREATE_ACCOUNT:
+        return startHandler(conn, handleCreateAccount(conn));
+    case CMD::LOGIN:
+        return startHandler(conn, handleLogin(conn));
+    case CMD::POST:
+        // large media streams its data to disk instead of arriving in one field
+        if(flags & HEADER_FLAGS::STREAM_UPLOAD) return handleUpload(conn, flags & ~HEADER_FLAGS::STREAM_UPLOAD);
+        return startHandler(conn, handlePost(conn, flags));
+    case CMD::GET:
+        return handleGet(conn);
+    case CMD::BATCH:
+        return handleBatch(conn);
+    default:
+        return -1;
+    }
+}
+
+
+/**
+ * Keep a coroutine handler that suspended on the connection, to be resumed
+ * by runFrames once what it waits on is ready
+ * @param conn The connection, or detached request, the handler was started for
+ * @param handler The started handler
+ * @return Result of the handler if it finished, 0 if suspended, -1 if a detached request suspended
+ */
+int CSServer::startHandler(Connection* conn, Handler handler)
+{
+    if(handler.done()) return handler.result();
+
+    // a detached request holds its whole frame, so it can never wait for more
+    if(conn->state == CONN_STATE::DETACHED) return -1;
+
+    conn->handler = handler.release();
+
+    return 0;
+}
+
+
+/**
+ * Hand a tagged request to the task pool once its whole frame is buffered.
+ * Fast commands, and requests over the in flight limits, run on the reactor.
+ * Offloaded handlers (account creation, login, post and batch) share the
+ * account manager, the access manager and the session manager with the
+ * reactors, each of which serializes its own callers, so the pool needs no
+ * locking of its own.
+ * @param conn The connection the request was received on, header already parsed
+ * @param command Command without flag bits
+ * @param flags Flags carried in the command
+ * @return 0 if queued, INCOMPLETE_FRAME if more bytes are needed, RUN_INLINE if not queued
+ */
+int CSServer::offloadRequest(Connection* conn, uint16_t command, uint8_t flags)
+{
+    int ret;
+    size_t size;
+    Task* task;
+    uint64_t signal = 1;
+
+    if(_numTaskThreads == 0 || conn->thread->completions == nullptr) return RUN_INLINE;
+
+    // streamed data has to go through the connection as it arrives
+    if(flags & HEADER_FLAGS::STREAM_UPLOAD) return RUN_INLINE;
+    if(conn->inFlight >= MAX_REQUESTS_IN_FLIGHT) return RUN_INLINE;
+
+    if((ret = measureRequest(conn, command, &size)) != 0) return ret;
+
+    if(_tasksInFlight.fetch_add(1, memory_order_relaxed) >= (int)_tasks.capacity()) {
+        _tasksInFlight.fetch_sub(1, memory_order_relaxed);
+        return RUN_INLINE;
+    }
+
+    // frame is copied in behind the task, the receive buffer is reused
+    task = (Task*) calloc (1, sizeof(Task) + size);
+    task->conn = conn;
+    task->thread = conn->thread;
+    task->command = command;
+    task->flags = flags;
+
+    task->request.state = CONN_STATE::DETACHED;
+    task->request.session_id = conn->session_id;
+    task->request.session_token = conn->session_token;
+    task->request.full_command = conn->full_command;
+    task->request.hasRequestId = true;
+    task->request.requestId = conn->requestId;
+    task->request.isAdmin = conn->isAdmin;
+    task->request.version = conn->version;
+    task->request.capabilities = conn->capabilities;
+    task->request.startedNs = conn->startedNs;
+    task->request.inBuf = (char*)(task + 1);
+    task->request.inLen = size;
+
+    memcpy(task->request.inBuf, conn->inBuf + conn->inPos, size);
+
+    if(!_tasks.push(task)) {
+        free(task);
+        _tasksInFlight.fetch_sub(1, memory_order_relaxed);
+        return RUN_INLINE;
+    }
+
+    conn->inPos += size;
+    conn->inFlight++;
+
+    if(write(_taskEvent, &signal, sizeof(signal)) < 0) perror("write to task event");
+
+    return 0;
+}
+
+
+/**
+ * Measure the body of a request that can run on the task pool
+ * @param conn The connection with the body at its parse cursor
+ * @param command Command without flag bits
+ * @param size Container for the body size
+ * @return 0 if the whole body is buffered, INCOMPLETE_FRAME if not, RUN_INLINE for fast commands
+ */
+int CSServer::measureRequest(Connection* conn, uint16_t command, size_t* size)
+{
+    // gets stream from the reactor
+    if(command == CMD::GET) return RUN_INLINE;
+
+    return measureBody(conn, command, size);
+}
+
+
+/**
+ * Measure the body of a request as laid out for its command
+ * @param conn The connection with the body at its parse cursor
+ * @param command Command without flag bits
+ * @param size Container for the body size
+ * @return 0 if the whole body is buffered, INCOMPLETE_FRAME if not, RUN_INLINE if malformed or without a body
+ */
+int CSServer::measureBody(Connection* conn, uint16_t command, size_t* size)
+{
+    const char* fields;
+
+    if(command == CMD::BATCH) return measureBatch(conn, size);
+
+    if((fields = requestFields(command)) == nullptr) return RUN_INLINE;
+
+    return measureFields(conn, conn->inPos, fields, size);
+}
+
+
+/**
+ * Measure the body of a batch, its count and then each operation's fields
+ * @param conn The connection with the body at its parse cursor
+ * @param size Container for the body size
+ * @return 0 if the whole body is buffered, INCOMPLETE_FRAME if not, RUN_INLINE if malformed
+ */
+int CSServer::measureBatch(Connection* conn, size_t* size)
+{
+    int ret;
+    uint8_t count;
+    const char* fields;
+    size_t pos = conn->inPos, opSize;
+
+    if(conn->inLen - pos < 1) return INCOMPLETE_FRAME;
+
+    count = getInt(conn->inBuf + pos, 1);
+    pos += 1;
+
+    if(count == 0 || count > MAX_BATCH_OPS) return RUN_INLINE;
+
+    for(int i = 0; i < count; i++)
+    {
+        if(conn->inLen - pos < 1) return INCOMPLETE_FRAME;
+
+        if((fields = batchFields(getInt(conn->inBuf + pos, 1))) == nullptr) return RUN_INLINE;
+        pos += 1;
+
+        if((ret = measureFields(conn, pos, fields, &opSize)) != 0) return ret;
+        pos += opSize;
+    }
+
+    *size = pos - conn->inPos;
+
+    return 0;
+}
+
+
+/**
+ * Measure fields laid out as given
+ * @param conn The connection with the fields in its input buffer
+ * @param pos Position of the first field in the input buffer
+ * @param fields Field layout, see requestFields
+ * @param size Container for the size of the fields
+ * @return 0 if all of them are buffered, INCOMPLETE_FRAME if not, RUN_INLINE if a field is malformed
+ */
+int CSServer::measureFields(Connection* conn, size_t pos, const char* fields, size_t* size)
+{
+    int prefix;
+    uint64_t length;
+    size_t start = pos;
+
+    for(; *fields; fields++) {
+        if(*fields == 'i') {
+            pos += 1;
+            continue;
+        }
+
+        prefix = peekField(conn, pos, STR_LEN_SIZE, &length);
+
+        if(prefix == INCOMPLETE_FRAME) return INCOMPLETE_FRAME;
+
+        // malformed fields are answered by the handler
+        if(prefix == 0 || length > MAX_INPUT_BUF_SIZE) return RUN_INLINE;
+
+        pos += prefix + length;
+    }
+
+    if(pos > conn->inLen) return INCOMPLETE_FRAME;
+
+    *size = pos - start;
+
+    return 0;
+}
+
+
+/**
+ * Field layout of a command's body, 'i' is a one byte int and 's' a length
+ * prefixed string or data field
+ * @param command Command without flag bits
+ * @return The layout, null for commands without a body
+ */
+const char* CSServer::requestFields(uint16_t command)
+{
+    switch(command) {
+    case CMD::CREATE_ACCOUNT:
+        return "sss";
+    case CMD::LOGIN:
+        return "ss";
+    case CMD::POST:
+        return "iss";
+    case CMD::GET:
+        return "s";
+    default:
+        return nullptr;
+    }
+}
+
+
+/**
+ * Field layout of a batch operation, laid out as in requestFields
+ * @param op The operation
+ * @return The layout, null for unknown operations
+ */
+const char* CSServer::batchFields(uint8_t op)
+{
+    switch(op) {
+    case BATCH_OP::BATCH_POST:
+        return "iiss";
+    case BATCH_OP::BATCH_DELETE:
+        return "s";
+    default:
+        return nullptr;
+    }
+}
+
+
+/**
+ * Check a request against the token buckets of its session and account.
+ * Requests on an unknown session share one bucket, so made up session IDs
+ * do not each get a full bucket. A batch takes a write token per operation.
+ * @param conn The connection the request was received on, header already parsed
+ * @param command Command without flag bits
+ * @return 0 if the request may run, RATE_LIMITED if not, INCOMPLETE_FRAME if a batch's count is still arriving
+ */
+int CSServer::admitRequest(Connection* conn, uint16_t command)
+{
+    RATE_CLASS rateClass;
+    session_s session;
+    double cost = 1;
+
+    switch(command) {
+    case CMD::CREATE_ACCOUNT:
+    case CMD::LOGIN:
+        rateClass = RATE_CLASS::RATE_AUTH;
+        break;
+    case CMD::POST:
+        rateClass = RATE_CLASS::RATE_WRITE;
+        break;
+    case CMD::GET:
+        rateClass = RATE_CLASS::RATE_READ;
+        break;
+    case CMD::BATCH:
+        if(conn->inLen - conn->inPos < 1) return INCOMPLETE_FRAME;
+
+        rateClass = RATE_CLASS::RATE_WRITE;
+        cost = getInt(conn->inBuf + conn->inPos, 1);
+        if(cost < 1) cost = 1;
+        break;
+    default:
+        return 0;
+    }
+
+    if(_sm.getSession(&conn->session_token, &session) != 0) {
+        if(!_limiter.admit(rateClass, 0, nullptr, nowNs(), cost)) return ERROR::RATE_LIMITED;
+    } else {
+        if(!_limiter.admit(rateClass, session.id, session.uid[0] ? session.uid : nullptr, nowNs(), cost)) return ERROR::RATE_LIMITED;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Answer a request that was turned away, its fields are read and dropped so
+ * the next frame is found
+ * @param conn The connection the request was received on, header already parsed
+ * @param fields Field layout of the request body, see requestFields
+ * @param code Error code to answer with
+ * @return Handler finishing with 0 once the request has been dropped and answered
+ */
+Handler CSServer::refuseRequest(Connection* conn, const char* fields, int code)
+{
+    int err = 0;
+    uint32_t size;
+
+    for(; fields != nullptr && *fields && err == 0; fields++) {
+        if(*fields == 'i') {
+            co_await nextBytes(conn, 1);
+        } else {
+            co_await nextData(conn, &size, &err);
+        }
+    }
+
+    // a malformed field leaves nowhere to find the next frame
+    if(err != 0) {
+        co_await writeCode(conn, conn->full_command, err);
+        conn->state = CONN_STATE::CLOSING;
+        co_return 0;
+    }
+
+    co_await writeCode(conn, conn->full_command, code);
+
+    co_return 0;
+}
+
+
+/**
+ * Task pool thread, runs queued requests and hands them back to their reactor
+ * @param arg Unused
+ */
+void* CSServer::runTasks(void* arg)
+{
+    Task* task;
+    uint64_t signal;
+
+    (void)arg;
+
+    while(true) {
+        if(read(_taskEvent, &signal, sizeof(signal)) < 0) {
+            if(errno == EINTR) continue;
+            err(2, "read task event");
+        }
+
+        // the push behind this signal may still be finishing
+        while(!_tasks.pop(&task)) std::this_thread::yield();
+
+        task->result = runCommand(&task->request, task->command, task->flags);
+
+        while(!task->thread->completions->push(task)) std::this_thread::yield();
+
+        signal = 1;
+        if(write(task->thread->completionEvent, &signal, sizeof(signal)) < 0) perror("write to task completion event");
+    }
+
+    return 0;
+}
+
+
+/**
+ * Write the replies of finished tasks, on the reactor owning their connections
+ * @param thread The reactor whose tasks finished
+ */
+void CSServer::completeTasks(Thread* thread)
+{
+    Task* task;
+    Connection* conn;
+
+    while(thread->completions->pop(&task)) {
+        conn = task->conn;
+        conn->inFlight--;
+        _tasksInFlight.fetch_sub(1, memory_order_relaxed);
+
+        if(conn->state == CONN_STATE::CLOSING) {
+            // closed while the task ran
+            if(conn->inFlight == 0) freeClient(conn);
+        } else if(task->result != 0) {
+            LOG_WARN("Received invalid message from client");
+            closeClient(thread, conn);
+        } else if(conn->stream != nullptr) {
+            // replies cannot cut into the chunks of a GET, written once it ends
+            task->next = conn->deferred;
+            conn->deferred = task;
+            continue;
+        } else if(appendBytes(&conn->outBuf, &conn->outLen, &conn->outCap, task->request.outBuf, task->request.outLen) != 0
+                  || flushOutput(conn) != 0) {
+            closeClient(thread, conn);
+        } else {
+            finishCommand(&task->request);
+        }
+
+        freeTask(task);
+    }
+}
+
+
+/**
+ * Free a task and the reply staged on it
+ * @param task The task to free
+ */
+void CSServer::freeTask(Task* task)
+{
+    if(task->request.outBuf != nullptr) free(task->request.outBuf);
+    free(task);
+}
+
+
+/**
+ * Handle get session id command, establishes new session, one with a random
+ * 128 bit token under CAP_WIDE_SESSION
+ * @param conn Connection requesting session ID
+ * @return 0 when handled
+ */
+int CSServer::handleGetSessionID(Connection* conn)
+{
+    char returnBuf[MAX_REPLY_HEADER_SIZE];
+    int size;
+
+    if(conn->capabilities & CAPABILITY::CAP_WIDE_SESSION) {
+        if(_sm.createSession(&conn->session_token) != 0) conn->session_token = {0, 0};
+        conn->session_id = conn->session_token.lo;
+    } else {
+        conn->session_id = _sm.createSession();
+        conn->session_token = {0, conn->session_id};
+    }
+
+    size = placeHeader(conn, returnBuf, conn->session_id, CMD::GET_SESSION_ID);
+
+    sendBytes(conn, returnBuf, size);
+
+    return 0;
+}
+
+
+/**
+ * Handle hello command, switches the connection to the protocol version it
+ * asks for, or the newest one supported below it, and grants the capabilities
+ * it asks for that the version supports. The reply carries the version and
+ * capabilities chosen and is the last frame in the old framing.
+ * @param conn Connection requesting a protocol version
+ * @return 0 when handled, INCOMPLETE_FRAME if the version is still arriving
+ */
+int CSServer::handleHello(Connection* conn)
+{
+    char returnBuf[MAX_REPLY_HEADER_SIZE+MAX_VARINT_SIZE+2];
+    int size;
+    uint8_t version, capabilities;
+
+    if(conn->inLen - conn->inPos < 2) return INCOMPLETE_FRAME;
+
+    version = scanInt(conn, 1);
+    capabilities = scanInt(conn, 1);
+
+    // replies still owed to tagged requests would go out in the old framing
+    if(version < PROTOCOL::PROTOCOL_V1 || conn->inFlight > 0 || conn->deferred != nullptr) {
+        returnWithCode(conn, conn->session_id, conn->full_command, ERROR::COMMAND_FORMAT);
+        return 0;
+    }
+
+    if(version > PROTOCOL::PROTOCOL_V2) version = PROTOCOL::PROTOCOL_V2;
+
+    // compressed bodies and session tokens are only framed by v2
+    capabilities = version == PROTOCOL::PROTOCOL_V2 ? capabilities & (CAPABILITY::CAP_DEFLATE | CAPABILITY::CAP_WIDE_SESSION) : 0;
+
+    Metrics::countReply(ERROR::SUCCESS);
+
+    size = placeHeader(conn, returnBuf, conn->session_id, conn->full_command);
+    size += placeField(conn, returnBuf, ERROR::SUCCESS, size, ERR_CODE_SIZE);
+    placeInt(returnBuf, version, size, 1);
+    placeInt(returnBuf, capabilities, size + 1, 1);
+
+    sendBytes(conn, returnBuf, size + 2);
+
+    conn->version = version;
+    conn->capabilities = capabilities;
+
+    return 0;
+}
+
+
+/**
+ * Handle creating account by server command
+ * @param conn Connection requesting account creation
+ * @return Handler finishing with 0 when handled, suspends while fields are still arriving
+ */
+Handler CSServer::handleCreateAccount(Connection* conn)
+{
+    int err;
+    uint64_t opStart;
+    session_s session;
+
+    string_view username, email, password;
+    char usernameBuf[MAX_LOGIN_FIELD_SIZE+1];
+    char emailBuf[MAX_LOGIN_FIELD_SIZE+1];
+    char passwordBuf[MAX_LOGIN_FIELD_SIZE+1];
+
+    err = 0;
+
+    // fields are copied out as they arrive, the input moves while suspended
+
+    // get username string
+    username = co_await nextString(conn, MAX_LOGIN_FIELD_SIZE, &err);
+
+    if(err) {
+        co_await writeCode(conn, CMD::CREATE_ACCOUNT, err);
+        co_return 0;
+    }
+
+    copyField(usernameBuf, sizeof(usernameBuf), username);
+
+    // get email string
+    email = co_await nextString(conn, MAX_LOGIN_FIELD_SIZE, &err);
+
+    if(err) {
+        co_await writeCode(conn, CMD::CREATE_ACCOUNT, err);
+        co_return 0;
+    }
+
+    copyField(emailBuf, sizeof(emailBuf), email);
+
+    // get password string
+    password = co_await nextString(conn, MAX_LOGIN_FIELD_SIZE, &err);
+
+    if(err) {
+        co_await writeCode(conn, CMD::CREATE_ACCOUNT, err);
+        co_return 0;
+    }
+
+    copyField(passwordBuf, sizeof(passwordBuf), password);
+
+
+
+    if(!err && _sm.getSession(&conn->session_token, &session) != 0) err = ERROR::NO_SESSION;
+
+    // if format error, return before making account
+    if(err) {
+        co_await writeCode(conn, CMD::CREATE_ACCOUNT, err);
+        co_return 0;
+    }
+
+    // create the account
+    opStart = nowNs();
+    err = _am.createAccount(usernameBuf, emailBuf, passwordBuf);
+    Metrics::recordOp(METRIC_OP::OP_CREATE_ACCOUNT, nowNs() - opStart);
+
+    co_await writeCode(conn, CMD::CREATE_ACCOUNT, err);
+
+    co_return 0;
+}
+
+
+/**
+ * Handle login command from client
+ * @param conn Connection requesting login
+ * @return Handler finishing with 0 when handled, suspends while fields are still arriving
+ */
+Handler CSServer::handleLogin(Connection* conn)
+{
+    int err;
+    uint64_t opStart;
+    account_info_s* accountInfo;
+    string_view username, password;
+    char usernameBuf[MAX_LOGIN_FIELD_SIZE+1];
+    char passwordBuf[MAX_LOGIN_FIELD_SIZE+1];
+    
+    err = 0;
+
+    // get username
+    username = co_await nextString(conn, MAX_LOGIN_FIELD_SIZE, &err);
+
+    if(err) {
+        co_await writeCode(conn, CMD::LOGIN, err);
+        co_return 0;
+    }
+
+    copyField(usernameBuf, sizeof(usernameBuf), username);
+
+    // get password
+    password = co_await nextString(conn, MAX_LOGIN_FIELD_SIZE, &err);
+
+    if(err) {
+        co_await writeCode(conn, CMD::LOGIN, err);
+        co_return 0;
+    }
+
+    copyField(passwordBuf, sizeof(passwordBuf), password);
+
+    // attempt login and session set
+    opStart = nowNs();
+    accountInfo = _am.login(usernameBuf, passwordBuf, &err);
+    Metrics::recordOp(METRIC_OP::OP_LOGIN, nowNs() - opStart);
+
+    if(err) {
+        co_await writeCode(conn, CMD::LOGIN, err);
+        co_return 0;
+    }
+
+    // set uid in session
+    err = _sm.replaceUid(&conn->session_token, accountInfo->uid);
+
+    co_await writeCode(conn, CMD::LOGIN, err);
+
+    co_return 0;
+}
+
+
+/**
+ * Handle post to database
+ * @param conn Connection handling post request
+ * @param flags Flags associated with this post 
+ * @return Handler finishing with 0 when handled, suspends while fields are still arriving
+ */
+Handler CSServer::handlePost(Connection* conn, uint8_t flags)
+{
+    int err;
+    uint64_t opStart;
+    uint32_t dataSize;
+    DTYPE type;
+    PERM perm;
+    request_info_s requestInfo;
+    const char* data;
+    session_s session;
+    string_view path;
+    char pathBuf[MAX_PATH_SIZE+1];
+
+    err = 0;
+
+    perm = static_cast<PERM>(getInt(co_await nextBytes(conn, 1), 1));
+
+    path = co_await nextString(conn, MAX_PATH_SIZE, &err);
+
+    if(err) {
+        co_await writeCode(conn, conn->full_command, err);
+        co_return 0;
+    }
+
+    copyField(pathBuf, sizeof(pathBuf), path);
+
+    data = co_await nextData(conn, &dataSize, &err);
+
+    if(err) {
+        co_await writeCode(conn, conn->full_command, err);
+        co_return 0;
+    }
+
+    // check whether this user is logged in
+    if(_sm.getSession(&conn->session_token, &session) != 0) {
+        co_await writeCode(conn, conn->full_command, ERROR::NO_SESSION);
+        co_return 0;
+    }
+
+    type = postType(flags);
+
+    if(type == DTYPE::NONE) {
+        co_await writeCode(conn, conn->full_command, ERROR::TYPE_INVAL);
+        co_return 0;
+    }
+
+    requestInfo.uid = session.uid;
+    requestInfo.perms = "w";
+    requestInfo.isAdmin = conn->isAdmin;
+
+    // data is a view into the receive buffer, the db copies it into the item
+    opStart = nowNs();
+    err = _dbam.replaceItem(DEFAULT_DB, pathBuf, requestInfo, data, dataSize, type, perm);
+    Metrics::recordOp(METRIC_OP::OP_REPLACE_ITEM, nowNs() - opStart);
+
+    co_await writeCode(conn, conn->full_command, err);
+
+    co_return 0;
+}
+
+/**
+ * Get the item type for the resource flags of a post
+ * @param flags Flags associated with the post
+ * @return The item type, NONE if the flags name no resource
+ */
+DTYPE CSServer::postType(uint8_t flags)
+{
+    switch(flags) {
+    case FLAGS::TEXT_RESOURCE:
+        return DTYPE::TEXT;
+    case FLAGS::IMAGE_RESOURCE:
+        return DTYPE::TEXT;
+    case FLAGS::AUDIO_RESOURCE:
+        return DTYPE::AUDIO;
+    case FLAGS::VIDEO_RESOURCE:
+        return DTYPE::VIDEO;
+    case FLAGS::STREAM_RESOURCE:
+        return DTYPE::STREAM;
+    case FLAGS::AUDIO_STREAM_RESOURCE:
+        return DTYPE::AUDIO_STREAM;
+    default:
+        return DTYPE::NONE;
+    }
+}
+
+
+/**
+ * Handle batch command, posts and deletes applied in order with each touched
+ * collection's manifest written once at the end. Operations succeed or fail
+ * on their own, the reply carries a code for each. The whole batch is parsed
+ * at once, so it has to fit in the input buffer.
+ * @param conn Connection, or detached request, carrying the batch
+ * @param refused Error code the batch was turned away with, its operations are dropped
+ * @return 0 when handled, INCOMPLETE_FRAME if operations are still arriving
+ */
+int CSServer::handleBatch(Connection* conn, int refused)
+{
+    char returnBuf[MAX_REPLY_HEADER_SIZE+MAX_VARINT_SIZE+1+MAX_BATCH_OPS*MAX_VARINT_SIZE];
+    batch_op_s ops[MAX_BATCH_OPS] = {};
+    request_info_s requestInfo;
+    session_s session;
+    string_view path;
+    uint64_t opStart;
+    size_t bodySize, start, opSize;
+    uint32_t dataSize;
+    char* paths;
+    char* nextPath;
+    uint8_t count, flags;
+    int ret, err, size;
+
+    ret = measureBatch(conn, &bodySize);
+
+    if(ret == INCOMPLETE_FRAME) return ret;
+
+    // a malformed operation leaves nowhere to find the next frame
+    if(ret != 0) {
+        returnWithCode(conn, conn->session_id, conn->full_command, ERROR::COMMAND_FORMAT);
+        conn->state = CONN_STATE::CLOSING;
+        return 0;
+    }
+
+    if(refused == 0 && _sm.getSession(&conn->session_token, &session) != 0) refused = ERROR::NO_SESSION;
+
+    if(refused != 0) {
+        conn->inPos += bodySize;
+        returnWithCode(conn, conn->session_id, conn->full_command, refused);
+        return 0;
+    }
+
+    count = scanInt(conn, 1);
+
+    // every path fits in the body it came from
+    paths = (char*) malloc (bodySize + count);
+    nextPath = paths;
+
+    for(int i = 0; i < count; i++)
+    {
+        start = conn->inPos;
+        dataSize = 0;
+        ops[i].op = static_cast<BATCH_OP>(scanInt(conn, 1));
+        measureFields(conn, conn->inPos, batchFields(ops[i].op), &opSize);
+        opSize += conn->inPos - start;
+
+        if(ops[i].op == BATCH_OP::BATCH_POST) {
+            flags = scanInt(conn, 1);
+            ops[i].perm = static_cast<PERM>(scanInt(conn, 1));
+            ops[i].type = postType(flags);
+
+            if(ops[i].type == DTYPE::NONE) ops[i].result = ERROR::TYPE_INVAL;
+        }
+
+        path = scanString(conn, MAX_PATH_SIZE, &err);
+
+        if(err == 0 && ops[i].op == BATCH_OP::BATCH_POST) ops[i].data = scanData(conn, &dataSize, &err);
+
+        if(err != 0 && ops[i].result == 0) ops[i].result = err;
+
+        copyField(nextPath, path.size() + 1, path);
+        ops[i].path = nextPath;
+        ops[i].dataSize = dataSize;
+        nextPath += path.size() + 1;
+
+        // a field refused above leaves the cursor short of the next operation
+        conn->inPos = start + opSize;
+    }
+
+    requestInfo.uid = session.uid;
+    requestInfo.perms = "w";
+    requestInfo.isAdmin = conn->isAdmin;
+
+    // data are views into the receive buffer, the db copies them into the items
+    opStart = nowNs();
+    _dbam.applyBatch(DEFAULT_DB, requestInfo, ops, count);
+    Metrics::recordOp(METRIC_OP::OP_APPLY_BATCH, nowNs() - opStart);
+
+    free(paths);
+
+    // the batch itself went through, each operation answers for itself
+    Metrics::countReply(ERROR::SUCCESS);
+
+    size = placeHeader(conn, returnBuf, conn->session_id, conn->full_command);
+    size += placeField(conn, returnBuf, ERROR::SUCCESS, size, ERR_CODE_SIZE);
+    placeInt(returnBuf, count, size, 1);
+    size += 1;
+
+    for(int i = 0; i < count; i++)
+    {
+        size += placeField(conn, returnBuf, ops[i].result, size, ERR_CODE_SIZE);
+    }
+
+    sendBytes(conn, returnBuf, size);
+
+    return 0;
+}
+
+
+/**
+ * Handle streamed post, the frame carries the perm, path and an 8 byte data
+ * size, a varint under v2, and the data follows unframed. Data is written to a temp file in the
+ * collection as it arrives so memory stays bounded, and the item is replaced
+ * once all of it has been received. Only media types can be streamed.
+ * @param conn Connection handling post request
+ * @param flags Resource flags of this post
+ * @param refused Error code the upload was turned away with, its data is dropped
+ * @return 0 when handled, INCOMPLETE_FRAME if fields are still arriving
+ */
+int CSServer::handleUpload(Connection* conn, uint8_t flags, int refused)
+{
+    int err;
+    uint64_t opStart;
+    PERM perm;
+    uint64_t size;
+    string_view path;
+    session_s session;
+    upload_s* upload;
+    request_info_s requestInfo;
+
+    err = 0;
+
+    perm = static_cast<PERM>(scanInt(conn, 1, &err));
+
+    if(err == INCOMPLETE_FRAME) return err;
+
+    path = scanString(conn, MAX_PATH_SIZE, &err);
+
+    if(err == INCOMPLETE_FRAME) return err;
+    if(err) {
+        // without a path the data size is unknown, the connection cannot continue
+        returnWithCode(conn, conn->session_id, conn->full_command, err);
+        conn->state = CONN_STATE::CLOSING;
+        return 0;
+    }
+
+    size = scanField(conn, UPLOAD_SIZE_SIZE, &err);
+
+    if(err == INCOMPLETE_FRAME) return err;
+    if(err) {
+        returnWithCode(conn, conn->session_id, conn->full_command, err);
+        conn->state = CONN_STATE::CLOSING;
+        return 0;
+    }
+
+    upload = (upload_s*) calloc (1, sizeof(upload_s));
+    upload->fd = -1;
+    upload->type = postType(flags);
+    upload->perm = perm;
+    upload->size = size;
+    upload->remaining = size;
+    copyField(upload->path, sizeof(upload->path), path);
+
+    if(refused) {
+        upload->err = refused;
+    } else if(_sm.getSession(&conn->session_token, &session) != 0) {
+        upload->err = ERROR::NO_SESSION;
+    } else if(upload->type == DTYPE::NONE || upload->type == DTYPE::TEXT) {
+        upload->err = ERROR::TYPE_INVAL;
+    } else {
+        copyField(upload->uid, sizeof(upload->uid), session.uid);
+
+        requestInfo.uid = upload->uid;
+        requestInfo.perms = "w";
+        requestInfo.isAdmin = conn->isAdmin;
+
+        opStart = nowNs();
+        upload->err = _dbam.openUpload(DEFAULT_DB, upload->path, requestInfo, &upload->fd, upload->tempPath, sizeof(upload->tempPath));
+        Metrics::recordOp(METRIC_OP::OP_OPEN_UPLOAD, nowNs() - opStart);
+    }
+
+    conn->upload = upload;
+
+    if(size == 0) finishUpload(conn);
+
+    return 0;
+}
+
+
+/**
+ * Write the buffered part of a streamed post to its temp file, finishing the
+ * upload once all of its data has been received
+ * @param conn Connection with an upload in progress
+ */
+void CSServer::consumeUpload(Connection* conn)
+{
+    upload_s* upload = conn->upload;
+    size_t available = conn->inLen - conn->inPos;
+    size_t size = available < upload->remaining ? available : upload->remaining;
+    size_t done = 0;
+    ssize_t written;
+
+    while(upload->err == 0 && done < size) {
+        written = write(upload->fd, conn->inBuf + conn->inPos + done, size - done);
+
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            upload->err = ERROR::FILE_WRITE;
+            break;
+        }
+
+        done += written;
+    }
+
+    conn->inPos += size;
+    upload->remaining -= size;
+
+    if(upload->remaining == 0) finishUpload(conn);
+}
+
+
+/**
+ * Commit a fully received upload and reply with the result
+ * @param conn Connection whose upload has received all of its data
+ */
+void CSServer::finishUpload(Connection* conn)
+{
+    upload_s* upload = conn->upload;
+    request_info_s requestInfo;
+    int err = upload->err;
+    uint64_t opStart;
+
+    conn->upload = nullptr;
+
+    close(upload->fd);
+    upload->fd = -1;
+
+    if(err == 0) {
+        requestInfo.uid = upload->uid;
+        requestInfo.perms = "w";
+        requestInfo.isAdmin = conn->isAdmin;
+
+        opStart = nowNs();
+        err = _dbam.commitUpload(DEFAULT_DB, upload->path, requestInfo, upload->tempPath, upload->size, upload->type, upload->perm);
+        Metrics::recordOp(METRIC_OP::OP_COMMIT_UPLOAD, nowNs() - opStart);
+    }
+
+    freeUpload(upload, err != 0);
+
+    returnWithCode(conn, conn->session_id, conn->full_command, err);
+    finishCommand(conn);
+}
+
+
+/**
+ * Free upload state, removing the temp file if it was not committed
+ * @param upload The upload to free
+ * @param abort Whether the temp file should be removed
+ */
+void CSServer::freeUpload(upload_s* upload, bool abort)
+{
+    if(upload->fd >= 0) close(upload->fd);
+    if(abort && upload->tempPath[0] != 0) _dbam.abortUpload(DEFAULT_DB, upload->tempPath);
+
+    free(upload);
+}
+
+
+/**
+ * Handle get from database. The reply header carries the item type and is
+ * followed by the item data in chunks of a 2 byte length, a varint under v2,
+ * and at most MAX_CHUNK_SIZE bytes, ending with an empty chunk. Only the first chunk is
+ * read here, the rest is streamed as the socket drains.
+ * @param conn Connection handling get request
+ * @return 0 when handled, INCOMPLETE_FRAME if the path is still arriving, -1 if the reply could not be staged
+ */
+int CSServer::handleGet(Connection* conn)
+{
+    int err, prefix;
+    char header[MAX_REPLY_HEADER_SIZE+MAX_VARINT_SIZE+DTYPE_SIZE];
+    size_t start;
+    ssize_t bytesRead;
+    uint64_t opStart;
+    char* chunk;
+    DTYPE type;
+    string_view path;
+    session_s session;
+    stream_s* stream;
+    request_info_s requestInfo;
+
+    err = 0;
+
+    path = scanString(conn, MAX_PATH_SIZE, &err);
+
+    if(err == INCOMPLETE_FRAME) return err;
+    if(err) {
+        returnWithCode(conn, conn->session_id, conn->full_command, err);
+        return 0;
+    }
+
+    stream = (stream_s*) calloc (1, sizeof(stream_s));
+    stream->fd = -1;
+    copyField(stream->path, sizeof(stream->path), path);
+
+    // public items can be read without logging in
+    if(_sm.getSession(&conn->session_token, &session) == 0) copyField(stream->uid, sizeof(stream->uid), session.uid);
+
+    requestInfo.uid = stream->uid;
+    requestInfo.perms = "r";
+    requestInfo.isAdmin = conn->isAdmin;
+
+    // header and success code, the item type follows once known
+    prefix = placeHeader(conn, header, conn->session_id, conn->full_command);
+    prefix += placeField(conn, header, ERROR::SUCCESS, prefix, ERR_CODE_SIZE) + DTYPE_SIZE;
+
+    // media is sent from its file without loading the item into memory
+    opStart = nowNs();
+    err = _dbam.openItemFile(DEFAULT_DB, stream->path, requestInfo, &stream->fd, &stream->size, &type);
+    Metrics::recordOp(METRIC_OP::OP_OPEN_ITEM_FILE, nowNs() - opStart);
+
+    if(err == 0) {
+        if(type != DTYPE::TEXT) {
+            Metrics::countReply(ERROR::SUCCESS);
+            placeInt(header, type, prefix - DTYPE_SIZE, DTYPE_SIZE);
+
+            if(sendBytes(conn, header, prefix) != 0) {
+                freeStream(stream);
+                return -1;
+            }
+
+            return startStream(conn, stream);
+        }
+
+        close(stream->fd);
+        stream->fd = -1;
+    }
+
+    // read the first chunk straight into place behind the reply header
+
+    if(reserveOutput(conn, prefix + 2*STR_LEN_SIZE + MAX_CHUNK_SIZE) != 0) {
+        freeStream(stream);
+        return -1;
+    }
+
+    start = conn->outLen;
+    chunk = conn->outBuf + start + prefix;
+
+    opStart = nowNs();
+    bytesRead = _dbam.getItemData(DEFAULT_DB, stream->path, requestInfo, chunk + STR_LEN_SIZE, &type, MAX_CHUNK_SIZE, 0);
+    Metrics::recordOp(METRIC_OP::OP_GET_ITEM_DATA, nowNs() - opStart);
+
+    if(bytesRead < 0) {
+        freeStream(stream);
+        returnWithCode(conn, conn->session_id, conn->full_command, -bytesRead);
+        return 0;
+    }
+
+    Metrics::countReply(ERROR::SUCCESS);
+    memcpy(conn->outBuf + start, header, prefix - DTYPE_SIZE);
+    placeInt(conn->outBuf + start, type, prefix - DTYPE_SIZE, DTYPE_SIZE);
+
+    conn->outLen = (chunk - conn->outBuf) + placeChunk(conn, chunk, bytesRead);
+    _outputStats.responses.fetch_add(1, memory_order_relaxed);
+
+    // fits in one chunk, end it here without streaming, the empty chunk of
+    // an empty item already ends it
+    if(bytesRead < MAX_CHUNK_SIZE) {
+        if(bytesRead > 0) conn->outLen += placeField(conn, conn->outBuf + conn->outLen, 0, 0, STR_LEN_SIZE);
+        freeStream(stream);
+        return 0;
+    }
+
+    stream->offset = bytesRead;
+
+    return startStream(conn, stream);
+}
+
+
+/**
+ * Hold back further frames and stream the rest of an item whenever the socket is writable
+ * @param conn Connection the item is streamed to
+ * @param stream Stream state, owned by the connection until the stream ends
+ * @return 0 if started, -1 if the connection could not be switched over
+ */
+int CSServer::startStream(Connection* conn, stream_s* stream)
+{
+    struct epoll_event event;
+
+    conn->stream = stream;
+
+    // level triggered so every turn sends another batch while the socket takes it
+    event.events = STREAM_EVENTS;
+    event.data.ptr = conn;
+
+    if(epoll_ctl(conn->thread->epfd, EPOLL_CTL_MOD, conn->cl, &event) != 0) {
+        perror("epoll_ctl starting stream");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Write the next chunks of a GET stream, at most STREAM_CHUNKS_PER_TURN so one
+ * large item does not starve the other connections on the reactor
+ * @param conn Connection to stream to
+ * @return 0 if the connection should stay open, -1 if it should be closed
+ */
+int CSServer::pumpStream(Connection* conn)
+{
+    char* chunk;
+    ssize_t bytesRead;
+    uint64_t opStart;
+    DTYPE type;
+    request_info_s requestInfo;
+    stream_s* stream = conn->stream;
+
+    if(stream == nullptr || conn->state != CONN_STATE::ACTIVE) return 0;
+
+    if(stream->fd >= 0) return pumpFile(conn);
+
+    requestInfo.uid = stream->uid;
+    requestInfo.perms = "r";
+    requestInfo.isAdmin = conn->isAdmin;
+
+    for(int i = 0; i < STREAM_CHUNKS_PER_TURN; i++) {
+        if(flushOutput(conn) != 0) return -1;
+
+        // socket is full, continue once it drains
+        if(conn->outLen > 0) return 0;
+
+        if(reserveOutput(conn, STR_LEN_SIZE + MAX_CHUNK_SIZE) != 0) return -1;
+
+        chunk = conn->outBuf + conn->outLen;
+        opStart = nowNs();
+        bytesRead = _dbam.getItemData(DEFAULT_DB, stream->path, requestInfo, chunk + STR_LEN_SIZE, &type, MAX_CHUNK_SIZE, stream->offset);
+        Metrics::recordOp(METRIC_OP::OP_GET_ITEM_DATA, nowNs() - opStart);
+
+        // the item can no longer be read, the reply is already under way so it just ends
+        if(bytesRead < 0) bytesRead = 0;
+
+        conn->outLen += placeChunk(conn, chunk, bytesRead);
+        stream->offset += bytesRead;
+
+        // empty chunk ends the item
+        if(bytesRead == 0) return endStream(conn);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Write the next chunks of a GET stream sent from the item file. Each chunk
+ * length goes out ahead of its data, which is handed to sendFile and may be
+ * sent in several parts as the socket drains.
+ * @param conn Connection to stream to
+ * @return 0 if the connection should stay open, -1 if it should be closed
+ */
+int CSServer::pumpFile(Connection* conn)
+{
+    ssize_t sent;
+    size_t size;
+    int lengthSize;
+    char length[MAX_VARINT_SIZE];
+    stream_s* stream = conn->stream;
+
+    for(int i = 0; i < STREAM_CHUNKS_PER_TURN; i++) {
+        if(stream->chunkLeft == 0) {
+            size = stream->size - stream->offset;
+            if(size > MAX_CHUNK_SIZE) size = MAX_CHUNK_SIZE;
+
+            lengthSize = placeField(conn, length, size, 0, STR_LEN_SIZE);
+            if(appendBytes(&conn->outBuf, &conn->outLen, &conn->outCap, length, lengthSize) != 0) return -1;
+
+            // empty chunk ends the item
+            if(size == 0) return endStream(conn);
+
+            stream->chunkLeft = size;
+        }
+
+        // staged output has to reach the socket before file data behind it
+        if(flushOutput(conn) != 0) return -1;
+        if(conn->outLen > 0) return 0;
+
+        if((sent = sendFile(conn, stream->fd, stream->offset, stream->chunkLeft)) < 0) return -1;
+
+        // socket is full, continue once it drains
+        if(sent == 0) return 0;
+
+        stream->offset += sent;
+        stream->chunkLeft -= sent;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Send part of a file to a client. Local clients and those with kernel TLS
+ * active are sent straight from the page cache, otherwise the data is read
+ * into the out buffer and written by the next flush.
+ * @param conn The connection to send to
+ * @param fd The file to send from
+ * @param offset Offset in the file to send from
+ * @param size Maximum number of bytes to send
+ * @return Number of bytes sent or staged, 0 if the socket is full, -1 on error
+ */
+ssize_t CSServer::sendFile(Connection* conn, int fd, off_t offset, size_t size)
+{
+    ssize_t bytesRead;
+
+    // nothing to encrypt for local clients, the kernel sends straight from the file
+    if(conn->ssl == nullptr) {
+        ssize_t sent = sendfile(conn->cl, fd, &offset, size);
+
+        if(sent > 0) {
+            _outputStats.sendfileBytes.fetch_add(sent, memory_order_relaxed);
+            return sent;
+        }
+
+        return sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+    if(ktlsSend(conn->ssl)) {
+        ossl_ssize_t sent = SSL_sendfile(conn->ssl, fd, offset, size, 0);
 
-    while(true) {
-        if(sem_wait(&(thread->mutex)) != 0) err(2, "sem_wait on thread mutex");
+        if(sent > 0) {
+            _outputStats.sendfileBytes.fetch_add(sent, memory_order_relaxed);
+            return sent;
+        }
+
+        switch(SSL_get_error(conn->ssl, sent)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            return 0;
+        default:
+            return -1;
+        }
+    }
+#endif
 
-        // handle client
-        handleClient(thread);
+    if(reserveOutput(conn, size) != 0) return -1;
 
-        close(thread->cl);
+    // a short file means it was truncated under us
+    if((bytesRead = pread(fd, conn->outBuf + conn->outLen, size, offset)) <= 0) return -1;
 
-        thread->cl = 0;
-    }
+    conn->outLen += bytesRead;
 
-    return 0;
+    return bytesRead;
 }
 
 
 /**
- * Handle client, called from worker thread when new client available
- * @param thread thread responsible for handling this client
+ * Free a GET stream, closing the item file if it was sent from one
+ * @param stream The stream to free
  */
-void CSServer::handleClient(Thread* thread)
+void CSServer::freeStream(stream_s* stream)
 {
+    if(stream->fd >= 0) close(stream->fd);
+    free(stream);
+}
 
-    printf("Handling client: %d\n", thread->cl);
 
-    // init ssl
-    thread->ssl = SSL_new(_ctx);
+/**
+ * Finish a GET stream, write replies deferred behind it and resume parsing
+ * @param conn Connection whose stream ended
+ * @return 0 if successful, -1 if the connection should be closed
+ */
+int CSServer::endStream(Connection* conn)
+{
+    int ret = 0;
+    Task* task;
+    struct epoll_event event;
 
-    SSL_set_fd(thread->ssl, thread->cl);
+    freeStream(conn->stream);
+    conn->stream = nullptr;
 
-    if (SSL_accept(thread->ssl) <= 0) {
-        ERR_print_errors_fp(stderr);
-    }
-    else {
-        cout << "SSL accepted" << endl;
-        //SSL_write(thread->ssl, reply, strlen(reply));
+    event.events = CLIENT_EVENTS;
+    event.data.ptr = conn;
+
+    if(epoll_ctl(conn->thread->epfd, EPOLL_CTL_MOD, conn->cl, &event) != 0) {
+        perror("epoll_ctl ending stream");
+        ret = -1;
     }
 
-    // continue reading command while connected
-    while(true) 
-    {
-        int bytesRead;
-        // Read from client until full tls record received
-        if((bytesRead = SSL_read(thread->ssl, thread->threadBuf, HEADER_SIZE)) <= 0)
-        {
-            cout << "Client " << thread->cl << " exited\n";
-            break;
-        }
+    while((task = conn->deferred) != nullptr) {
+        conn->deferred = task->next;
 
-        // pass bytes read to server
-        //server.received_data((uint8_t*)thread->threadBuf, bytesRead);
-        if(bytesRead > 0) {            
-            // parse message
-            if(parseMessage(thread) != 0) {
-                cerr << "Received invalid message from client" << endl;
-                break;
-            } 
-        } 
+        if(ret == 0) ret = appendBytes(&conn->outBuf, &conn->outLen, &conn->outCap, task->request.outBuf, task->request.outLen);
+        if(ret == 0) finishCommand(&task->request);
 
+        freeTask(task);
     }
 
-    SSL_shutdown(thread->ssl);
-    SSL_free(thread->ssl);
+    return ret;
 }
 
 
 /**
- * Function for parsing and handling messages from client
- * @param thread The thread managing the current client
- * @param message The message received from the client
- * @return 0 if successfully parsed and handled, error code if not
+ * Read the specified number of bytes from the buffer client descriptor 
+ * up to the given maximum size
+ * @param cl Client file descriptor
+ * @param buf Buffer to read bytes into
+ * @param size Max size to read into buffer
+ * @return The number of bytes read to the given buffer
  */
-int CSServer::parseMessage(Thread* thread)
+int CSServer::readBytes(int cl, char* buf, uint16_t size)
 {
-    thread->session_id = getInt(thread->threadBuf, 0, 4);
-    uint16_t command = getInt(thread->threadBuf, 4, 2);
-    thread->full_command = command;
-    
-    uint8_t flags = (command & 0x0FF0) >> 4;
-    command = command & 0xF00F;
+    int rcvSize = 0;
 
-    cout << "Parsing command: 0x" << hex << command << dec << endl;
+    while(rcvSize < size) {
+        int thisRcvSize = read(cl, (void*)((uint64_t)buf + rcvSize), size - rcvSize);
+        rcvSize += thisRcvSize;
+        //printf("Received %d bytes\n", thisRcvSize);
 
-    switch(command) {
-    case CMD::GET_SESSION_ID:
-        handleGetSessionID(thread);
-        break;
-    case CMD::CREATE_ACCOUNT:
-        handleCreateAccount(thread);
-        break;
-    case CMD::LOGIN:
-        handleLogin(thread);
-        break;
-    case CMD::POST:
-        handlePost(thread, flags);
-        break;
-    default:
-        return -1;
+        if(thisRcvSize <= 0) return rcvSize;
     }
 
-    return 0;
+    return rcvSize;
 }
 
 
 /**
- * Handle get session id command, establishes new session
- * @param thread Thread requesting session ID
+ * Return with error code to given connection
+ * @param conn Connection to write to
+ * @param session_id Session ID to embed
+ * @param command Command to embed
+ * @param code Error code to embed
  */
-void CSServer::handleGetSessionID(Thread* thread)
+void CSServer::returnWithCode(Connection* conn, uint32_t session_id, uint16_t command, int code)
 {
-    char returnBuf[HEADER_SIZE];
-    thread->session_id = _sm.createSession();
+    char returnBuf[MAX_REPLY_HEADER_SIZE+MAX_VARINT_SIZE];
+    int size;
+
+    Metrics::countReply(code);
 
-    placeInt(returnBuf, thread->session_id, 0, IDENT_SIZE);
-    placeInt(returnBuf, CMD::GET_SESSION_ID, IDENT_SIZE, COMMAND_SIZE);
+    size = placeHeader(conn, returnBuf, session_id, command);
+    size += placeField(conn, returnBuf, code, size, ERR_CODE_SIZE);
 
-    SSL_write(thread->ssl, returnBuf, HEADER_SIZE);
+    sendBytes(conn, returnBuf, size);
 }
 
 
 /**
- * Handle creating account by server command
- * @param thread Thread requesting account creation
+ * Place a reply header, followed by the request ID if the request carried one,
+ * in the framing of the connection's protocol version
+ * @param conn Connection or detached request being answered
+ * @param buf Buffer with room for MAX_REPLY_HEADER_SIZE bytes
+ * @param session_id Session ID to embed
+ * @param command Command to embed, with its flag bits
+ * @return Number of bytes placed
  */
-void CSServer::handleCreateAccount(Thread* thread)
+int CSServer::placeHeader(Connection* conn, char* buf, uint32_t session_id, uint16_t command)
 {
-    int err;
-    session_s* session;
-
-    string username, email, password;
-
-    err = 0;
+    if(conn->version == PROTOCOL::PROTOCOL_V2) {
+        uint8_t flags = (command & 0x0FF0) >> 4;
+        uint64_t word = (uint64_t)(flags & 0x0F) << V2_RESOURCE_SHIFT;
+        int size = 1;
+
+        if(flags & HEADER_FLAGS::STREAM_UPLOAD) word |= FLAGS_V2::V2_STREAM_UPLOAD;
+        if(conn->hasRequestId) word |= FLAGS_V2::V2_HAS_REQUEST_ID;
+
+        placeInt(buf, PROTOCOL::PROTOCOL_V2, 0, 1);
+        size += placeVarint(buf, command & 0xF00F, size);
+        size += placeVarint(buf, word, size);
+
+        if(conn->capabilities & CAPABILITY::CAP_WIDE_SESSION) {
+            placeInt(buf, conn->session_token.hi, size, 8);
+            placeInt(buf, conn->session_token.lo, size + 8, 8);
+            size += SESSION_TOKEN_SIZE;
+        } else {
+            placeInt(buf, session_id, size, IDENT_SIZE);
+            size += IDENT_SIZE;
+        }
 
-    // get username string
-    username = scanString(thread->ssl, MAX_LOGIN_FIELD_SIZE, &err);
+        if(conn->hasRequestId) size += placeVarint(buf, conn->requestId, size);
 
-    if(err) {
-        returnWithCode(thread->ssl, thread->session_id, CREATE_ACCOUNT, err);
-        return;
+        return size;
     }
 
-    // get email string
-    email = scanString(thread->ssl, MAX_LOGIN_FIELD_SIZE, &err);
-
-    if(err) {
-        returnWithCode(thread->ssl, thread->session_id, CMD::CREATE_ACCOUNT, err);
-        return;
-    }
+    if(conn->hasRequestId) command |= HEADER_FLAGS::HAS_REQUEST_ID << 4;
 
-    // get password string
-    password = scanString(thread->ssl, MAX_LOGIN_FIELD_SIZE, &err);
+    placeInt(buf, session_id, 0, IDENT_SIZE);
+    placeInt(buf, command, IDENT_SIZE, COMMAND_SIZE);
 
-    if(err) {
-        returnWithCode(thread->ssl, thread->session_id, CMD::CREATE_ACCOUNT, err);
-        return;
-    }
+    if(!conn->hasRequestId) return HEADER_SIZE;
 
+    placeInt(buf, conn->requestId, HEADER_SIZE, REQUEST_ID_SIZE);
 
+    return HEADER_SIZE+REQUEST_ID_SIZE;
+}
 
-    session = _sm.getSession(thread->session_id);
-    if(!err && !session) err = ERROR::NO_SESSION;
 
-    // if format error, return before making account
-    if(err) {
-        returnWithCode(thread->ssl, thread->session_id, CMD::CREATE_ACCOUNT, err);
-        return;
-    }
+/**
+ * Place a length, size or code, fixed size under v1 and a varint under v2
+ * @param conn Connection or detached request being answered
+ * @param buf Buffer to place into
+ * @param value Value to place
+ * @param start Start index for the field in the buffer
+ * @param v1Size Size in bytes of the field under v1
+ * @return Number of bytes placed
+ */
+int CSServer::placeField(Connection* conn, char* buf, uint64_t value, uint16_t start, uint16_t v1Size)
+{
+    if(conn->version == PROTOCOL::PROTOCOL_V2) return placeVarint(buf, value, start);
 
-    // create the account
-    err = _am.createAccount(username.c_str(), email.c_str(), password.c_str());
+    placeInt(buf, value, start, v1Size);
 
-    returnWithCode(thread->ssl, thread->session_id, CMD::CREATE_ACCOUNT, err);
+    return v1Size;
 }
 
 
 /**
- * Handle login command from client
- * @param thread Thread requesting login
+ * Place the length of a GET chunk whose data was read in behind STR_LEN_SIZE
+ * bytes of room. A shorter varint length moves the data up against it.
+ * @param conn Connection the chunk is for
+ * @param chunk Start of the chunk, its data at chunk+STR_LEN_SIZE
+ * @param size Size of the data, at most MAX_CHUNK_SIZE
+ * @return Size of the whole chunk
  */
-void CSServer::handleLogin(Thread* thread)
+size_t CSServer::placeChunk(Connection* conn, char* chunk, size_t size)
 {
-    int err;
-    account_info_s* accountInfo;
-    string username, password;
-    
-    err = 0;
-
-    // get username
-    username = scanString(thread->ssl, MAX_LOGIN_FIELD_SIZE, &err);
+    int lengthSize = placeField(conn, chunk, size, 0, STR_LEN_SIZE);
 
-    if(err) {
-        returnWithCode(thread->ssl, thread->session_id, CMD::LOGIN, err);
-        return;
-    }
+    if(lengthSize < STR_LEN_SIZE) memmove(chunk + lengthSize, chunk + STR_LEN_SIZE, size);
 
-    // get password
-    password = scanString(thread->ssl, MAX_LOGIN_FIELD_SIZE, &err);
+    return lengthSize + size;
+}
 
-    if(err) {
-        returnWithCode(thread->ssl, thread->session_id, CMD::LOGIN, err);
-        return;
-    }
+/**
+ * Wait for the next bytes of the frame
+ * @param conn Connection to read from
+ * @param size Number of bytes
+ * @return Awaitable resuming with a pointer to the bytes in the input buffer
+ */
+CSServer::ReadBytes CSServer::nextBytes(Connection* conn, size_t size)
+{
+    return ReadBytes(conn, size);
+}
 
-    // attempt login and session set
-    accountInfo = _am.login(username.c_str(), password.c_str(), &err);
 
-    if(err) {
-        returnWithCode(thread->ssl, thread->session_id, CMD::LOGIN, err);
-        return;
-    }
+/**
+ * Wait for the next length prefixed string of the frame
+ * @param conn Connection to read from
+ * @param maxSize Max size of the string
+ * @param err Container for error code, set once the string has been read
+ * @return Awaitable resuming with a view of the string in the input buffer
+ */
+CSServer::ReadString CSServer::nextString(Connection* conn, uint16_t maxSize, int* err)
+{
+    return ReadString(this, conn, maxSize, err);
+}
 
-    // set uid in session
-    err = _sm.replaceUid(thread->session_id, accountInfo->uid);
 
-    returnWithCode(thread->ssl, thread->session_id, CMD::LOGIN, err);
+/**
+ * Wait for the next length prefixed data field of the frame
+ * @param conn Connection to read from
+ * @param dataSize Container for size of data
+ * @param err Container for error code, set once the data has been read
+ * @return Awaitable resuming with a pointer to the data in the input buffer
+ */
+CSServer::ReadData CSServer::nextData(Connection* conn, uint32_t* dataSize, int* err)
+{
+    return ReadData(this, conn, dataSize, err);
 }
 
 
 /**
- * Handle post to database
- * @param thread Thread handling post request
- * @param flags Flags associated with this post 
+ * Stage a frame for the client, the handler is held back while too much
+ * output is waiting for the socket
+ * @param conn Connection or detached request to write to
+ * @param buf Frame to write
+ * @param size Size of the frame
+ * @return Awaitable resuming once unsent output is below OUTPUT_HIGH_WATER
  */
-void CSServer::handlePost(Thread* thread, uint8_t flags)
+CSServer::WriteFrame CSServer::writeFrame(Connection* conn, const void* buf, int size)
 {
-    int err;
-    uint16_t dataSize;
-    DTYPE type;
-    PERM perm;
-    request_info_s requestInfo;
-    char* data;
-    session_s* session;
-    string path;
-
-    // check whether this user is logged in
-    session = _sm.getSession(thread->session_id);
+    sendBytes(conn, buf, size);
 
-    if(session == nullptr) {
-        returnWithCode(thread->ssl, thread->session_id, thread->full_command, ERROR::NO_SESSION);
-        return;
-    }
+    return WriteFrame(conn);
+}
 
-    // set post type
-    switch(flags) {
-    case FLAGS::TEXT_RESOURCE:
-        type = DTYPE::TEXT;
-        break;
-    case FLAGS::IMAGE_RESOURCE:
-        type = DTYPE::TEXT;
-        break;
-    case FLAGS::AUDIO_RESOURCE:
-        type = DTYPE::AUDIO;
-        break;
-    case FLAGS::VIDEO_RESOURCE:
-        type = DTYPE::VIDEO;
-        break;
-    case FLAGS::STREAM_RESOURCE:
-        type = DTYPE::STREAM;
-        break;
-    case FLAGS::AUDIO_STREAM_RESOURCE:
-        type = DTYPE::AUDIO_STREAM;
-        break;
-    default:
-        type = DTYPE::NONE;
-        break;
-    }
 
-    if(type == DTYPE::NONE) {
-        returnWithCode(thread->ssl, thread->session_id, thread->full_command, ERROR::TYPE_INVAL);
-        return;
-    }
+/**
+ * Stage a reply carrying an error code, see writeFrame
+ * @param conn Connection or detached request to write to
+ * @param command Command to embed
+ * @param code Error code to embed
+ * @return Awaitable resuming once unsent output is below OUTPUT_HIGH_WATER
+ */
+CSServer::WriteFrame CSServer::writeCode(Connection* conn, uint16_t command, int code)
+{
+    char returnBuf[MAX_REPLY_HEADER_SIZE+MAX_VARINT_SIZE];
+    int size;
 
-    perm = static_cast<PERM>(scanInt(thread->ssl, 1, &err));
+    Metrics::countReply(code);
 
-    if(err) {
-        returnWithCode(thread->ssl, thread->session_id, thread->full_command, err);
-        return;
-    }
+    size = placeHeader(conn, returnBuf, conn->session_id, command);
+    size += placeField(conn, returnBuf, code, size, ERR_CODE_SIZE);
 
+    return writeFrame(conn, returnBuf, size);
+}
 
-    path = scanString(thread->ssl, MAX_PATH_SIZE, &err);
 
-    if(err) {
-        returnWithCode(thread->ssl, thread->session_id, thread->full_command, err);
-        return;
-    }
+bool CSServer::ReadBytes::await_ready()
+{
+    if(conn->inLen - conn->inPos < size) return false;
 
-    data = scanData(thread->ssl, &dataSize, &err);
+    data = conn->inBuf + conn->inPos;
+    conn->inPos += size;
 
-    if(err) {
-        returnWithCode(thread->ssl, thread->session_id, thread->full_command, err);
-        return;
-    }
+    return true;
+}
 
-    requestInfo.uid = session->uid;
-    requestInfo.perms = "w";
 
-    err = _dbam.replaceItem(DEFAULT_DB, path.c_str(), requestInfo, data, dataSize, type, perm);
+bool CSServer::ReadString::await_ready()
+{
+    value = server->scanString(conn, maxSize, err);
 
-    returnWithCode(thread->ssl, thread->session_id, thread->full_command, err);
+    return *err != INCOMPLETE_FRAME;
 }
 
-/**
- * Read the specified number of bytes from the buffer client descriptor 
- * up to the given maximum size
- * @param cl Client file descriptor
- * @param buf Buffer to read bytes into
- * @param size Max size to read into buffer
- * @return The number of bytes read to the given buffer
- */
-int CSServer::readBytes(int cl, char* buf, uint16_t size)
-{
-    int rcvSize = 0;
-
-    while(rcvSize < size) {
-        int thisRcvSize = read(cl, (void*)((uint64_t)buf + rcvSize), size - rcvSize);
-        rcvSize += thisRcvSize;
-        //printf("Received %d bytes\n", thisRcvSize);
 
-        if(thisRcvSize <= 0) return rcvSize;
-    }
+bool CSServer::ReadData::await_ready()
+{
+    data = server->scanData(conn, dataSize, err);
 
-    return rcvSize;
+    return *err != INCOMPLETE_FRAME;
 }
 
 
-/**
- * Return with error code to given ssl socket
- * @param ssl SSL socket to use
- * @param session_id Session ID to embed
- * @param command Command to embed
- * @param code Error code to embed
- */
-void CSServer::returnWithCode(SSL* ssl, uint32_t session_id, uint16_t command, int code)
+bool CSServer::WriteFrame::await_ready()
 {
-    char returnBuf[HEADER_SIZE+ERR_CODE_SIZE];
-    placeInt(returnBuf, session_id, 0, IDENT_SIZE);
-    placeInt(returnBuf, command, IDENT_SIZE, COMMAND_SIZE);
-    placeInt(returnBuf, code, HEADER_SIZE, ERR_CODE_SIZE);
-
-    SSL_write(ssl, returnBuf, HEADER_SIZE+ERR_CODE_SIZE);
+    // detached requests and closing connections never wait on the socket
+    return conn->state != CONN_STATE::ACTIVE || conn->outLen <= OUTPUT_HIGH_WATER;
 }
 
+
 /**
- * Scan string from the ssl context, return new C string stored on heap
- * @param ssl SSL socket to use
+ * Scan string from the connection input buffer without copying it
+ * @param conn Connection to parse from
  * @param maxSize Max size of the string to parse
- * @parm err Pointer to error code container
+ * @parm err Pointer to error code container, INCOMPLETE_FRAME if not fully buffered
+ * @return View of the string in the input buffer, valid until the frame has been handled
  */
-string CSServer::scanString(SSL* ssl, uint16_t maxSize, int* err)
+string_view CSServer::scanString(Connection* conn, uint16_t maxSize, int* err)
 {
-    uint16_t strSize;
-    char buf[STR_LEN_SIZE];
-    char* ret;
+    uint64_t strSize;
+    size_t available = conn->inLen - conn->inPos;
+    int prefix = peekField(conn, conn->inPos, STR_LEN_SIZE, &strSize);
 
-    if(SSL_read(ssl, buf, STR_LEN_SIZE) < STR_LEN_SIZE) {
-        if(err) *err = ERROR::COMMAND_FORMAT;
-        return string();
+    if(prefix == INCOMPLETE_FRAME) {
+        if(err) *err = INCOMPLETE_FRAME;
+        return string_view();
     }
 
-    strSize = getInt(buf, STR_LEN_SIZE);
-
-    if(strSize > maxSize || strSize == 0) {
+    if(prefix == 0 || strSize > maxSize || strSize == 0) {
         if(err) *err = ERROR::COMMAND_FORMAT;
-        return string();
+        return string_view();
     }
 
-    ret = (char*) malloc (strSize+1);
-
-    if(SSL_read(ssl, ret, strSize) < strSize) {
-        if(err) *err = ERROR::COMMAND_FORMAT;
-        free(ret);
-        return string();
+    if(available < prefix + strSize) {
+        if(err) *err = INCOMPLETE_FRAME;
+        return string_view();
     }
 
-    ret[strSize] = 0;
+    const char* start = conn->inBuf + conn->inPos + prefix;
+    conn->inPos += prefix + strSize;
 
-    string toRet(ret);
+    if(err) *err = 0;
 
-    free(ret);
-
-    *err = 0;
-    return toRet;
+    // strings may be zero padded to their field size
+    return string_view(start, strnlen(start, strSize));
 }
 
 
 /**
- * Scan data from the SSL stream
- * @param ssl SSL socket to parse data from
+ * Scan data from the connection input buffer without copying it. Under v2
+ * the size is a varint, data that could never fit the input buffer is refused.
+ * @param conn Connection to parse data from
  * @param dataSize Container for size of data
- * @param err Cointainer for error code
+ * @param err Cointainer for error code, INCOMPLETE_FRAME if not fully buffered
+ * @return Pointer to the data in the input buffer, valid until the frame has been handled
  */
-char* CSServer::scanData(SSL* ssl, uint16_t* dataSize, int* err)
+const char* CSServer::scanData(Connection* conn, uint32_t* dataSize, int* err)
 {
-    uint16_t size;
-    char buf[STR_LEN_SIZE];
-    char* ret;
+    uint64_t size;
+    const char* ret;
+    size_t available = conn->inLen - conn->inPos;
+    int prefix = peekField(conn, conn->inPos, STR_LEN_SIZE, &size);
 
-    if(SSL_read(ssl, buf, STR_LEN_SIZE) < STR_LEN_SIZE) {
-        if(err) *err = ERROR::COMMAND_FORMAT;
+    if(prefix == INCOMPLETE_FRAME) {
+        if(err) *err = INCOMPLETE_FRAME;
         return nullptr;
     }
 
-    size = getInt(buf, STR_LEN_SIZE);
-
-    if(size == 0) {
+    if(prefix == 0 || size == 0 || size > MAX_INPUT_BUF_SIZE) {
         if(err) *err = ERROR::COMMAND_FORMAT;
         return nullptr;
     }
 
-    ret = (char*) malloc (size);
-
-    if(SSL_read(ssl, ret, size) < size) {
-        if(err) *err = ERROR::COMMAND_FORMAT;
-        free(ret);
+    if(available < prefix + size) {
+        if(err) *err = INCOMPLETE_FRAME;
         return nullptr;
     }
 
+    ret = conn->inBuf + conn->inPos + prefix;
+    conn->inPos += prefix + size;
+
     *dataSize = size;
-    *err = 0;
+    if(err) *err = 0;
     return ret;
 }
 
 
 /**
- * Scan int value from SSL stream
- * @param ssl SSL socket to parse int from
+ * Scan int value from the connection input buffer
+ * @param conn Connection to parse int from
  * @param size Size of int in bytes
- * @param err Container for error code
+ * @param err Container for error code, INCOMPLETE_FRAME if not fully buffered
  */
-uint64_t CSServer::scanInt(SSL* ssl, uint16_t size, int* err)
+uint64_t CSServer::scanInt(Connection* conn, uint16_t size, int* err)
 {
     uint64_t ret;
-    char* buf = (char*) malloc (size);
-    
-    if(SSL_read(ssl, buf, size) < size) {
-        if(err) *err = ERROR::COMMAND_FORMAT;
+
+    if(conn->inLen - conn->inPos < size) {
+        if(err) *err = INCOMPLETE_FRAME;
+        return 0;
+    }
+
+    ret = getInt(conn->inBuf + conn->inPos, size);
+    conn->inPos += size;
+
+    if(err) *err = 0;
+    return ret;
+}
+
+
+/**
+ * Scan a size field from the connection input buffer, fixed size under v1
+ * and a varint under v2
+ * @param conn Connection to parse the field from
+ * @param v1Size Size of the field in bytes under v1
+ * @param err Container for error code, INCOMPLETE_FRAME if not fully buffered
+ * @return The parsed value
+ */
+uint64_t CSServer::scanField(Connection* conn, uint16_t v1Size, int* err)
+{
+    uint64_t ret;
+    int prefix = peekField(conn, conn->inPos, v1Size, &ret);
+
+    if(prefix <= 0) {
+        if(err) *err = prefix == INCOMPLETE_FRAME ? INCOMPLETE_FRAME : ERROR::COMMAND_FORMAT;
         return 0;
     }
 
-    ret = getInt(buf, size);
+    conn->inPos += prefix;
 
-    free(buf);
+    if(err) *err = 0;
     return ret;
 }
 
 
+/**
+ * Read a length or size field without consuming it
+ * @param conn Connection to read from
+ * @param pos Position of the field in the input buffer
+ * @param v1Size Size of the field in bytes under v1
+ * @param value Container for the value
+ * @return Size of the field, INCOMPLETE_FRAME if not fully buffered, 0 if malformed
+ */
+int CSServer::peekField(Connection* conn, size_t pos, uint16_t v1Size, uint64_t* value)
+{
+    if(conn->version == PROTOCOL::PROTOCOL_V2) return getVarint(conn->inBuf + pos, conn->inLen - pos, value);
+
+    if(conn->inLen - pos < v1Size) return INCOMPLETE_FRAME;
+
+    *value = getInt(conn->inBuf + pos, v1Size);
+
+    return v1Size;
+}
+
+
+/**
+ * Copy a scanned field into a null terminated buffer
+ * @param dest Buffer to copy into
+ * @param destSize Size of the destination buffer
+ * @param field Field to copy, truncated if it does not fit
+ */
+void CSServer::copyField(char* dest, size_t destSize, string_view field)
+{
+    size_t size = field.size() < destSize ? field.size() : destSize - 1;
+
+    memcpy(dest, field.data(), size);
+    dest[size] = 0;
+}
+
+
 /**
  * Returns new c string in heap from source buffer, starting at index 0 and with given size
  * @param src Source buffer to read string from
@@ -708,7 +4081,7 @@ uint64_t CSServer::getInt(const char* src, uint16_t start, uint16_t size)
     uint64_t result = 0;
     // go from back to front, add based on powers of 8
     for(int i = (start+size)-1; i >= start; --i) {
-        result += static_cast<uint8_t>(src[i]) << 8*place;
+        result += static_cast<uint64_t>(static_cast<uint8_t>(src[i])) << 8*place;
         place++;
     }
 
@@ -731,4 +4104,56 @@ void CSServer::placeInt(void* buf, uint64_t value, uint16_t start, uint16_t size
         buffer[i] = (char)(value & 0xFF);
         value = value >> 8; 
     }
-}
\ No newline at end of file
+}
+
+
+/**
+ * Read a LEB128 varint, seven bits a byte starting with the lowest, the top
+ * bit set on every byte but the last
+ * @param src Buffer to read from
+ * @param available Number of bytes buffered at src
+ * @param value Container for the value
+ * @return Number of bytes read, INCOMPLETE_FRAME if not fully buffered, 0 if longer than MAX_VARINT_SIZE
+ */
+int CSServer::getVarint(const char* src, size_t available, uint64_t* value)
+{
+    uint64_t result = 0;
+    uint8_t byte;
+
+    for(int i = 0; i < MAX_VARINT_SIZE; i++) {
+        if((size_t)i >= available) return INCOMPLETE_FRAME;
+
+        byte = src[i];
+        result |= (uint64_t)(byte & 0x7F) << (7*i);
+
+        if(!(byte & 0x80)) {
+            *value = result;
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Place a LEB128 varint into the given buffer
+ * @param buf Buffer with room for MAX_VARINT_SIZE bytes from start
+ * @param value Value to place
+ * @param start Start index for the varint in the buffer
+ * @return Number of bytes placed
+ */
+int CSServer::placeVarint(void* buf, uint64_t value, uint16_t start)
+{
+    char* buffer = (char*)buf + start;
+    int size = 0;
+
+    while(value >= 0x80) {
+        buffer[size++] = (char)((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+
+    buffer[size++] = (char)value;
+
+    return size;
+}
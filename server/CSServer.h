@@ -1,84 +1,631 @@
 /**
  * Author: Ryan Steinwert
- * 
+ *
  * Header file for main Common Sense Social server class
  */
 
 #define DEFAULT_BUF_SIZE 4096
+#define THREAD_BUF_SIZE 65536
+#define MAX_INPUT_BUF_SIZE 1048576
+// a compressed body may claim at most this many times its size once inflated
+#define MAX_INFLATE_RATIO 64
 
-#include <semaphore.h>
+// largest reply header and request ID of either protocol version, v2 is a
+// version byte, varint command and flags, session token and varint request ID
+#define MAX_REPLY_HEADER_SIZE 32
+
+// staged replies are flushed early once they fill a TLS record
+#define OUTPUT_FLUSH_THRESHOLD 16384
+// handlers writing past this much unsent output suspend until the socket drains
+#define OUTPUT_HIGH_WATER 262144
+
+#define MAX_EVENTS 64
+
+#define DEFAULT_NUM_THREADS 4
+#define DEFAULT_QUEUE_DEPTH 1024
+#define DEFAULT_MAX_CONNECTIONS 16384
+#define DEFAULT_NUM_TASK_THREADS 4
+#define DEFAULT_TASK_QUEUE_DEPTH 1024
+
+// tagged requests beyond this per connection run on the reactor
+#define MAX_REQUESTS_IN_FLIGHT 64
+
+// chunks written for a GET stream each time its socket is serviced
+#define STREAM_CHUNKS_PER_TURN 8
+
+// deadlines enforced by each reactor's timer wheel
+#define HANDSHAKE_TIMEOUT_MS 10000
+#define READ_TIMEOUT_MS 30000
+#define IDLE_TIMEOUT_MS 300000
+
+// peer uids mapped to admin on the local socket
+#define MAX_ADMIN_UIDS 16
+// local clients need the server's group to connect
+#define LOCAL_SOCKET_MODE 0660
+
+// how long a stats client may stall the acceptor while its stats are written
+#define STATS_SEND_TIMEOUT_S 1
+
+// how long either side of a listener handoff waits on the other
+#define HANDOFF_TIMEOUT_S 5
+// listeners passed in one handoff, the SCM_RIGHTS limit
+#define MAX_HANDOFF_FDS 253
+
+// connections still busy this long after a drain starts are closed anyway
+#define DRAIN_TIMEOUT_MS 30000
+// how often draining reactors look for connections gone idle
+#define DRAIN_POLL_MS 100
+
+// how often the acceptor removes expired sessions
+#define SESSION_SWEEP_MS 1000
+// how often the session persister appends session changes to the delta
+#define SESSION_FLUSH_MS 1000
+// how often the whole session table is snapshotted, starting a new delta
+#define SESSION_SNAPSHOT_MS 60000
+
+// internal parse result, a frame is not fully buffered yet
+#define INCOMPLETE_FRAME -1
+// internal parse result, the request is run on the reactor instead of the task pool
+#define RUN_INLINE -2
+
+#include <atomic>
+#include <climits>
 #include <cstdint>
+#include <cstdio>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+
+#include <sys/types.h>
 
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/ssl.h>
 
 #include "CSDB/CSDBAccessManager.h"
 #include "SessionManager.h"
 #include "AccountManager.h"
+#include "BoundedQueue.h"
+#include "Handler.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include "RateLimiter.h"
+#include "TicketKeyRing.h"
+#include "TimerWheel.h"
 
 
-typedef struct Thread {
+// mac context handed to the ticket key callback differs between OpenSSL versions
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX ticket_mac_ctx;
+#else
+typedef HMAC_CTX ticket_mac_ctx;
+#endif
+
+
+/**
+ * TLS state of a client connection
+ */
+enum CONN_STATE {
+    HANDSHAKE = 0,
+    ACTIVE = 1,
+    CLOSING = 2,
+    // request copy run on the task pool, only stages its reply
+    DETACHED = 3
+};
+
+
+/**
+ * Deadline a connection's timer is armed for
+ */
+enum DEADLINE {
+    NO_DEADLINE = 0,
+    // TLS handshake has to finish
+    HANDSHAKE_DEADLINE = 1,
+    // a frame that has started arriving has to finish
+    READ_DEADLINE = 2,
+    // connection with nothing in progress, pushed back by activity
+    IDLE_DEADLINE = 3
+};
+
+
+struct Thread;
+struct Task;
+
+
+/**
+ * Item being streamed to a client by GET, parsing resumes once it has ended
+ */
+typedef struct stream_t {
+    char path[MAX_PATH_SIZE+1];
+    char uid[MAX_LOGIN_FIELD_SIZE+1];
+    size_t offset;
+
+    // media is sent from the item file, -1 when read through the item
+    int fd;
+    size_t size;
+    size_t chunkLeft;
+} stream_s;
+
+
+/**
+ * Streamed POST in progress, data is written to a temp file as it arrives and
+ * committed once all of it has been received. After an error the remaining
+ * data is still read and dropped so the next frame is found.
+ */
+typedef struct upload_t {
+    int fd;
+    int err;
+    DTYPE type;
+    PERM perm;
+    uint64_t size;
+    uint64_t remaining;
+    char path[MAX_PATH_SIZE+1];
+    char uid[MAX_LOGIN_FIELD_SIZE+1];
+    char tempPath[PATH_MAX];
+} upload_s;
+
+
+/**
+ * Per-connection state, owned by the worker reactor it was assigned to
+ */
+typedef struct Connection {
     int cl;
+    CONN_STATE state;
+    bool rejected;
+    uint64_t queuedAt;
     uint32_t session_id;
+    // session of the frame being handled, 0:session_id without CAP_WIDE_SESSION
+    session_token_s session_token;
     uint16_t full_command;
-    sem_t mutex;
+    // null for local clients, which skip TLS
     SSL* ssl;
-    char threadBuf[DEFAULT_BUF_SIZE];
+
+    // reactor the connection is registered with, and its neighbours in the reactor's list
+    struct Thread* thread;
+    struct Connection* prev;
+    struct Connection* next;
+
+    // deadline on the reactor's timer wheel, and when it last saw activity
+    timer_entry_s timer;
+    DEADLINE deadline;
+    uint64_t lastActive;
+
+    // local client whose peer credentials map to admin, database rules are skipped
+    bool isAdmin;
+
+    // protocol version negotiated by HELLO, frames in both directions use it,
+    // and the CAPABILITY bits granted with it
+    uint8_t version;
+    uint8_t capabilities;
+
+    // request ID of the frame being handled, echoed in its reply
+    bool hasRequestId;
+    uint32_t requestId;
+
+    // frame being parsed has taken its rate limit tokens, kept while it is resumed
+    bool admitted;
+
+    // when the header of the command being handled was parsed, 0 if it is not timed
+    uint64_t startedNs;
+
+    // tagged requests still running on the task pool, and finished ones
+    // waiting for a GET stream to end
+    int inFlight;
+    struct Task* deferred;
+
+    // handler suspended part way through a frame, resumed as more arrives
+    handler_handle handler;
+
+    // GET stream in progress
+    stream_s* stream;
+
+    // streamed POST in progress
+    upload_s* upload;
+
+    // buffered input, inPos is the parse cursor. While frames are parsed
+    // straight from the thread buffer inBuf borrows it and inCap is 0
+    char* inBuf;
+    size_t inLen;
+    size_t inPos;
+    size_t inCap;
+
+    // replies staged this turn and output waiting for the socket to become writable
+    char* outBuf;
+    size_t outLen;
+    size_t outCap;
+} Connection;
+
+
+/**
+ * Worker reactor, each owns an epoll instance and the connections registered with it
+ */
+typedef struct Thread {
+    int epfd;
+    int listenSock;
+    int core;
+    int numConnections;
+    Connection* connections;
+    char threadBuf[THREAD_BUF_SIZE];
+
+    // deadlines of the connections registered here
+    TimerWheel* timers;
+
+    // requests finished by the task pool, signalled through completionEvent
+    BoundedQueue<Task*>* completions;
+    int completionEvent;
 } Thread;
 
+
+/**
+ * Tagged request handed to the task pool. The handler runs against a detached
+ * copy of the connection holding the frame, its reply is staged there and
+ * written by the owning reactor once the task completes
+ */
+typedef struct Task {
+    Connection* conn;
+    Thread* thread;
+    uint16_t command;
+    uint8_t flags;
+    int result;
+    Connection request;
+    struct Task* next;
+} Task;
+
+
+/**
+ * Counters for the pending connection queue between acceptor and workers
+ */
+typedef struct queue_stats_t {
+    std::atomic<uint64_t> enqueued;
+    std::atomic<uint64_t> dequeued;
+    std::atomic<uint64_t> rejected;
+    // accepted on the local socket
+    std::atomic<uint64_t> local;
+    std::atomic<uint64_t> maxDepth;
+    std::atomic<uint64_t> totalWaitNs;
+    std::atomic<uint64_t> maxWaitNs;
+} queue_stats_s;
+
+
+/**
+ * Counters for TLS handshakes, resumed ones skip the expensive key exchange
+ */
+typedef struct tls_stats_t {
+    std::atomic<uint64_t> fullHandshakes;
+    std::atomic<uint64_t> resumedHandshakes;
+    std::atomic<uint64_t> failedHandshakes;
+    std::atomic<uint64_t> ktlsSend;
+} tls_stats_s;
+
+
+/**
+ * Counters for compressed request bodies, bytes as sent and once inflated
+ */
+typedef struct compression_stats_t {
+    std::atomic<uint64_t> frames;
+    std::atomic<uint64_t> failed;
+    std::atomic<uint64_t> wireBytes;
+    std::atomic<uint64_t> bodyBytes;
+} compression_stats_s;
+
+
+/**
+ * Counters for coalesced output, responses per flush is the batching ratio
+ */
+typedef struct output_stats_t {
+    std::atomic<uint64_t> responses;
+    std::atomic<uint64_t> flushes;
+    std::atomic<uint64_t> blockedFlushes;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> sendfileBytes;
+} output_stats_s;
+
+
+/**
+ * Counters for connections closed by a deadline
+ */
+typedef struct timeout_stats_t {
+    std::atomic<uint64_t> handshakes;
+    std::atomic<uint64_t> reads;
+    std::atomic<uint64_t> idles;
+} timeout_stats_s;
+
+
+/**
+ * Server settings chosen on the command line
+ */
+typedef struct server_options_t {
+    int numThreads = DEFAULT_NUM_THREADS;
+    int queueDepth = DEFAULT_QUEUE_DEPTH;
+    int maxConnections = DEFAULT_MAX_CONNECTIONS;
+    // threads running slow tagged requests, 0 runs everything on the reactors
+    int numTaskThreads = DEFAULT_NUM_TASK_THREADS;
+    // each worker binds its own listener with SO_REUSEPORT instead of sharing the queue
+    bool reusePort = false;
+    // pin each worker thread to its own core
+    bool pinThreads = false;
+    // enable kernel TLS so item files can be sent with sendfile
+    bool ktls = false;
+    // plaintext unix socket for trusted services on the same host, none if null
+    const char* localPath = nullptr;
+    // peer uids on the local socket whose requests run as admin
+    uid_t adminUids[MAX_ADMIN_UIDS] = {};
+    int numAdminUids = 0;
+    // unix socket answering every connection with the current stats, none if null
+    const char* statsPath = nullptr;
+    // unix socket a replacement server takes the listeners over from, none if null
+    const char* handoffPath = nullptr;
+    // command line, rerun to start a replacement
+    char** argv = nullptr;
+    // seconds a session lives without being used, 0 to never expire sessions
+    uint32_t sessionTtl = DEFAULT_SESSION_TTL_S;
+    // sessions kept before the least recently used are evicted
+    size_t maxSessions = DEFAULT_MAX_SESSIONS;
+    // logged in sessions are snapshotted here and restored on start, none if null
+    const char* sessionPath = nullptr;
+    // token buckets of each command class, per session and per account
+    rate_limit_s rateLimits[NUM_RATE_CLASSES] = {
+        {DEFAULT_AUTH_RATE, DEFAULT_AUTH_BURST},
+        {DEFAULT_WRITE_RATE, DEFAULT_WRITE_BURST},
+        {DEFAULT_READ_RATE, DEFAULT_READ_BURST}
+    };
+} server_options_s;
+
+
 class CSServer {
 public:
-    CSServer                            (int numCores);
+    CSServer                            (server_options_s options);
     ~CSServer                           ();
 
     void startup                        ();
 
+    void dumpQueueStats                 (FILE* file);
+    void dumpTlsStats                   (FILE* file);
+    void dumpOutputStats                (FILE* file);
+    void dumpTimeoutStats               (FILE* file);
+    void dumpCompressionStats           (FILE* file);
+    void dumpStats                      (FILE* file);
+
 
 private:
 
     int _numThreads;
+    int _maxConnections;
+    bool _reusePort;
+    bool _ktls;
     uint16_t _port;
 
-    sem_t _mutex;
-
     bool _shouldExit;
 
     Thread* _threadPool;
 
-    // ssl context
+    // acceptor reactor, only serves connections being turned away
+    Thread _acceptor;
+
+    // accepted connections waiting for a worker with capacity
+    BoundedQueue<Connection*> _pending;
+    int _pendingEvent;
+    queue_stats_s _queueStats;
+
+    // ssl context, its session cache is shared by every worker
     SSL_CTX* _ctx;
+    TicketKeyRing _ticketKeys;
+    tls_stats_s _tlsStats;
 
-    CSDBAccessManager _dbam; 
-    SessionManager _sm;
+    output_stats_s _outputStats;
+    timeout_stats_s _timeoutStats;
+    compression_stats_s _compressionStats;
+
+    // local listener, served by the acceptor, and the peers mapped to admin
+    const char* _localPath;
+    int _localSock;
+    uid_t _adminUids[MAX_ADMIN_UIDS];
+    int _numAdminUids;
+
+    // stats endpoint, served by the acceptor
+    const char* _statsPath;
+    int _statsSock;
+
+    // listener handoff to a replacement server, and the command line that starts one
+    const char* _handoffPath;
+    int _handoffSock;
+    bool _handedOff;
+    char** _argv;
+
+    // shared listener when not sharded
+    int _listenSock;
+
+    // SIGTERM, SIGINT, SIGUSR2 and SIGCHLD, read by the acceptor
+    int _signalFd;
+
+    // set once the server stops accepting, reactors close connections as
+    // they go idle and exit once they have none
+    std::atomic<bool> _draining;
+    std::atomic<uint64_t> _drainDeadline;
+    std::atomic<int> _liveThreads;
+
+    // task pool for tagged requests, bounded by the completion queue depth
+    int _numTaskThreads;
+    BoundedQueue<Task*> _tasks;
+    int _taskEvent;
+    std::atomic<int> _tasksInFlight;
+
+    CSDBAccessManager _dbam;
     AccountManager _am;
 
+    // swept by the acceptor every SESSION_SWEEP_MS, flushed and snapshotted
+    // by the persister, which the handoff and shutdown snapshots lock out
+    SessionManager _sm;
+    uint64_t _nextSweepMs;
+    std::mutex _persistMutex;
+    bool _persistStopped;
+
+    RateLimiter _limiter;
+
 
     void* start                         (void* arg);
+    void* runTasks                      (void* arg);
+    void* persistSessions               (void* arg);
+
+    int createListener                  (bool reusePort);
+    void acceptClients                  (int sock, Thread* shard);
+    void acceptLocalClients             ();
+    Connection* createConnection        (int cl, bool local);
+    int attachClient                    (Thread* thread, Connection* conn);
+    void dispatchClient                 (Connection* conn);
+    void rejectClient                   (Connection* conn);
+    void adoptClients                   (Thread* thread);
+    int createUnixListener              (const char* path, mode_t mode);
+    void serveStats                     ();
 
-    void handleClient                   (Thread* thread);
+    // graceful shutdown and restart
+    int takeListeners                   (int* fds);
+    void handOff                        ();
+    void handleSignals                  ();
+    void restart                        ();
+    void startDrain                     ();
+    void finalSnapshot                  ();
+    bool drainThread                    (Thread* thread);
+    bool idleClient                     (Connection* conn);
+    int pollTimeout                     (Thread* thread);
 
-    int parseMessage                    (Thread* thread);
+    void serviceConnection              (Thread* thread, Connection* conn, uint32_t events);
+    int handleClient                    (Connection* conn);
+    void closeClient                    (Thread* thread, Connection* conn);
+    void updateDeadline                 (Thread* thread, Connection* conn);
+    void expireDeadlines                (Thread* thread);
+    void freeClient                     (Connection* conn);
+
+    int parseMessage                    (Connection* conn);
+    int parseHeaderV2                   (Connection* conn, uint16_t* command, uint8_t* flags);
+    int inflateBody                     (Connection* conn, uint16_t command);
+    int runCommand                      (Connection* conn, uint16_t command, uint8_t flags);
+    int startHandler                    (Connection* conn, Handler handler);
+    void finishCommand                  (Connection* conn);
+    int offloadRequest                  (Connection* conn, uint16_t command, uint8_t flags);
+    int measureRequest                  (Connection* conn, uint16_t command, size_t* size);
+    int measureBody                     (Connection* conn, uint16_t command, size_t* size);
+    int measureBatch                    (Connection* conn, size_t* size);
+    int measureFields                   (Connection* conn, size_t pos, const char* fields, size_t* size);
+    const char* requestFields           (uint16_t command);
+    const char* batchFields             (uint8_t op);
+    int admitRequest                    (Connection* conn, uint16_t command);
+    Handler refuseRequest               (Connection* conn, const char* fields, int code);
+    void completeTasks                  (Thread* thread);
+    void freeTask                       (Task* task);
 
     int readBytes                       (int cl, char* buf, uint16_t size);
 
+    int drainInput                      (Thread* thread, Connection* conn);
+    int runFrames                       (Connection* conn);
+    int reserveInput                    (Connection* conn, size_t space);
+    void retainInput                    (Connection* conn);
+    int appendBytes                     (char** buf, size_t* len, size_t* cap, const void* src, size_t size);
+    int reserveOutput                   (Connection* conn, size_t space);
+
+    int sendBytes                       (Connection* conn, const void* buf, int size);
+    int flushOutput                     (Connection* conn);
+    int readClient                      (Connection* conn, void* buf, size_t size);
+    int writeClient                     (Connection* conn, const void* buf, size_t size);
+
     // command handlers
-    void handleGetSessionID             (Thread* thread);
-    void handleCreateAccount            (Thread* thread);
-    void handleLogin                    (Thread* thread);
-    void handlePost                     (Thread* thread, uint8_t flags);
+    int handleGetSessionID              (Connection* conn);
+    int handleHello                     (Connection* conn);
+    Handler handleCreateAccount         (Connection* conn);
+    Handler handleLogin                 (Connection* conn);
+    Handler handlePost                  (Connection* conn, uint8_t flags);
+    int handleGet                       (Connection* conn);
+    int handleUpload                    (Connection* conn, uint8_t flags, int refused = 0);
+    int handleBatch                     (Connection* conn, int refused = 0);
+
+    DTYPE postType                      (uint8_t flags);
+
+    // streamed POST
+    void consumeUpload                  (Connection* conn);
+    void finishUpload                   (Connection* conn);
+    void freeUpload                     (upload_s* upload, bool abort);
+
+    // GET streaming
+    int startStream                     (Connection* conn, stream_s* stream);
+    int pumpStream                      (Connection* conn);
+    int pumpFile                        (Connection* conn);
+    ssize_t sendFile                    (Connection* conn, int fd, off_t offset, size_t size);
+    void freeStream                     (stream_s* stream);
+    int endStream                       (Connection* conn);
 
     // functions for ssl
     void initOpenSSL                    ();
     void cleanupOpenSSL                 ();
     SSL_CTX* createContext              ();
     void configureContext               (SSL_CTX* ctx);
+    void configureSessionResumption     (SSL_CTX* ctx);
+
+    static int ticketKeyCallback        (SSL* ssl, unsigned char* keyName, unsigned char* iv,
+                                         EVP_CIPHER_CTX* cipherCtx, ticket_mac_ctx* macCtx, int enc);
+
+    // awaitables for coroutine handlers, views they return point into the
+    // input buffer and only last until the handler next suspends
+    struct ReadBytes : HandlerAwait {
+        Connection* conn;
+        size_t size;
+        const char* data;
+
+        ReadBytes(Connection* c, size_t n) : conn(c), size(n), data(nullptr) {}
+        bool await_ready() override;
+        const char* await_resume() { return data; }
+    };
+
+    struct ReadString : HandlerAwait {
+        CSServer* server;
+        Connection* conn;
+        uint16_t maxSize;
+        int* err;
+        std::string_view value;
+
+        ReadString(CSServer* s, Connection* c, uint16_t max, int* e) : server(s), conn(c), maxSize(max), err(e) {}
+        bool await_ready() override;
+        std::string_view await_resume() { return value; }
+    };
 
-    void returnWithCode                 (SSL* ssl, uint32_t session_id, uint16_t command, int code);
+    struct ReadData : HandlerAwait {
+        CSServer* server;
+        Connection* conn;
+        uint32_t* dataSize;
+        int* err;
+        const char* data;
 
-    std::string scanString              (SSL* ssl, uint16_t maxSize, int* err = nullptr);
-    char* scanData                      (SSL* ssl, uint16_t* dataSize, int* err = nullptr);
-    uint64_t scanInt                    (SSL* ssl, uint16_t size, int* err = nullptr);
+        ReadData(CSServer* s, Connection* c, uint32_t* size, int* e) : server(s), conn(c), dataSize(size), err(e), data(nullptr) {}
+        bool await_ready() override;
+        const char* await_resume() { return data; }
+    };
+
+    struct WriteFrame : HandlerAwait {
+        Connection* conn;
+
+        WriteFrame(Connection* c) : conn(c) {}
+        bool await_ready() override;
+        void await_resume() {}
+    };
+
+    ReadBytes nextBytes                 (Connection* conn, size_t size);
+    ReadString nextString               (Connection* conn, uint16_t maxSize, int* err);
+    ReadData nextData                   (Connection* conn, uint32_t* dataSize, int* err);
+    WriteFrame writeFrame               (Connection* conn, const void* buf, int size);
+    WriteFrame writeCode                (Connection* conn, uint16_t command, int code);
+
+    void returnWithCode                 (Connection* conn, uint32_t session_id, uint16_t command, int code);
+    int placeHeader                     (Connection* conn, char* buf, uint32_t session_id, uint16_t command);
+    int placeField                      (Connection* conn, char* buf, uint64_t value, uint16_t start, uint16_t v1Size);
+    size_t placeChunk                   (Connection* conn, char* chunk, size_t size);
+
+    std::string_view scanString         (Connection* conn, uint16_t maxSize, int* err = nullptr);
+    const char* scanData                (Connection* conn, uint32_t* dataSize, int* err = nullptr);
+    uint64_t scanInt                    (Connection* conn, uint16_t size, int* err = nullptr);
+    uint64_t scanField                  (Connection* conn, uint16_t v1Size, int* err = nullptr);
+    int peekField                       (Connection* conn, size_t pos, uint16_t v1Size, uint64_t* value);
+
+    void copyField                      (char* dest, size_t destSize, std::string_view field);
 
     char* getCStr                       (const char* src, uint16_t size);
     char* getCStr                       (const char* src, uint16_t start, uint16_t size);
@@ -88,4 +635,7 @@ private:
 
     void placeInt                       (void* buf, uint64_t value, uint16_t start, uint16_t size);
 
-};
\ No newline at end of file
+    int getVarint                       (const char* src, size_t available, uint64_t* value);
+    int placeVarint                     (void* buf, uint64_t value, uint16_t start);
+
+};
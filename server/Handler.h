@@ -0,0 +1,147 @@
+#pragma once
+/**
+ * Author: Ryan Steinwert
+ *
+ * Coroutine type for command handlers, a handler suspends while the fields of
+ * its frame are still arriving and picks up where it left off once they have
+ */
+
+#include <coroutine>
+#include <exception>
+
+
+struct HandlerPromise;
+
+typedef std::coroutine_handle<HandlerPromise> handler_handle;
+
+
+/**
+ * Base of everything a handler can co_await. The reactor checks await_ready
+ * again before resuming, so a resumed handler always finds what it waited for.
+ */
+struct HandlerAwait {
+	virtual bool await_ready() = 0;
+	void await_suspend(handler_handle handle);
+};
+
+
+/**
+ * Handler started for a frame, owns the coroutine until it is released to the
+ * connection it suspended on
+ */
+class Handler {
+public:
+	typedef HandlerPromise promise_type;
+
+	explicit Handler(handler_handle handle);
+	Handler(Handler&& other);
+	~Handler();
+
+	Handler(const Handler&) = delete;
+	Handler& operator=(const Handler&) = delete;
+
+	bool done();
+	int result();
+	handler_handle release();
+
+	static bool resume(handler_handle handle);
+
+private:
+	handler_handle _handle;
+};
+
+
+/**
+ * Coroutine state of a handler, runs eagerly up to its first suspension and
+ * keeps its result once finished
+ */
+struct HandlerPromise {
+	int result = 0;
+	HandlerAwait* waiting = nullptr;
+
+	Handler get_return_object() { return Handler(handler_handle::from_promise(*this)); }
+	std::suspend_never initial_suspend() noexcept { return {}; }
+	std::suspend_always final_suspend() noexcept { return {}; }
+	void return_value(int value) { result = value; }
+	void unhandled_exception() { std::terminate(); }
+};
+
+
+
+/**
+ * Record what a suspending handler waits on
+ * @param handle The handler being suspended
+ */
+inline void HandlerAwait::await_suspend(handler_handle handle)
+{
+	handle.promise().waiting = this;
+}
+
+
+inline Handler::Handler(handler_handle handle) :
+	_handle(handle)
+{
+}
+
+
+inline Handler::Handler(Handler&& other) :
+	_handle(other._handle)
+{
+	other._handle = nullptr;
+}
+
+
+inline Handler::~Handler()
+{
+	if(_handle) _handle.destroy();
+}
+
+
+/**
+ * @return True if the handler ran to completion without suspending
+ */
+inline bool Handler::done()
+{
+	return _handle.done();
+}
+
+
+/**
+ * @return Result the handler finished with, 0 if handled
+ */
+inline int Handler::result()
+{
+	return _handle.promise().result;
+}
+
+
+/**
+ * Give up ownership of a suspended handler, it is freed with destroy()
+ * @return Handle to resume the handler with
+ */
+inline handler_handle Handler::release()
+{
+	handler_handle handle = _handle;
+
+	_handle = nullptr;
+
+	return handle;
+}
+
+
+/**
+ * Resume a suspended handler if what it waits on is ready
+ * @param handle The suspended handler
+ * @return True if the handler ran to completion, false if it is still suspended
+ */
+inline bool Handler::resume(handler_handle handle)
+{
+	HandlerPromise& promise = handle.promise();
+
+	if(!promise.waiting->await_ready()) return false;
+
+	promise.waiting = nullptr;
+	handle.resume();
+
+	return handle.done();
+}
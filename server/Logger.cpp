@@ -0,0 +1,150 @@
+/**
+ * Author: Ryan Steinwert
+ *
+ * Implementation for asynchronous logger
+ */
+
+#include <unistd.h>
+
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+
+#include "Logger.h"
+
+
+std::atomic<log_ring_s*> Logger::_rings(nullptr);
+std::atomic<uint64_t> Logger::_dropped(0);
+
+
+
+/**
+ * Wait until every record queued before the call has been written
+ */
+void Logger::flush()
+{
+	for(log_ring_s* ring = _rings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next)
+	{
+		uint64_t head = ring->head.load(std::memory_order_acquire);
+
+		while(ring->tail.load(std::memory_order_acquire) < head) usleep(LOG_POLL_US);
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+}
+
+
+/**
+ * @return Number of records dropped because their thread's ring was full or
+ * could not be allocated
+ */
+uint64_t Logger::dropped()
+{
+	return _dropped.load(std::memory_order_relaxed);
+}
+
+
+/**
+ * Owner of the calling thread's ring, releases it for reuse when the thread exits
+ */
+typedef struct ring_owner_t {
+	log_ring_s* ring = nullptr;
+
+	~ring_owner_t()
+	{
+		if(ring != nullptr) ring->owned.store(false, std::memory_order_release);
+		ring = nullptr;
+	}
+} ring_owner_s;
+
+
+/**
+ * Ring of the calling thread, claimed from the rings released by exited
+ * threads or created and registered with the writer on first use. The
+ * writer is started with the first ring.
+ * @return The calling thread's ring, null if none could be allocated
+ */
+log_ring_s* Logger::threadRing()
+{
+	static std::once_flag started;
+	thread_local ring_owner_s owner;
+
+	if(owner.ring != nullptr) return owner.ring;
+
+	if((owner.ring = claimRing()) != nullptr) return owner.ring;
+
+	if((owner.ring = (log_ring_s*) calloc (1, sizeof(log_ring_s))) == nullptr) return nullptr;
+
+	owner.ring->owned.store(true, std::memory_order_relaxed);
+
+	// rings are only ever added at the front, the writer walks them from there
+	owner.ring->next = _rings.load(std::memory_order_relaxed);
+	while(!_rings.compare_exchange_weak(owner.ring->next, owner.ring, std::memory_order_release, std::memory_order_relaxed));
+
+	std::call_once(started, []() { std::thread(&Logger::run).detach(); });
+
+	return owner.ring;
+}
+
+
+/**
+ * Take over a ring released by an exited thread. Records it left behind are
+ * still drained in order, the new owner carries on from its head.
+ * @return The claimed ring, null if every ring is owned
+ */
+log_ring_s* Logger::claimRing()
+{
+	for(log_ring_s* ring = _rings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next)
+	{
+		bool owned = false;
+
+		if(ring->owned.compare_exchange_strong(owned, true, std::memory_order_acquire, std::memory_order_relaxed)) return ring;
+	}
+
+	return nullptr;
+}
+
+
+/**
+ * Writer thread, formats queued records and sleeps while there are none
+ */
+void Logger::run()
+{
+	while(true) {
+		if(!drain()) usleep(LOG_POLL_US);
+	}
+}
+
+
+/**
+ * Format and write every queued record, one ring at a time
+ * @return True if anything was written
+ */
+bool Logger::drain()
+{
+	bool wrote = false;
+
+	for(log_ring_s* ring = _rings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next)
+	{
+		uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+		uint64_t head = ring->head.load(std::memory_order_acquire);
+
+		for(; tail < head; tail++)
+		{
+			log_record_s* record = &ring->records[tail % LOG_RING_SIZE];
+			FILE* file = record->level >= LOG_LEVEL_WARN ? stderr : stdout;
+
+			record->print(file, record->format, record->args);
+			fputc('\n', file);
+		}
+
+		if(tail != ring->tail.load(std::memory_order_relaxed)) wrote = true;
+
+		ring->tail.store(tail, std::memory_order_release);
+	}
+
+	if(wrote) fflush(stdout);
+
+	return wrote;
+}
@@ -0,0 +1,198 @@
+#pragma once
+/**
+ * Author: Ryan Steinwert
+ *
+ * Definition for asynchronous logger, records are queued on a ring owned by
+ * the logging thread and formatted by a background writer
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+// calls below this level compile out, set with -DLOG_LEVEL=
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_MAX_ARGS 6
+
+// records per thread, a full ring drops new records instead of blocking
+#define LOG_RING_SIZE 1024
+
+// how long the writer sleeps once every ring is empty
+#define LOG_POLL_US 2000
+
+
+// never evaluated, only lets the compiler check the format against its arguments
+#define LOG_AT(level, ...) do { \
+	if(false) printf(__VA_ARGS__); \
+	Logger::log(level, __VA_ARGS__); \
+} while(0)
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) ((void)0)
+#endif
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+
+/**
+ * Log call waiting to be formatted. Arguments are kept as raw words and
+ * print is instantiated for their types, so formatting happens on the writer.
+ */
+typedef struct log_record_t {
+	int level;
+	const char* format;
+	void (*print)(FILE* file, const char* format, const uint64_t* args);
+	uint64_t args[LOG_MAX_ARGS];
+} log_record_s;
+
+
+/**
+ * Single producer single consumer ring, written by one thread and drained by
+ * the writer. A ring is released when its thread exits and is then claimed by
+ * the next thread that needs one, so short lived threads do not grow the list.
+ */
+typedef struct log_ring_t {
+	alignas(64) std::atomic<uint64_t> head;
+	alignas(64) std::atomic<uint64_t> tail;
+	log_record_s records[LOG_RING_SIZE];
+	std::atomic<bool> owned;
+	struct log_ring_t* next;
+} log_ring_s;
+
+
+
+/**
+ * Process wide logger. Format strings and string arguments must be literals
+ * or otherwise outlive the writer, only their pointers are queued.
+ */
+class Logger {
+public:
+	template <typename... Args>
+	static void log(int level, const char* format, Args... args);
+
+	static void flush();
+	static uint64_t dropped();
+
+private:
+	static std::atomic<log_ring_s*> _rings;
+	static std::atomic<uint64_t> _dropped;
+
+	static log_ring_s* threadRing();
+	static log_ring_s* claimRing();
+	static void run();
+	static bool drain();
+
+	template <typename T>
+	static T argAt(const uint64_t* args, size_t i);
+
+	template <typename... Args, size_t... I>
+	static void printArgs(FILE* file, const char* format, const uint64_t* args, std::index_sequence<I...>);
+
+	template <typename... Args>
+	static void print(FILE* file, const char* format, const uint64_t* args);
+};
+
+
+
+/**
+ * Queue a log record without formatting it, never blocks
+ * @param level Level of the record, warnings and errors go to stderr
+ * @param format printf style format
+ * @param args Arguments, each at most 8 bytes and trivially copyable
+ */
+template <typename... Args>
+void Logger::log(int level, const char* format, Args... args)
+{
+	static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many log arguments");
+	static_assert(((sizeof(Args) <= sizeof(uint64_t) && std::is_trivially_copyable<Args>::value) && ...),
+	              "log arguments are queued as 8 byte words");
+
+	log_ring_s* ring = threadRing();
+	uint64_t head;
+	log_record_s* record;
+	size_t i = 0;
+
+	// no ring could be allocated for this thread
+	if(ring == nullptr) {
+		_dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	head = ring->head.load(std::memory_order_relaxed);
+
+	if(head - ring->tail.load(std::memory_order_acquire) >= LOG_RING_SIZE) {
+		_dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	record = &ring->records[head % LOG_RING_SIZE];
+	record->level = level;
+	record->format = format;
+	record->print = &print<Args...>;
+
+	(memcpy(&record->args[i++], &args, sizeof(Args)), ...);
+	(void)i;
+
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+
+template <typename T>
+T Logger::argAt(const uint64_t* args, size_t i)
+{
+	T value;
+
+	memcpy(&value, &args[i], sizeof(T));
+
+	return value;
+}
+
+
+template <typename... Args, size_t... I>
+void Logger::printArgs(FILE* file, const char* format, const uint64_t* args, std::index_sequence<I...>)
+{
+	fprintf(file, format, argAt<Args>(args, I)...);
+}
+
+
+/**
+ * Format a record on the writer thread
+ * @param file File to print to
+ * @param format printf style format
+ * @param args Queued argument words
+ */
+template <typename... Args>
+void Logger::print(FILE* file, const char* format, const uint64_t* args)
+{
+	if constexpr (sizeof...(Args) == 0) {
+		(void)args;
+		fputs(format, file);
+	} else {
+		printArgs<Args...>(file, format, args, std::index_sequence_for<Args...>());
+	}
+}
@@ -0,0 +1,208 @@
+/**
+ * Author: Ryan Steinwert
+ *
+ * Tests for metrics module
+ */
+
+#include <cstdio>
+#include <cstring>
+
+
+#include "../Metrics.h"
+#include "../definitions.h"
+
+typedef struct summary_t {
+	uint64_t count;
+	uint64_t meanNs;
+	uint64_t p50Ns;
+	uint64_t p90Ns;
+	uint64_t p99Ns;
+	uint64_t p999Ns;
+	uint64_t maxNs;
+} summary_s;
+
+int bucketEdgeTests();
+int bucketPrecisionTests();
+int percentileTests();
+int smallHistogramTests();
+
+int readSummary(const char* name, summary_s* summary);
+
+void printResult(FILE* file, int testResult);
+
+int main()
+{
+	FILE* out = stdout;
+
+
+	fprintf(out, "Bucket edge tests: ");
+	printResult(out, bucketEdgeTests());
+
+	fprintf(out, "Bucket precision tests: ");
+	printResult(out, bucketPrecisionTests());
+
+	fprintf(out, "Percentile tests: ");
+	printResult(out, percentileTests());
+
+	fprintf(out, "Small histogram tests: ");
+	printResult(out, smallHistogramTests());
+}
+
+
+/**
+ * Small latencies get a bucket each, above that every bucket starts where
+ * the one before it ends, and latencies past the top share the last bucket
+ */
+int bucketEdgeTests()
+{
+	uint64_t top = (uint64_t)1 << HISTOGRAM_MAX_BITS;
+
+	for(int i = 0; i < HISTOGRAM_SUB_BUCKETS; i++)
+	{
+		if(Metrics::bucketIndex(i) != i || Metrics::bucketValue(i) != (uint64_t)i) return -1;
+	}
+
+	// first power of two split into buckets of one, the next into buckets of two
+	if(Metrics::bucketIndex(16) != 16 || Metrics::bucketIndex(31) != 31) return -2;
+	if(Metrics::bucketIndex(32) != 32 || Metrics::bucketIndex(33) != 32 || Metrics::bucketIndex(34) != 33) return -3;
+	if(Metrics::bucketValue(32) != 32 || Metrics::bucketValue(33) != 34) return -4;
+
+	for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		// both ends of every bucket map back to it
+		if(Metrics::bucketIndex(Metrics::bucketValue(i)) != i) return -5;
+		if(Metrics::bucketIndex(Metrics::bucketValue(i + 1) - 1) != i) return -6;
+
+		if(Metrics::bucketValue(i + 1) <= Metrics::bucketValue(i)) return -7;
+	}
+
+	if(Metrics::bucketValue(HISTOGRAM_BUCKETS) != top) return -8;
+	if(Metrics::bucketIndex(top - 1) != HISTOGRAM_BUCKETS - 1) return -9;
+	if(Metrics::bucketIndex(top) != HISTOGRAM_BUCKETS - 1) return -10;
+	if(Metrics::bucketIndex(UINT64_MAX) != HISTOGRAM_BUCKETS - 1) return -11;
+
+	return 0;
+}
+
+
+/**
+ * No bucket past the exact ones is wider than 1 / HISTOGRAM_SUB_BUCKETS of
+ * the latencies it holds
+ */
+int bucketPrecisionTests()
+{
+	uint64_t low, high;
+
+	for(int i = HISTOGRAM_SUB_BUCKETS; i < HISTOGRAM_BUCKETS; i++)
+	{
+		low = Metrics::bucketValue(i);
+		high = Metrics::bucketValue(i + 1);
+
+		if((high - low) * HISTOGRAM_SUB_BUCKETS > low) return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * One sample of each latency from 1 to 1000ns, every percentile is reported
+ * as the top of the bucket holding it, never past the largest sample
+ */
+int percentileTests()
+{
+	summary_s summary;
+
+	for(uint64_t ns = 1; ns <= 1000; ns++) Metrics::recordCommand(CMD::GET, ns);
+
+	if(readSummary("get", &summary) != 0) return -1;
+
+	if(summary.count != 1000 || summary.meanNs != 500 || summary.maxNs != 1000) return -2;
+
+	// 500 is in [496, 511], 900 in [896, 927], 990 in [960, 991]
+	if(summary.p50Ns != 511) return -3;
+	if(summary.p90Ns != 927) return -4;
+	if(summary.p99Ns != 991) return -5;
+
+	// 999 is in [992, 1023], capped by the largest sample
+	if(summary.p999Ns != 1000) return -6;
+
+	return 0;
+}
+
+
+/**
+ * An empty histogram reports zeros, and with a single sample every
+ * percentile is that sample
+ */
+int smallHistogramTests()
+{
+	summary_s summary;
+
+	if(readSummary("batch", &summary) != 0) return -1;
+	if(summary.count != 0 || summary.p50Ns != 0 || summary.p999Ns != 0 || summary.maxNs != 0) return -2;
+
+	Metrics::recordCommand(CMD::POST, 5);
+
+	if(readSummary("post", &summary) != 0) return -3;
+	if(summary.count != 1 || summary.meanNs != 5 || summary.maxNs != 5) return -4;
+	if(summary.p50Ns != 5 || summary.p90Ns != 5 || summary.p99Ns != 5 || summary.p999Ns != 5) return -5;
+
+	// exact buckets below HISTOGRAM_SUB_BUCKETS, one sample per value
+	Metrics::recordCommand(CMD::LOGIN, 1);
+	Metrics::recordCommand(CMD::LOGIN, 2);
+
+	if(readSummary("login", &summary) != 0) return -6;
+	if(summary.p50Ns != 1 || summary.p90Ns != 2 || summary.maxNs != 2) return -7;
+
+	return 0;
+}
+
+
+/**
+ * Dump the metrics and read back the line of one command
+ * @param name Name of the command
+ * @param summary Container for the values on its line
+ * @return 0 if found, -1 if not
+ */
+int readSummary(const char* name, summary_s* summary)
+{
+	char line[512];
+	char prefix[64];
+	int ret = -1;
+	FILE* file = tmpfile();
+
+	if(file == nullptr) return -1;
+
+	Metrics::dump(file);
+	rewind(file);
+
+	snprintf(prefix, sizeof(prefix), "command name:%s ", name);
+
+	while(fgets(line, sizeof(line), file) != nullptr)
+	{
+		if(strncmp(line, prefix, strlen(prefix)) != 0) continue;
+
+		if(sscanf(line + strlen(prefix), "count:%lu mean_ns:%lu p50_ns:%lu p90_ns:%lu p99_ns:%lu p99.9_ns:%lu max_ns:%lu",
+		          &summary->count, &summary->meanNs, &summary->p50Ns, &summary->p90Ns,
+		          &summary->p99Ns, &summary->p999Ns, &summary->maxNs) == 7) ret = 0;
+		break;
+	}
+
+	fclose(file);
+
+	return ret;
+}
+
+
+/**
+ * Print success or FAILED based on given result of test
+ */
+void printResult(FILE* file, int testResult)
+{
+    if(testResult == 0) {
+        fprintf(file, "success\n");
+    } else {
+        fprintf(file, "FAILED: %d\n", testResult);
+    }
+}
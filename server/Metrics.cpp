@@ -0,0 +1,253 @@
+/**
+ * Author: Ryan Steinwert
+ *
+ * Implementation for request metrics
+ */
+
+#include <cstdlib>
+
+#include "Metrics.h"
+#include "definitions.h"
+
+
+static const char* commandNames[NUM_METRIC_CMDS] = {
+	"get_session_id", "create_account", "login", "get", "post", "batch"
+};
+
+static const char* opNames[NUM_METRIC_OPS] = {
+	"create_account", "login", "replace_item", "get_item_data", "open_item_file", "open_upload", "commit_upload", "apply_batch"
+};
+
+// percentiles reported for every histogram, in thousandths
+static const int percentiles[] = { 500, 900, 990, 999 };
+
+
+std::atomic<metrics_shard_s*> Metrics::_shards(nullptr);
+
+
+
+/**
+ * Add to a counter only the calling thread writes, no atomic read-modify-write needed
+ * @param counter The counter
+ * @param value Amount to add
+ */
+static inline void bump(std::atomic<uint64_t>& counter, uint64_t value)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+
+/**
+ * Record how long a command took, from its header being parsed to its reply
+ * being staged
+ * @param command Command without flag bits
+ * @param ns Latency in nanoseconds
+ */
+void Metrics::recordCommand(uint16_t command, uint64_t ns)
+{
+	int index;
+
+	switch(command) {
+	case CMD::GET_SESSION_ID:
+		index = METRIC_CMD::METRIC_GET_SESSION_ID;
+		break;
+	case CMD::CREATE_ACCOUNT:
+		index = METRIC_CMD::METRIC_CREATE_ACCOUNT;
+		break;
+	case CMD::LOGIN:
+		index = METRIC_CMD::METRIC_LOGIN;
+		break;
+	case CMD::GET:
+		index = METRIC_CMD::METRIC_GET;
+		break;
+	case CMD::POST:
+		index = METRIC_CMD::METRIC_POST;
+		break;
+	case CMD::BATCH:
+		index = METRIC_CMD::METRIC_BATCH;
+		break;
+	default:
+		return;
+	}
+
+	record(&threadShard()->commands[index], ns);
+}
+
+
+/**
+ * Record how long an account or database operation took
+ * @param op The operation
+ * @param ns Latency in nanoseconds
+ */
+void Metrics::recordOp(METRIC_OP op, uint64_t ns)
+{
+	record(&threadShard()->ops[op], ns);
+}
+
+
+/**
+ * Count a reply by its code
+ * @param code Error code of the reply, 0 for success
+ */
+void Metrics::countReply(int code)
+{
+	if(code < 0 || code >= MAX_COUNTED_CODES) code = MAX_COUNTED_CODES - 1;
+
+	bump(threadShard()->codes[code], 1);
+}
+
+
+/**
+ * Print every histogram and counter, summed over all threads, one line each
+ * @param file File to print to
+ */
+void Metrics::dump(FILE* file)
+{
+	uint64_t count;
+
+	for(int i = 0; i < NUM_METRIC_CMDS; i++)
+	{
+		dumpHistogram(file, "command", commandNames[i], false, i);
+	}
+
+	for(int i = 0; i < NUM_METRIC_OPS; i++)
+	{
+		dumpHistogram(file, "op", opNames[i], true, i);
+	}
+
+	for(int code = 0; code < MAX_COUNTED_CODES; code++)
+	{
+		count = 0;
+		for(metrics_shard_s* shard = _shards.load(std::memory_order_acquire); shard != nullptr; shard = shard->next)
+		{
+			count += shard->codes[code].load(std::memory_order_relaxed);
+		}
+
+		if(count > 0) fprintf(file, "reply code:%d count:%lu\n", code, count);
+	}
+}
+
+
+/**
+ * Shard of the calling thread, created and registered on first use
+ * @return The calling thread's shard
+ */
+metrics_shard_s* Metrics::threadShard()
+{
+	thread_local metrics_shard_s* shard = nullptr;
+
+	if(shard != nullptr) return shard;
+
+	shard = (metrics_shard_s*) calloc (1, sizeof(metrics_shard_s));
+
+	// shards are only ever added at the front, readers walk them from there
+	shard->next = _shards.load(std::memory_order_relaxed);
+	while(!_shards.compare_exchange_weak(shard->next, shard, std::memory_order_release, std::memory_order_relaxed));
+
+	return shard;
+}
+
+
+/**
+ * Record a latency in a histogram owned by the calling thread
+ * @param histogram The histogram
+ * @param ns Latency in nanoseconds
+ */
+void Metrics::record(histogram_s* histogram, uint64_t ns)
+{
+	bump(histogram->counts[bucketIndex(ns)], 1);
+	bump(histogram->count, 1);
+	bump(histogram->sumNs, ns);
+
+	if(ns > histogram->maxNs.load(std::memory_order_relaxed)) histogram->maxNs.store(ns, std::memory_order_relaxed);
+}
+
+
+/**
+ * Merge a histogram over all threads and print its count, mean, percentiles and max
+ * @param file File to print to
+ * @param kind Kind of histogram, command or op
+ * @param name Name of the command or operation
+ * @param ops Whether the histogram is an operation's
+ * @param index Index of the command or operation
+ */
+void Metrics::dumpHistogram(FILE* file, const char* kind, const char* name, bool ops, int index)
+{
+	uint64_t counts[HISTOGRAM_BUCKETS] = {};
+	uint64_t count = 0, sumNs = 0, maxNs = 0, seen, target, value;
+	histogram_s* histogram;
+	int bucket;
+
+	for(metrics_shard_s* shard = _shards.load(std::memory_order_acquire); shard != nullptr; shard = shard->next)
+	{
+		histogram = ops ? &shard->ops[index] : &shard->commands[index];
+
+		for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		{
+			counts[i] += histogram->counts[i].load(std::memory_order_relaxed);
+		}
+
+		count += histogram->count.load(std::memory_order_relaxed);
+		sumNs += histogram->sumNs.load(std::memory_order_relaxed);
+		if(histogram->maxNs.load(std::memory_order_relaxed) > maxNs) maxNs = histogram->maxNs.load(std::memory_order_relaxed);
+	}
+
+	fprintf(file, "%s name:%s count:%lu mean_ns:%lu", kind, name, count, count ? sumNs / count : 0);
+
+	for(int p : percentiles)
+	{
+		// smallest bucket holding at least p thousandths of the samples
+		target = (count * p + 999) / 1000;
+		seen = 0;
+
+		for(bucket = 0; bucket < HISTOGRAM_BUCKETS - 1; bucket++)
+		{
+			seen += counts[bucket];
+			if(seen >= target && seen > 0) break;
+		}
+
+		// top of the bucket, never past the largest sample
+		value = count ? bucketValue(bucket + 1) - 1 : 0;
+		if(value > maxNs) value = maxNs;
+
+		fprintf(file, " p%g_ns:%lu", p / 10.0, value);
+	}
+
+	fprintf(file, " max_ns:%lu\n", maxNs);
+}
+
+
+/**
+ * Bucket holding a latency. Below HISTOGRAM_SUB_BUCKETS each value has its own
+ * bucket, above it each power of two is split into HISTOGRAM_SUB_BUCKETS.
+ * @param ns Latency in nanoseconds
+ * @return Index of the bucket
+ */
+int Metrics::bucketIndex(uint64_t ns)
+{
+	int exponent;
+
+	if(ns < HISTOGRAM_SUB_BUCKETS) return ns;
+	if(ns >> HISTOGRAM_MAX_BITS) return HISTOGRAM_BUCKETS - 1;
+
+	exponent = 63 - __builtin_clzll(ns);
+
+	return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+	       + ((ns >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+
+/**
+ * Lowest latency falling in a bucket
+ * @param index Index of the bucket, HISTOGRAM_BUCKETS for the end of the last one
+ * @return Latency in nanoseconds
+ */
+uint64_t Metrics::bucketValue(int index)
+{
+	int group = index / HISTOGRAM_SUB_BUCKETS;
+	int sub = index % HISTOGRAM_SUB_BUCKETS;
+
+	if(group == 0) return sub;
+
+	return (uint64_t)(HISTOGRAM_SUB_BUCKETS + sub) << (group - 1);
+}
@@ -0,0 +1,100 @@
+#pragma once
+/**
+ * Author: Ryan Steinwert
+ *
+ * Definition for request metrics, latency histograms and counters are kept
+ * per thread and merged when read
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+// each power of two is split into this many buckets, about 6% precision
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+// latencies are nanoseconds, anything past 2^40 (about 18 minutes) lands in the last bucket
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+// reply codes counted separately, higher ones share the last counter
+#define MAX_COUNTED_CODES 32
+
+
+/**
+ * Commands with their own histogram
+ */
+enum METRIC_CMD {
+	METRIC_GET_SESSION_ID = 0,
+	METRIC_CREATE_ACCOUNT = 1,
+	METRIC_LOGIN = 2,
+	METRIC_GET = 3,
+	METRIC_POST = 4,
+	METRIC_BATCH = 5,
+	NUM_METRIC_CMDS = 6
+};
+
+
+/**
+ * Account and database operations with their own histogram
+ */
+enum METRIC_OP {
+	OP_CREATE_ACCOUNT = 0,
+	OP_LOGIN = 1,
+	OP_REPLACE_ITEM = 2,
+	OP_GET_ITEM_DATA = 3,
+	OP_OPEN_ITEM_FILE = 4,
+	OP_OPEN_UPLOAD = 5,
+	OP_COMMIT_UPLOAD = 6,
+	OP_APPLY_BATCH = 7,
+	NUM_METRIC_OPS = 8
+};
+
+
+/**
+ * Log linear latency histogram, written only by the thread owning it
+ */
+typedef struct histogram_t {
+	std::atomic<uint64_t> counts[HISTOGRAM_BUCKETS];
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> sumNs;
+	std::atomic<uint64_t> maxNs;
+} histogram_s;
+
+
+/**
+ * Metrics recorded by one thread
+ */
+typedef struct metrics_shard_t {
+	histogram_s commands[NUM_METRIC_CMDS];
+	histogram_s ops[NUM_METRIC_OPS];
+	std::atomic<uint64_t> codes[MAX_COUNTED_CODES];
+	struct metrics_shard_t* next;
+} metrics_shard_s;
+
+
+
+/**
+ * Process wide metrics. Recording only touches the calling thread's shard,
+ * so it never contends, dump sums every shard.
+ */
+class Metrics {
+public:
+	static void recordCommand(uint16_t command, uint64_t ns);
+	static void recordOp(METRIC_OP op, uint64_t ns);
+	static void countReply(int code);
+
+	static void dump(FILE* file);
+
+	static int bucketIndex(uint64_t ns);
+	static uint64_t bucketValue(int index);
+
+private:
+	static std::atomic<metrics_shard_s*> _shards;
+
+	static metrics_shard_s* threadShard();
+
+	static void record(histogram_s* histogram, uint64_t ns);
+	static void dumpHistogram(FILE* file, const char* kind, const char* name, bool ops, int index);
+};
@@ -0,0 +1,271 @@
+/**
+ * Author: Ryan Steinwert
+ *
+ * Tests for rate limiter module
+ */
+
+#include <cstdio>
+#include <cstring>
+
+
+#include "../RateLimiter.h"
+
+#define MS_NS 1000000ull
+
+// nonzero start, a clock read of 0 is never special
+#define START_NS 1000000000ull
+
+// tokens per second and burst used by every test, fractions of a second
+// used below refill an exact number of tokens
+#define TEST_RATE 4
+#define TEST_BURST 4
+
+int refillTests();
+int burstTests();
+int accountTests();
+int refusalTests();
+int sweepTests();
+
+void printResult(FILE* file, int testResult);
+
+int main()
+{
+	FILE* out = stdout;
+
+
+	fprintf(out, "Refill tests: ");
+	printResult(out, refillTests());
+
+	fprintf(out, "Burst tests: ");
+	printResult(out, burstTests());
+
+	fprintf(out, "Account tests: ");
+	printResult(out, accountTests());
+
+	fprintf(out, "Refusal tests: ");
+	printResult(out, refusalTests());
+
+	fprintf(out, "Sweep tests: ");
+	printResult(out, sweepTests());
+}
+
+
+/**
+ * An emptied bucket refills at the class's rate, a fraction of a token is
+ * kept for the next request, and a clock read earlier than the last one
+ * adds nothing
+ */
+int refillTests()
+{
+	RateLimiter limiter;
+	uint64_t now = START_NS;
+
+	limiter.setLimit(RATE_CLASS::RATE_WRITE, TEST_RATE, TEST_BURST);
+
+	for(int i = 0; i < TEST_BURST; i++)
+	{
+		if(!limiter.admit(RATE_CLASS::RATE_WRITE, 1, nullptr, now)) return -1;
+	}
+
+	if(limiter.admit(RATE_CLASS::RATE_WRITE, 1, nullptr, now)) return -2;
+
+	// a quarter second is one token
+	now += 250 * MS_NS;
+	if(!limiter.admit(RATE_CLASS::RATE_WRITE, 1, nullptr, now)) return -3;
+	if(limiter.admit(RATE_CLASS::RATE_WRITE, 1, nullptr, now)) return -4;
+
+	// half a token is not enough, the next half makes it one
+	now += 125 * MS_NS;
+	if(limiter.admit(RATE_CLASS::RATE_WRITE, 1, nullptr, now)) return -5;
+	now += 125 * MS_NS;
+	if(!limiter.admit(RATE_CLASS::RATE_WRITE, 1, nullptr, now)) return -6;
+
+	// a thread that read the clock earlier refills nothing
+	if(limiter.admit(RATE_CLASS::RATE_WRITE, 1, nullptr, now - 250 * MS_NS)) return -7;
+
+	// classes have buckets of their own
+	if(!limiter.admit(RATE_CLASS::RATE_READ, 1, nullptr, now)) return -8;
+
+	return 0;
+}
+
+
+/**
+ * However long a bucket is idle it holds at most the burst, a request
+ * costing more than the burst is charged the burst, and a class with no
+ * rate is never limited
+ */
+int burstTests()
+{
+	RateLimiter limiter;
+	uint64_t now = START_NS;
+
+	limiter.setLimit(RATE_CLASS::RATE_WRITE, TEST_RATE, TEST_BURST);
+	limiter.setLimit(RATE_CLASS::RATE_READ, 0, TEST_BURST);
+
+	if(!limiter.admit(RATE_CLASS::RATE_WRITE, 1, nullptr, now)) return -1;
+
+	now += 3600 * 1000 * MS_NS;
+
+	for(int i = 0; i < TEST_BURST; i++)
+	{
+		if(!limiter.admit(RATE_CLASS::RATE_WRITE, 1, nullptr, now)) return -2;
+	}
+
+	if(limiter.admit(RATE_CLASS::RATE_WRITE, 1, nullptr, now)) return -3;
+
+	now += 1000 * MS_NS;
+	if(!limiter.admit(RATE_CLASS::RATE_WRITE, 1, nullptr, now, 10 * TEST_BURST)) return -4;
+	if(limiter.admit(RATE_CLASS::RATE_WRITE, 1, nullptr, now)) return -5;
+
+	for(int i = 0; i < 10 * TEST_BURST; i++)
+	{
+		if(!limiter.admit(RATE_CLASS::RATE_READ, 1, nullptr, now)) return -6;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Sessions logged in to one account share its bucket, so a new session
+ * does not raise the account's limit, while other accounts and sessions
+ * not logged in are unaffected
+ */
+int accountTests()
+{
+	RateLimiter limiter;
+	uint64_t now = START_NS;
+
+	limiter.setLimit(RATE_CLASS::RATE_AUTH, TEST_RATE, TEST_BURST);
+
+	for(int i = 0; i < TEST_BURST - 1; i++)
+	{
+		if(!limiter.admit(RATE_CLASS::RATE_AUTH, 1, "myuid1", now)) return -1;
+	}
+
+	// the second session's own bucket is full, the account's has one left
+	if(!limiter.admit(RATE_CLASS::RATE_AUTH, 2, "myuid1", now)) return -2;
+	if(limiter.admit(RATE_CLASS::RATE_AUTH, 2, "myuid1", now)) return -3;
+	if(limiter.admit(RATE_CLASS::RATE_AUTH, 3, "myuid1", now)) return -4;
+
+	if(!limiter.admit(RATE_CLASS::RATE_AUTH, 2, "myuid2", now)) return -5;
+	if(!limiter.admit(RATE_CLASS::RATE_AUTH, 3, nullptr, now)) return -6;
+
+	// the account refills like any bucket
+	now += 250 * MS_NS;
+	if(!limiter.admit(RATE_CLASS::RATE_AUTH, 3, "myuid1", now)) return -7;
+
+	return 0;
+}
+
+
+/**
+ * A refused request takes nothing from either bucket, whichever of the two
+ * was short
+ */
+int refusalTests()
+{
+	RateLimiter limiter;
+	uint64_t now = START_NS;
+
+	limiter.setLimit(RATE_CLASS::RATE_WRITE, TEST_RATE, TEST_BURST);
+
+	// the account is empty, the session is not
+	for(int i = 0; i < TEST_BURST; i++)
+	{
+		if(!limiter.admit(RATE_CLASS::RATE_WRITE, 1, "myuid1", now)) return -1;
+	}
+
+	for(int i = 0; i < TEST_BURST; i++)
+	{
+		if(limiter.admit(RATE_CLASS::RATE_WRITE, 2, "myuid1", now)) return -2;
+	}
+
+	for(int i = 0; i < TEST_BURST; i++)
+	{
+		if(!limiter.admit(RATE_CLASS::RATE_WRITE, 2, nullptr, now)) return -3;
+	}
+
+	// the session is empty, the account is not
+	for(int i = 0; i < TEST_BURST; i++)
+	{
+		if(!limiter.admit(RATE_CLASS::RATE_WRITE, 3, nullptr, now)) return -4;
+	}
+
+	for(int i = 0; i < TEST_BURST; i++)
+	{
+		if(limiter.admit(RATE_CLASS::RATE_WRITE, 3, "myuid2", now)) return -5;
+	}
+
+	for(int i = 0; i < TEST_BURST; i++)
+	{
+		if(!limiter.admit(RATE_CLASS::RATE_WRITE, 4, "myuid2", now)) return -6;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Fill one shard to the sweep threshold, then admit into it a quarter second later.
+ * Buckets that have refilled by then are dropped, ones that have not keep
+ * their tokens, and one updated after the sweep read the clock is kept.
+ */
+int sweepTests()
+{
+	RateLimiter limiter;
+	uint64_t now = START_NS;
+	// session keys are the ID above the class bits, so these share a shard
+	uint32_t step = RATE_LIMIT_SHARDS / 4;
+	uint32_t numBuckets = RATE_LIMIT_SHARD_SIZE;
+	uint32_t numRefilled = (numBuckets - 1) / 2;
+
+	limiter.setLimit(RATE_CLASS::RATE_AUTH, TEST_RATE, TEST_BURST);
+
+	// emptied by a thread whose clock read is later than the sweep's
+	if(!limiter.admit(RATE_CLASS::RATE_AUTH, step, nullptr, now + 2000 * MS_NS, TEST_BURST)) return -1;
+
+	for(uint32_t i = 1; i < numBuckets; i++)
+	{
+		// odd ones take the whole burst, even ones only a token
+		if(!limiter.admit(RATE_CLASS::RATE_AUTH, (i + 1) * step, nullptr, now, i % 2 ? TEST_BURST : 1)) return -2;
+	}
+
+	if(limiter.size() != numBuckets) return -3;
+
+	// a quarter second refills the even ones, the odd ones hold one token
+	now += 250 * MS_NS;
+	if(!limiter.admit(RATE_CLASS::RATE_AUTH, (numBuckets + 1) * step, nullptr, now)) return -4;
+
+	if(limiter.size() != numBuckets - numRefilled + 1) return -5;
+
+	for(uint32_t i = 1; i < numBuckets; i++)
+	{
+		if(i % 2 == 0) {
+			// a dropped bucket comes back full
+			if(!limiter.admit(RATE_CLASS::RATE_AUTH, (i + 1) * step, nullptr, now, TEST_BURST)) return -6;
+		} else {
+			if(!limiter.admit(RATE_CLASS::RATE_AUTH, (i + 1) * step, nullptr, now)) return -7;
+			if(limiter.admit(RATE_CLASS::RATE_AUTH, (i + 1) * step, nullptr, now)) return -8;
+		}
+	}
+
+	// still empty, it was not dropped
+	if(limiter.admit(RATE_CLASS::RATE_AUTH, step, nullptr, now)) return -9;
+
+	return 0;
+}
+
+
+/**
+ * Print success or FAILED based on given result of test
+ */
+void printResult(FILE* file, int testResult)
+{
+    if(testResult == 0) {
+        fprintf(file, "success\n");
+    } else {
+        fprintf(file, "FAILED: %d\n", testResult);
+    }
+}
@@ -0,0 +1,207 @@
+/**
+ * Author: Ryan Steinwert
+ *
+ * Implementation for token bucket rate limiter
+ */
+
+#define NS_PER_SEC 1e9
+
+// low key bits hold the rate class, the top bit marks account keys
+#define RATE_CLASS_BITS 2
+#define ACCOUNT_KEY_BIT (1ull << 63)
+
+#include <utility>
+
+#include "RateLimiter.h"
+
+
+
+RateLimiter::RateLimiter()
+{
+	setLimit(RATE_CLASS::RATE_AUTH, DEFAULT_AUTH_RATE, DEFAULT_AUTH_BURST);
+	setLimit(RATE_CLASS::RATE_WRITE, DEFAULT_WRITE_RATE, DEFAULT_WRITE_BURST);
+	setLimit(RATE_CLASS::RATE_READ, DEFAULT_READ_RATE, DEFAULT_READ_BURST);
+}
+
+
+/**
+ * Set the limit of a command class, not safe once requests are being admitted
+ * @param rateClass The class to limit
+ * @param rate Requests per second, 0 for no limit
+ * @param burst Requests that may be made at once after being idle
+ */
+void RateLimiter::setLimit(RATE_CLASS rateClass, double rate, double burst)
+{
+	_limits[rateClass].rate = rate;
+	_limits[rateClass].burst = burst < 1 ? 1 : burst;
+}
+
+
+/**
+ * Take tokens for a request from its session bucket and, if logged in, its
+ * account bucket. Nothing is taken unless both have enough.
+ * @param rateClass Class of the request's command
+ * @param sessionId Session the request was made on
+ * @param uid Account of the session, null if not logged in
+ * @param nowNs Current monotonic time in nanoseconds
+ * @param cost Tokens the request takes, at most the class's burst
+ * @return True if the request may run, false if it is over its limit
+ */
+bool RateLimiter::admit(RATE_CLASS rateClass, uint32_t sessionId, const char* uid, uint64_t nowNs, double cost)
+{
+	rate_limit_s* limit = &_limits[rateClass];
+	uint64_t keys[2];
+	shard_s* shards[2];
+	token_bucket_s* buckets[2];
+	int numKeys = 0;
+	bool admitted = true;
+
+	if(limit->rate <= 0) return true;
+
+	// a request costing more than a full bucket could never be admitted
+	if(cost > limit->burst) cost = limit->burst;
+
+	keys[numKeys++] = sessionKey(rateClass, sessionId);
+	if(uid != nullptr) keys[numKeys++] = accountKey(rateClass, uid);
+
+	for(int i = 0; i < numKeys; i++)
+	{
+		shards[i] = &_shards[keys[i] % RATE_LIMIT_SHARDS];
+	}
+
+	// always locked in shard order, once if both keys share a shard
+	if(numKeys == 2 && shards[1] < shards[0]) {
+		std::swap(shards[0], shards[1]);
+		std::swap(keys[0], keys[1]);
+	}
+
+	shards[0]->mutex.lock();
+	if(numKeys == 2 && shards[1] != shards[0]) shards[1]->mutex.lock();
+
+	// swept before either bucket is looked up, so neither is freed under us
+	for(int i = 0; i < numKeys; i++)
+	{
+		if(shards[i]->buckets.size() >= RATE_LIMIT_SHARD_SIZE) sweep(shards[i], nowNs);
+	}
+
+	for(int i = 0; i < numKeys; i++)
+	{
+		buckets[i] = bucket(shards[i], keys[i], limit, nowNs);
+		if(buckets[i]->tokens < cost) admitted = false;
+	}
+
+	if(admitted) {
+		for(int i = 0; i < numKeys; i++) buckets[i]->tokens -= cost;
+	}
+
+	if(numKeys == 2 && shards[1] != shards[0]) shards[1]->mutex.unlock();
+	shards[0]->mutex.unlock();
+
+	return admitted;
+}
+
+
+/**
+ * @return Number of buckets held, including full ones not yet swept
+ */
+size_t RateLimiter::size()
+{
+	size_t count = 0;
+
+	for(int i = 0; i < RATE_LIMIT_SHARDS; i++)
+	{
+		std::lock_guard<std::mutex> lock(_shards[i].mutex);
+
+		count += _shards[i].buckets.size();
+	}
+
+	return count;
+}
+
+
+/**
+ * Find or create a bucket and refill it for the time since it was last used,
+ * called with the shard locked
+ * @param shard Shard holding the bucket
+ * @param key Key of the bucket
+ * @param limit Limit of the bucket's class
+ * @param nowNs Current monotonic time in nanoseconds
+ * @return The refilled bucket
+ */
+token_bucket_s* RateLimiter::bucket(shard_s* shard, uint64_t key, rate_limit_s* limit, uint64_t nowNs)
+{
+	token_bucket_s* entry;
+	auto found = shard->buckets.find(key);
+
+	if(found == shard->buckets.end()) {
+		entry = &shard->buckets[key];
+		entry->tokens = limit->burst;
+		entry->updatedNs = nowNs;
+		return entry;
+	}
+
+	entry = &found->second;
+
+	if(nowNs > entry->updatedNs) {
+		entry->tokens += (nowNs - entry->updatedNs) / NS_PER_SEC * limit->rate;
+		if(entry->tokens > limit->burst) entry->tokens = limit->burst;
+		entry->updatedNs = nowNs;
+	}
+
+	return entry;
+}
+
+
+/**
+ * Drop the buckets of a shard that have refilled, a missing bucket starts full
+ * so nothing is lost. Called with the shard locked.
+ * @param shard Shard to sweep
+ * @param nowNs Current monotonic time in nanoseconds
+ */
+void RateLimiter::sweep(shard_s* shard, uint64_t nowNs)
+{
+	rate_limit_s* limit;
+
+	for(auto it = shard->buckets.begin(); it != shard->buckets.end();)
+	{
+		limit = &_limits[it->first & ((1 << RATE_CLASS_BITS) - 1)];
+
+		// updated by a thread that read the clock after this one did
+		if(it->second.updatedNs >= nowNs) {
+			++it;
+			continue;
+		}
+
+		if(it->second.tokens + (nowNs - it->second.updatedNs) / NS_PER_SEC * limit->rate >= limit->burst) {
+			it = shard->buckets.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+
+/**
+ * @return Bucket key for a session's requests of a class
+ */
+uint64_t RateLimiter::sessionKey(RATE_CLASS rateClass, uint32_t sessionId)
+{
+	return ((uint64_t)sessionId << RATE_CLASS_BITS) | rateClass;
+}
+
+
+/**
+ * @return Bucket key for an account's requests of a class, from an FNV-1a hash of its uid
+ */
+uint64_t RateLimiter::accountKey(RATE_CLASS rateClass, const char* uid)
+{
+	uint64_t hash = 14695981039346656037ull;
+
+	for(; *uid; uid++)
+	{
+		hash ^= (unsigned char)*uid;
+		hash *= 1099511628211ull;
+	}
+
+	return ACCOUNT_KEY_BIT | ((hash << RATE_CLASS_BITS) & ~ACCOUNT_KEY_BIT) | rateClass;
+}
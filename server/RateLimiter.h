@@ -0,0 +1,84 @@
+#pragma once
+/**
+ * Author: Ryan Steinwert
+ *
+ * Definition for token bucket rate limiter, keyed by session and by account
+ */
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+#define RATE_LIMIT_SHARDS 64
+
+// full buckets are swept out once a shard holds this many
+#define RATE_LIMIT_SHARD_SIZE 4096
+
+// requests per second and burst size of each command class, 0 rate is unlimited
+#define DEFAULT_AUTH_RATE 5
+#define DEFAULT_AUTH_BURST 10
+#define DEFAULT_WRITE_RATE 100
+#define DEFAULT_WRITE_BURST 200
+#define DEFAULT_READ_RATE 200
+#define DEFAULT_READ_BURST 400
+
+
+/**
+ * Classes of commands limited separately
+ */
+enum RATE_CLASS {
+	// account creation and login, each one hashes a password
+	RATE_AUTH = 0,
+	// posts, each one writes to disk
+	RATE_WRITE = 1,
+	RATE_READ = 2,
+	NUM_RATE_CLASSES = 3
+};
+
+
+typedef struct rate_limit_t {
+	double rate;
+	double burst;
+} rate_limit_s;
+
+
+typedef struct token_bucket_t {
+	double tokens;
+	uint64_t updatedNs;
+} token_bucket_s;
+
+
+
+/**
+ * Each request takes a token from the bucket of its session and, once logged
+ * in, from the bucket of its account, so opening more sessions does not raise
+ * an account's limit. Buckets are spread over mutex guarded shards.
+ */
+class RateLimiter {
+public:
+	RateLimiter();
+
+	RateLimiter(const RateLimiter&) = delete;
+	RateLimiter& operator=(const RateLimiter&) = delete;
+
+	void setLimit(RATE_CLASS rateClass, double rate, double burst);
+
+	bool admit(RATE_CLASS rateClass, uint32_t sessionId, const char* uid, uint64_t nowNs, double cost = 1);
+
+	size_t size();
+
+private:
+	typedef struct shard_t {
+		alignas(64) std::mutex mutex;
+		std::unordered_map<uint64_t, token_bucket_s> buckets;
+	} shard_s;
+
+	rate_limit_s _limits[NUM_RATE_CLASSES];
+	shard_s _shards[RATE_LIMIT_SHARDS];
+
+	token_bucket_s* bucket(shard_s* shard, uint64_t key, rate_limit_s* limit, uint64_t nowNs);
+	void sweep(shard_s* shard, uint64_t nowNs);
+
+	static uint64_t sessionKey(RATE_CLASS rateClass, uint32_t sessionId);
+	static uint64_t accountKey(RATE_CLASS rateClass, const char* uid);
+};
@@ -4,8 +4,11 @@
  * Tests for session manager module
  */
 
+#include <atomic>
 #include <cstdio>
 #include <cstring>
+#include <thread>
+#include <unistd.h>
 
 
 #include "../SessionManager.h"
@@ -15,6 +18,13 @@ SessionManager sm;
 int createTests();
 int deleteTests();
 int uidTests();
+int growthTests();
+int concurrentGrowthTests();
+int expiryTests();
+int evictionTests();
+int tokenTests();
+int snapshotTests();
+int staleSnapshotTests();
 
 void printResult(FILE* file, int testResult);
 
@@ -31,28 +41,46 @@ int main()
 
 	fprintf(out, "UID tests: ");
 	printResult(out, uidTests());
+
+	fprintf(out, "Growth tests: ");
+	printResult(out, growthTests());
+
+	fprintf(out, "Concurrent growth tests: ");
+	printResult(out, concurrentGrowthTests());
+
+	fprintf(out, "Expiry tests: ");
+	printResult(out, expiryTests());
+
+	fprintf(out, "Eviction tests: ");
+	printResult(out, evictionTests());
+
+	fprintf(out, "Token tests: ");
+	printResult(out, tokenTests());
+
+	fprintf(out, "Snapshot tests: ");
+	printResult(out, snapshotTests());
+
+	fprintf(out, "Stale snapshot tests: ");
+	printResult(out, staleSnapshotTests());
 }
 
 int createTests()
 {
 	uint32_t id1, id2;
-	session_s *sess1, *sess2;
+	session_s sess1, sess2;
 
 	id1 = sm.createSession();
 	id2 = sm.createSession();
 
 	if(id1 == id2) return -1;
 
-	sess1 = sm.getSession(id1);
-	sess2 = sm.getSession(id2);
+	if(sm.getSession(id1, &sess1) != 0) return -3;
+	if(sm.getSession(id2, &sess2) != 0) return -4;
 
-	if(sess1 == sess2) return -2;
+	if(sess1.id != id1) return -5;
+	if(sess2.id != id2) return -6;
 
-	if(sess1 == nullptr) return -3;
-	if(sess2 == nullptr) return -4;
-
-	if(sess1->id != id1) return -5;
-	if(sess2->id != id2) return -6;
+	if(sess1.uid[0] != 0) return -7;
 
 	return 0;
 
@@ -62,18 +90,21 @@ int createTests()
 int deleteTests()
 {
 	uint32_t id1, id2;
+	session_s sess;
 
 	id1 = sm.createSession();
 	id2 = sm.createSession();
 
-	if(!sm.getSession(id1)) return -1;
-	if(!sm.getSession(id2)) return -2;
+	if(sm.getSession(id1, &sess) != 0) return -1;
+	if(sm.getSession(id2, &sess) != 0) return -2;
 
 	if(sm.deleteSession(id1) != 0) return -3;
 	if(sm.deleteSession(id2) != 0) return -4;
 
-	if(sm.getSession(id1)) return -5;
-	if(sm.getSession(id2)) return -6;
+	if(sm.getSession(id1, &sess) == 0) return -5;
+	if(sm.getSession(id2, &sess) == 0) return -6;
+
+	if(sm.deleteSession(id1) != ERROR::NO_SESSION) return -7;
 
 	return 0;
 }
@@ -83,7 +114,7 @@ int deleteTests()
 int uidTests()
 {
 	uint32_t id1, id2;
-	session_s *sess1, *sess2;
+	session_s sess1, sess2;
 
 	id1 = sm.createSession();
 	id2 = sm.createSession();
@@ -91,11 +122,16 @@ int uidTests()
 	if(sm.replaceUid(id1, "myuid1") != 0) return -3;
 	if(sm.replaceUid(id2, "myuid2") != 0) return -4;
 
-	sess1 = sm.getSession(id1);
-	sess2 = sm.getSession(id2);
+	sm.getSession(id1, &sess1);
+	sm.getSession(id2, &sess2);
+
+	if(strcmp(sess1.uid, "myuid1") != 0) return -5;
+	if(strcmp(sess2.uid, "myuid2") != 0) return -6;
 
-	if(strcmp(sess1->uid, "myuid1") != 0) return -5;
-	if(strcmp(sess2->uid, "myuid2") != 0) return -6;
+	// a full length uid fits inline, a longer one does not
+	if(sm.replaceUid(id1, "0123456789abcdefghijklmnopqrstuv") != 0) return -7;
+	if(sm.getSession(id1, &sess1) != 0 || strlen(sess1.uid) != DEFAULT_UID_LEN) return -8;
+	if(sm.replaceUid(id2, "0123456789abcdefghijklmnopqrstuvw") != ERROR::PARAM_INVAL) return -9;
 
 	sm.deleteSession(id1);
 	sm.deleteSession(id2);
@@ -104,6 +140,295 @@ int uidTests()
 }
 
 
+/**
+ * Create enough sessions to grow every shard several times, then delete
+ * every other one, the rest must still be found after their neighbours move
+ */
+int growthTests()
+{
+	const int numSessions = 20000;
+	uint32_t* ids = new uint32_t[numSessions];
+	session_s sess;
+	int ret = 0;
+
+	for(int i = 0; i < numSessions && ret == 0; i++)
+	{
+		ids[i] = sm.createSession();
+		if(ids[i] == 0) ret = -1;
+	}
+
+	for(int i = 0; i < numSessions && ret == 0; i++)
+	{
+		if(sm.getSession(ids[i], &sess) != 0 || sess.id != ids[i]) ret = -2;
+	}
+
+	for(int i = 0; i < numSessions && ret == 0; i += 2)
+	{
+		if(sm.deleteSession(ids[i]) != 0) ret = -3;
+	}
+
+	for(int i = 0; i < numSessions && ret == 0; i++)
+	{
+		if((sm.getSession(ids[i], &sess) == 0) != (i % 2 == 1)) ret = -4;
+	}
+
+	for(int i = 1; i < numSessions; i += 2) sm.deleteSession(ids[i]);
+
+	delete[] ids;
+
+	return ret;
+}
+
+
+/**
+ * Look sessions up from other threads while every shard grows several
+ * times, lookups must keep finding them as their tables are swapped and
+ * the outgrown ones freed
+ */
+int concurrentGrowthTests()
+{
+	const int numSessions = 20000;
+	const int numKnown = 256;
+	SessionManager growing;
+	uint32_t known[numKnown];
+	std::atomic<bool> done(false);
+	std::atomic<int> misses(0);
+	std::thread readers[2];
+
+	for(int i = 0; i < numKnown; i++)
+	{
+		if((known[i] = growing.createSession()) == 0) return -1;
+	}
+
+	for(std::thread& reader : readers)
+	{
+		reader = std::thread([&]() {
+			session_s sess;
+
+			while(!done.load(std::memory_order_relaxed)) {
+				for(int i = 0; i < numKnown; i++)
+				{
+					if(growing.getSession(known[i], &sess) != 0 || sess.id != known[i]) misses.fetch_add(1);
+				}
+			}
+		});
+	}
+
+	for(int i = 0; i < numSessions; i++)
+	{
+		if(growing.createSession() == 0) misses.fetch_add(1);
+	}
+
+	done.store(true);
+	for(std::thread& reader : readers) reader.join();
+
+	if(misses.load() != 0) return -2;
+
+	return 0;
+}
+
+
+/**
+ * With a two second TTL, a session looked up halfway stays alive while one
+ * left alone expires, is hidden from lookups and is removed once the sweeps
+ * have gone round every shard
+ */
+int expiryTests()
+{
+	SessionManager expiring;
+	uint32_t id1, id2;
+	session_s sess;
+	size_t removed = 0;
+
+	expiring.setLimits(2, DEFAULT_MAX_SESSIONS);
+
+	id1 = expiring.createSession();
+	id2 = expiring.createSession();
+
+	usleep(1500000);
+	if(expiring.getSession(id2, &sess) != 0) return -1;
+
+	usleep(1600000);
+	if(expiring.getSession(id1, &sess) == 0) return -2;
+	if(expiring.getSession(id2, &sess) != 0) return -3;
+	if(expiring.replaceUid(id1, "myuid1") != ERROR::NO_SESSION) return -4;
+
+	if(expiring.size() != 2) return -5;
+	for(int i = 0; i < SESSION_SHARDS / SESSION_SWEEP_SHARDS; i++) removed += expiring.sweep();
+	if(removed != 1) return -6;
+	if(expiring.size() != 1) return -7;
+
+	return 0;
+}
+
+
+/**
+ * With room for one session per shard, creating more evicts old ones and
+ * the newest is always kept
+ */
+int evictionTests()
+{
+	SessionManager capped;
+	uint32_t id;
+	session_s sess;
+
+	capped.setLimits(0, SESSION_SHARDS);
+
+	for(int i = 0; i < 1000; i++)
+	{
+		if((id = capped.createSession()) == 0) return -1;
+		if(capped.getSession(id, &sess) != 0) return -2;
+	}
+
+	if(capped.size() > SESSION_SHARDS) return -3;
+
+	return 0;
+}
+
+
+/**
+ * Wide sessions are found by their whole token, never by their ID alone
+ */
+int tokenTests()
+{
+	SessionManager tokens;
+	session_token_s token, other, narrow;
+	session_s sess;
+
+	if(tokens.createSession(&token) != 0) return -1;
+	if(token.hi == 0 || (uint32_t)token.lo == 0) return -2;
+	if(tokens.createSession(&other) != 0) return -3;
+	if(memcmp(&token, &other, sizeof(token)) == 0) return -4;
+
+	if(tokens.getSession(&token, &sess) != 0) return -5;
+	if(sess.id != (uint32_t)token.lo) return -6;
+
+	// the ID alone, or with the wrong high half, finds nothing
+	if(tokens.getSession((uint32_t)token.lo, &sess) != ERROR::NO_SESSION) return -7;
+	other = token;
+	other.hi ^= 1;
+	if(tokens.getSession(&other, &sess) != ERROR::NO_SESSION) return -8;
+	if(tokens.replaceUid(&other, "user") != ERROR::NO_SESSION) return -9;
+	if(tokens.deleteSession(&other) != ERROR::NO_SESSION) return -10;
+
+	if(tokens.replaceUid(&token, "user") != 0) return -11;
+	if(tokens.getSession(&token, &sess) != 0 || strcmp(sess.uid, "user") != 0) return -12;
+
+	narrow = {0, tokens.createSession()};
+	if(tokens.getSession(&narrow, &sess) != 0) return -13;
+
+	if(tokens.deleteSession(&token) != 0) return -14;
+	if(tokens.getSession(&token, &sess) != ERROR::NO_SESSION) return -15;
+
+	return 0;
+}
+
+
+/**
+ * Logged in sessions come back from the snapshot and the delta after it,
+ * sessions never logged in and ones removed since do not
+ */
+int snapshotTests()
+{
+	const char* path = "snapshotTest.sessions";
+	session_token_s kept, later, removed, anonymous;
+	session_s sess;
+	int ret = 0;
+
+	{
+		SessionManager before;
+		before.setSnapshotPath(path);
+
+		if(before.createSession(&kept) != 0 || before.createSession(&later) != 0) return -1;
+		if(before.createSession(&removed) != 0) return -2;
+		if(before.replaceUid(&kept, "kept") != 0 || before.replaceUid(&removed, "removed") != 0) return -3;
+
+		// enough to spread over every shard
+		for(int i = 0; i < 1000; i++)
+		{
+			if(before.createSession(&anonymous) != 0 || before.replaceUid(&anonymous, "many") != 0) return -5;
+		}
+
+		if(before.createSession(&anonymous) != 0) return -4;
+
+		if(before.snapshot() != 0) return -6;
+
+		// only in the delta
+		if(before.replaceUid(&later, "later") != 0) return -7;
+		if(before.deleteSession(&removed) != 0) return -8;
+		if(before.flushChanges() != 0) return -9;
+	}
+
+	SessionManager after;
+	after.setSnapshotPath(path);
+
+	if(after.restore(4) != 1002) ret = -10;
+	else if(after.getSession(&kept, &sess) != 0 || strcmp(sess.uid, "kept") != 0) ret = -11;
+	else if(after.getSession(&later, &sess) != 0 || strcmp(sess.uid, "later") != 0) ret = -12;
+	else if(after.getSession(&removed, &sess) != ERROR::NO_SESSION) ret = -13;
+	else if(after.getSession(&anonymous, &sess) != ERROR::NO_SESSION) ret = -14;
+
+	unlink(path);
+	unlink("snapshotTest.sessions" SESSION_DELTA_SUFFIX);
+
+	return ret;
+}
+
+
+/**
+ * A session last used longer than the TTL ago by the wall clock is not
+ * restored, even when that was before the machine booted
+ */
+int staleSnapshotTests()
+{
+	const char* path = "staleTest.sessions";
+	// magic, shard count, generation, section sizes, then the only record
+	long recordStart = 2 * sizeof(uint32_t) + sizeof(uint64_t) + SESSION_SHARDS * sizeof(uint64_t);
+	session_token_s token;
+	session_s sess;
+	int64_t lastUsed;
+	FILE* file;
+	int ret = 0;
+
+	{
+		SessionManager before;
+		before.setSnapshotPath(path);
+
+		if(before.createSession(&token) != 0 || before.replaceUid(&token, "stale") != 0) return -1;
+		if(before.snapshot() != 0) return -2;
+	}
+
+	// push the last use three days back, past the TTL and most uptimes
+	if((file = fopen(path, "r+b")) == nullptr) return -3;
+
+	fseek(file, recordStart + 1 + sizeof(session_token_s), SEEK_SET);
+	if(fread(&lastUsed, sizeof(lastUsed), 1, file) != 1) ret = -4;
+
+	lastUsed -= 3 * 24 * 3600;
+
+	fseek(file, recordStart + 1 + sizeof(session_token_s), SEEK_SET);
+	if(fwrite(&lastUsed, sizeof(lastUsed), 1, file) != 1) ret = -5;
+
+	fclose(file);
+
+	if(ret == 0) {
+		SessionManager after;
+		after.setSnapshotPath(path);
+		// longer than the monotonic clock has been running on most hosts,
+		// so only the wall clock shows the session has expired
+		after.setLimits(2 * 24 * 3600, DEFAULT_MAX_SESSIONS);
+
+		if(after.restore(1) != 0) ret = -6;
+		else if(after.getSession(&token, &sess) != ERROR::NO_SESSION) ret = -7;
+	}
+
+	unlink(path);
+	unlink("staleTest.sessions" SESSION_DELTA_SUFFIX);
+
+	return ret;
+}
+
+
 /**
  * Print success or FAILED based on given result of test
  */
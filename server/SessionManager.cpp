@@ -4,37 +4,91 @@
  * Implementation for server session manager
  */
 
-#define DEFAULT_TABLE_SIZE 64
+// random IDs drawn before giving up on finding a free one
+#define CREATE_SESSION_ATTEMPTS 4
 
+// random bytes fetched from the kernel at once by each thread
+#define ENTROPY_BATCH_SIZE 4096
+
+// first words of the snapshot and delta files
+#define SNAPSHOT_MAGIC 0x4E535343
+#define DELTA_MAGIC 0x4C445343
+
+// set in the first byte of a record removing a session
+#define RECORD_REMOVED 0x01
+
+#include <cerrno>
 #include <cstdlib>
 #include <ctime>
 #include <cstring>
-
-#include <random>
+#include <thread>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/stat.h>
 
 #include "SessionManager.h"
 
 
 
-SessionManager::SessionManager(uint16_t tableSize) :
-	_tableSize(tableSize)
+/**
+ * @param shardSlots Slots each shard starts with, rounded up to a power of two
+ */
+SessionManager::SessionManager(uint32_t shardSlots) :
+	_sweepCursor(0),
+	_expired(0),
+	_evicted(0),
+	_snapshotPath(nullptr),
+	_deltaFd(-1),
+	_generation(0)
 {
-	// create the table
-	_table = (session_s**) malloc (sizeof(session_s*) * _tableSize);
-	for(uint16_t i = 0; i < _tableSize; i++)
+	uint32_t numSlots = 2;
+
+	setLimits(DEFAULT_SESSION_TTL_S, DEFAULT_MAX_SESSIONS);
+
+	while(numSlots < shardSlots) numSlots <<= 1;
+
+	for(int i = 0; i < SESSION_SHARDS; i++)
 	{
-		_table[i] = nullptr;
+		_shards[i].seq.store(0, std::memory_order_relaxed);
+		_shards[i].table.store(newTable(numSlots), std::memory_order_relaxed);
+		_shards[i].count.store(0, std::memory_order_relaxed);
+		_shards[i].readers.store(0, std::memory_order_relaxed);
 	}
 }
 
 
-SessionManager::SessionManager() : SessionManager(DEFAULT_TABLE_SIZE)
+SessionManager::SessionManager() : SessionManager(DEFAULT_SHARD_SLOTS)
 {
 }
 
 
 SessionManager::~SessionManager()
 {
+	for(int i = 0; i < SESSION_SHARDS; i++)
+	{
+		free(_shards[i].table.load(std::memory_order_relaxed));
+
+		for(session_table_s* table : _shards[i].retired) free(table);
+	}
+
+	if(_deltaFd >= 0) close(_deltaFd);
+}
+
+
+/**
+ * Set how long sessions live unused and how many are kept, not safe once
+ * sessions are being looked up
+ * @param ttl Seconds a session lives without a lookup, 0 to never expire
+ * @param maxSessions Live sessions kept, split evenly between the shards
+ */
+void SessionManager::setLimits(uint32_t ttl, size_t maxSessions)
+{
+	_ttl = ttl;
+	_maxPerShard = maxSessions / SESSION_SHARDS;
+
+	if(_maxPerShard < 1) _maxPerShard = 1;
 }
 
 
@@ -44,160 +98,1080 @@ SessionManager::~SessionManager()
  */
 uint32_t SessionManager::createSession()
 {
-	uint32_t id;
+	session_s session = {};
+
+	session.lastAccess = nowS();
+
+	for(int i = 0; i < CREATE_SESSION_ATTEMPTS; i++)
+	{
+		do randomBytes(&session.id, sizeof(session.id)); while(session.id == 0);
+
+		session.token.lo = session.id;
+
+		if(insert(&session) == 0) return session.id;
+	}
+
+	return 0;
+}
 
-	std::random_device r;
 
-	std::default_random_engine e(r());
+/**
+ * Create and add a new session with a random 128 bit token
+ * @param token Container for the created session's token
+ * @return 0 if created, error code if not
+ */
+int SessionManager::createSession(session_token_s* token)
+{
+	session_s session = {};
 
-	std::uniform_int_distribution<uint32_t> uniform_dist(1, UINT32_MAX);
+	session.lastAccess = nowS();
 
-	id = uniform_dist(e);
+	for(int i = 0; i < CREATE_SESSION_ATTEMPTS; i++)
+	{
+		// a nonzero high half keeps it apart from the narrow sessions
+		do randomBytes(&session.token, sizeof(session_token_s));
+		while(session.token.hi == 0 || (uint32_t)session.token.lo == 0);
 
-	session_s* session = (session_s*) malloc (sizeof(session_s));
-	session->id = id;
-	session->uid = nullptr;
-	session->next = nullptr;
+		session.id = session.token.lo;
 
-	if(insert(session) != 0) return 0;
+		if(insert(&session) == 0) {
+			*token = session.token;
+			return 0;
+		}
+	}
 
-	return id;
+	return ERROR::DUPLICATE_SESSION;
 }
 
 
 
 /**
- * Insert a new session pointer into the session table
- * @param session The new session to insert
+ * Insert a new session into the session table. A shard at its share of the
+ * session cap evicts a session first, one that would be over three quarters
+ * full grows.
+ * @param session The new session to insert, copied into its slot
  * @return 0 if successfully inserted, error code if not
  */
 int SessionManager::insert(session_s* session)
 {
-	uint16_t slotPos = hash(session->id);
+	uint64_t hashed = hash(session->id);
+	shard_s* shard = shardOf(hashed);
+	session_table_s* table;
+	session_s* slot;
+	uint32_t pos;
 
-	session_s* slot = _table[slotPos];
+	std::lock_guard<std::mutex> lock(shard->mutex);
 
-	if(!slot) {
-		_table[slotPos] = session;
-		return 0;
-	}
+	table = shard->table.load(std::memory_order_relaxed);
 
-	while(slot->next != nullptr)
-	{
-		if(slot->id == session->id) return ERROR::DUPLICATE_SESSION;
+	if(find(table, session->id, hashed) != nullptr) return ERROR::DUPLICATE_SESSION;
+
+	if(shard->count.load(std::memory_order_relaxed) >= _maxPerShard) evict(shard, hashed);
+
+	if((shard->count.load(std::memory_order_relaxed) + 1) * 4 > (table->mask + 1) * 3) {
+		grow(shard);
+		table = shard->table.load(std::memory_order_relaxed);
 	}
 
-	if(slot->id == session->id) return ERROR::DUPLICATE_SESSION;
+	reclaim(shard);
+
+	slot = tableSlots(table);
+	pos = hashed & table->mask;
 
-	slot->next = session;
+	while(slot[pos].id != 0) pos = (pos + 1) & table->mask;
+
+	beginWrite(shard);
+	memcpy(&slot[pos], session, sizeof(session_s));
+	endWrite(shard);
+
+	shard->count.store(shard->count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
 
 	return 0;
 }
 
 
 /**
- * Get session from the hash table
+ * Get a copy of a narrow session, see getSession by token
  * @param sessionId The id to look for
- * @return pointer to the session, null if does not exist
+ * @param session Container for the copy
+ * @return 0 if found, NO_SESSION if does not exist or has expired
  */
-session_s* SessionManager::getSession(uint32_t sessionId)
+int SessionManager::getSession(uint32_t sessionId, session_s* session)
 {
-	session_s* slot = _table[hash(sessionId)];
+	session_token_s token = {0, sessionId};
 
-	while(slot != nullptr)
-	{
-		if(slot->id == sessionId) break;
-		slot = slot->next;
-	}
+	return getSession(&token, session);
+}
+
+
+/**
+ * Get a copy of a session from the hash table and push back its expiry,
+ * never locks. The copy is retried if a writer changed the shard while it
+ * was being taken, which also retries a refresh that may have missed a
+ * session being moved.
+ * @param token The token to look for
+ * @param session Container for the copy
+ * @return 0 if found, NO_SESSION if does not exist, has expired or its
+ * token does not match
+ */
+int SessionManager::getSession(const session_token_s* token, session_s* session)
+{
+	uint32_t sessionId = token->lo;
+	uint64_t hashed = hash(sessionId);
+	shard_s* shard = shardOf(hashed);
+	session_s* slot;
+	uint32_t seq, now = nowS();
+	bool live;
+
+	if(sessionId == 0) return ERROR::NO_SESSION;
+
+	// keeps the table this lookup probes from being freed, see reclaim
+	shard->readers.fetch_add(1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	do {
+		seq = shard->seq.load(std::memory_order_acquire);
 
-	return slot;
+		slot = find(shard->table.load(std::memory_order_acquire), sessionId, hashed);
+		live = slot != nullptr;
+
+		if(live) {
+			memcpy(session, slot, sizeof(session_s));
+			live = matches(session, token) && !expired(session, now);
+
+			// only written once a second, so lookups rarely dirty the slot
+			if(live && session->lastAccess != now) {
+				std::atomic_ref<uint32_t>(slot->lastAccess).store(now, std::memory_order_relaxed);
+				session->lastAccess = now;
+			}
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+	} while((seq & 1) || shard->seq.load(std::memory_order_relaxed) != seq);
+
+	shard->readers.fetch_sub(1, std::memory_order_release);
+
+	return live ? 0 : ERROR::NO_SESSION;
 }
 
 
 /**
- * Delete the session with the given id
+ * Delete the narrow session with the given id
  * @param sessionId The id of the session to delete
  * @return 0 if successfully deleted, error code if not
  */
 int SessionManager::deleteSession(uint32_t sessionId)
 {
-	uint16_t slotPos = hash(sessionId);
-	session_s *slot, *prev;
+	session_token_s token = {0, sessionId};
 
-	prev = nullptr;
-	slot = _table[slotPos];
+	return deleteSession(&token);
+}
+
+
+/**
+ * Delete the session with the given token
+ * @param token The token of the session to delete
+ * @return 0 if successfully deleted, error code if not
+ */
+int SessionManager::deleteSession(const session_token_s* token)
+{
+	uint32_t sessionId = token->lo;
+	uint64_t hashed = hash(sessionId);
+	shard_s* shard = shardOf(hashed);
+	session_table_s* table;
+	session_s* found;
+
+	if(sessionId == 0) return ERROR::NO_SESSION;
+
+	std::lock_guard<std::mutex> lock(shard->mutex);
+
+	table = shard->table.load(std::memory_order_relaxed);
+
+	found = find(table, sessionId, hashed);
+
+	if(!found || !matches(found, token)) return ERROR::NO_SESSION;
+
+	removeAt(shard, table, found - tableSlots(table));
+
+	return 0;
+}
+
+
+/**
+ * Remove the expired sessions of the next few shards, and free the tables
+ * they outgrew, one shard locked at a time. Each call carries on where the
+ * last one stopped, so the whole table is covered over
+ * SESSION_SHARDS / numShards calls. Called from one thread.
+ * @param numShards Shards to sweep, SESSION_SHARDS for all of them
+ * @return Number of sessions removed
+ */
+size_t SessionManager::sweep(int numShards)
+{
+	session_table_s* table;
+	session_s* slot;
+	shard_s* shard;
+	uint32_t now = nowS();
+	size_t removed = 0;
 
-	if(slot == nullptr) return ERROR::NO_SESSION;
+	if(numShards > SESSION_SHARDS) numShards = SESSION_SHARDS;
 
-	while(slot != nullptr)
+	for(int i = 0; i < numShards; i++)
 	{
-		if(slot->id == sessionId) {
-			// found node, delete
-			if(prev == nullptr) {
-				_table[slotPos] = slot->next;
-				freeSession(slot);
-				return 0;
+		shard = &_shards[_sweepCursor];
+		_sweepCursor = (_sweepCursor + 1) % SESSION_SHARDS;
+
+		std::lock_guard<std::mutex> lock(shard->mutex);
+
+		table = shard->table.load(std::memory_order_relaxed);
+		slot = tableSlots(table);
+
+		// a removal shifts another session into this slot, so it is checked again
+		for(uint32_t pos = 0; _ttl != 0 && pos <= table->mask;)
+		{
+			if(slot[pos].id != 0 && expired(&slot[pos], now)) {
+				removeAt(shard, table, pos);
+				removed++;
+				continue;
 			}
 
-			prev->next = slot->next;
-			freeSession(slot);
-			return 0;
+			pos++;
 		}
 
+		reclaim(shard);
+	}
+
+	_expired.fetch_add(removed, std::memory_order_relaxed);
+
+	return removed;
+}
+
+
+/**
+ * @return Number of sessions held, including expired ones not yet swept
+ */
+size_t SessionManager::size()
+{
+	size_t count = 0;
 
-		prev = slot;
-		slot = slot->next;
+	for(int i = 0; i < SESSION_SHARDS; i++)
+	{
+		count += _shards[i].count.load(std::memory_order_relaxed);
 	}
 
-	return ERROR::NO_SESSION;
+	return count;
 }
 
 
 /**
- * Replace the uid for a session
+ * Bytes held for sessions, every shard's table, the tables it outgrew that
+ * are not freed yet and its unflushed changes
+ * @return Number of bytes
+ */
+size_t SessionManager::memoryUsage()
+{
+	size_t bytes = 0;
+
+	for(int i = 0; i < SESSION_SHARDS; i++)
+	{
+		std::lock_guard<std::mutex> lock(_shards[i].mutex);
+
+		bytes += tableSize(_shards[i].table.load(std::memory_order_relaxed)->mask + 1);
+
+		for(session_table_s* table : _shards[i].retired) bytes += tableSize(table->mask + 1);
+
+		bytes += _shards[i].changes.capacity() * sizeof(session_s);
+	}
+
+	return bytes;
+}
+
+
+/**
+ * Print the number of sessions, how many have been expired and evicted, and
+ * the memory they take
+ * @param file File to print to
+ */
+void SessionManager::dump(FILE* file)
+{
+	size_t live = size();
+	size_t bytes = memoryUsage();
+
+	fprintf(file, "sessions live:%lu expired:%lu evicted:%lu bytes:%lu bytes_per_session:%lu\n",
+	        live,
+	        _expired.load(std::memory_order_relaxed),
+	        _evicted.load(std::memory_order_relaxed),
+	        bytes,
+	        live > 0 ? bytes / live : 0);
+}
+
+
+/**
+ * Keep logged in sessions in a snapshot and the delta file after it, not
+ * safe once sessions are being created
+ * @param path Snapshot file, null to keep sessions in memory only
+ */
+void SessionManager::setSnapshotPath(const char* path)
+{
+	_snapshotPath = path;
+
+	if(path != nullptr) _deltaPath = std::string(path) + SESSION_DELTA_SUFFIX;
+}
+
+
+/**
+ * Write every live logged in session to the snapshot file and start an
+ * empty delta after it. Each shard is locked only while it is copied, the
+ * file is written to the side and renamed over the old one, so a crash
+ * leaves either snapshot whole. Calls must not overlap each other or
+ * flushChanges.
+ * @return 0 if written or there is no snapshot path, -1 if not
+ */
+int SessionManager::snapshot()
+{
+	std::vector<char> out;
+	uint64_t sectionSizes[SESSION_SHARDS];
+	uint32_t header[2] = { SNAPSHOT_MAGIC, SESSION_SHARDS };
+	uint64_t generation = _generation + 1;
+	size_t headerSize = sizeof(header) + sizeof(generation) + sizeof(sectionSizes);
+	int64_t offset = wallOffset();
+	std::string tempPath;
+	session_table_s* table;
+	session_s* slot;
+	uint32_t now = nowS();
+	size_t start;
+	int fd;
+
+	if(_snapshotPath == nullptr) return 0;
+
+	out.resize(headerSize);
+
+	for(int i = 0; i < SESSION_SHARDS; i++)
+	{
+		std::lock_guard<std::mutex> lock(_shards[i].mutex);
+
+		table = _shards[i].table.load(std::memory_order_relaxed);
+		slot = tableSlots(table);
+		start = out.size();
+
+		for(uint32_t pos = 0; pos <= table->mask; pos++)
+		{
+			if(slot[pos].id != 0 && slot[pos].uid[0] != 0 && !expired(&slot[pos], now)) encodeSession(&out, &slot[pos], false, offset);
+		}
+
+		// already in the snapshot
+		_shards[i].changes.clear();
+
+		sectionSizes[i] = out.size() - start;
+	}
+
+	memcpy(out.data(), header, sizeof(header));
+	memcpy(out.data() + sizeof(header), &generation, sizeof(generation));
+	memcpy(out.data() + sizeof(header) + sizeof(generation), sectionSizes, sizeof(sectionSizes));
+
+	tempPath = std::string(_snapshotPath) + ".tmp";
+
+	if((fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) return -1;
+
+	if(writeAll(fd, out.data(), out.size()) != 0 || fsync(fd) != 0) {
+		close(fd);
+		unlink(tempPath.c_str());
+		return -1;
+	}
+
+	close(fd);
+
+	if(rename(tempPath.c_str(), _snapshotPath) != 0) {
+		unlink(tempPath.c_str());
+		return -1;
+	}
+
+	_generation = generation;
+
+	// a delta left from an older generation is ignored when restoring
+	if(_deltaFd >= 0) close(_deltaFd);
+
+	header[0] = DELTA_MAGIC;
+	header[1] = 0;
+
+	if((_deltaFd = open(_deltaPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600)) < 0) return -1;
+
+	if(writeAll(_deltaFd, header, sizeof(header)) != 0 || writeAll(_deltaFd, &generation, sizeof(generation)) != 0) {
+		close(_deltaFd);
+		_deltaFd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Append the logins and removals since the last flush to the delta file.
+ * Not synced, a crashed process still leaves them to the page cache.
+ * @return 0 if written or there is no delta file, -1 if not
+ */
+int SessionManager::flushChanges()
+{
+	std::vector<session_s> changes;
+	std::vector<char> out;
+	int64_t offset = wallOffset();
+
+	if(_deltaFd < 0) return 0;
+
+	for(int i = 0; i < SESSION_SHARDS; i++)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_shards[i].mutex);
+			changes.swap(_shards[i].changes);
+		}
+
+		for(session_s& change : changes) encodeSession(&out, &change, change.uid[0] == 0, offset);
+
+		changes.clear();
+	}
+
+	if(out.empty()) return 0;
+
+	return writeAll(_deltaFd, out.data(), out.size());
+}
+
+
+/**
+ * Load the snapshot, its shards split between threads, then apply the delta
+ * written after it. Sessions that expired while the server was down are
+ * dropped. Must be called before sessions are looked up.
+ * @param numThreads Threads to load the snapshot with
+ * @return Number of sessions held once restored
+ */
+size_t SessionManager::restore(int numThreads)
+{
+	std::vector<char> snap, delta;
+	std::vector<std::thread> threads;
+	uint64_t sectionSizes[SESSION_SHARDS];
+	uint32_t header[2];
+	uint64_t generation, total = 0;
+	size_t headerSize = sizeof(header) + sizeof(generation) + sizeof(sectionSizes);
+
+	if(_snapshotPath == nullptr) return 0;
+
+	if(readFile(_snapshotPath, &snap) == 0 && snap.size() >= headerSize) {
+		memcpy(header, snap.data(), sizeof(header));
+		memcpy(&generation, snap.data() + sizeof(header), sizeof(generation));
+		memcpy(sectionSizes, snap.data() + sizeof(header) + sizeof(generation), sizeof(sectionSizes));
+
+		for(int i = 0; i < SESSION_SHARDS; i++) total += sectionSizes[i];
+
+		if(header[0] == SNAPSHOT_MAGIC && header[1] == SESSION_SHARDS && total == snap.size() - headerSize) {
+			if(numThreads < 1) numThreads = 1;
+			if(numThreads > SESSION_SHARDS) numThreads = SESSION_SHARDS;
+
+			// a section only holds sessions of its own shard, so threads never share a lock
+			for(int t = 0; t < numThreads; t++) {
+				threads.emplace_back(&SessionManager::restoreShards, this, snap.data() + headerSize, sectionSizes, t, numThreads);
+			}
+
+			for(std::thread& thread : threads) thread.join();
+
+			_generation = generation;
+		}
+	}
+
+	if(readFile(_deltaPath.c_str(), &delta) == 0 && delta.size() >= sizeof(header) + sizeof(generation)) {
+		memcpy(header, delta.data(), sizeof(header));
+		memcpy(&generation, delta.data() + sizeof(header), sizeof(generation));
+
+		if(header[0] == DELTA_MAGIC && _generation != 0 && generation == _generation) {
+			replayChanges(delta.data() + sizeof(header) + sizeof(generation), delta.size() - sizeof(header) - sizeof(generation));
+		}
+	}
+
+	return size();
+}
+
+
+/**
+ * Load every step'th section of a snapshot
+ * @param sections The sections, one per shard in order
+ * @param sectionSizes Size of each section
+ * @param first First section to load
+ * @param step Sections between the ones loaded
+ */
+void SessionManager::restoreShards(const char* sections, const uint64_t* sectionSizes, int first, int step)
+{
+	session_s session;
+	size_t pos, end;
+	int64_t offset = wallOffset();
+	bool removed;
+	int used;
+
+	for(int i = first; i < SESSION_SHARDS; i += step)
+	{
+		pos = 0;
+		for(int j = 0; j < i; j++) pos += sectionSizes[j];
+
+		end = pos + sectionSizes[i];
+
+		while(pos < end) {
+			if((used = decodeSession(sections + pos, end - pos, &session, &removed, offset)) < 0) break;
+			pos += used;
+
+			if(!removed) insert(&session);
+		}
+	}
+}
+
+
+/**
+ * Apply delta records in the order they were logged, a login replaces the
+ * session and a removal deletes it
+ * @param delta The records
+ * @param size Size of the records, a torn last record is ignored
+ */
+void SessionManager::replayChanges(const char* delta, size_t size)
+{
+	session_s session;
+	size_t pos = 0;
+	int64_t offset = wallOffset();
+	int used;
+	bool removed;
+
+	while(pos < size) {
+		if((used = decodeSession(delta + pos, size - pos, &session, &removed, offset)) < 0) break;
+		pos += used;
+
+		deleteSession(&session.token);
+
+		if(!removed) insert(&session);
+	}
+}
+
+
+/**
+ * Log a logged in session's change to be flushed to the delta file. Must
+ * hold the shard's mutex.
+ * @param shard The session's shard
+ * @param session The session as changed
+ * @param removed Whether the session is being removed
+ */
+void SessionManager::logChange(shard_s* shard, session_s* session, bool removed)
+{
+	if(_snapshotPath == nullptr || session->uid[0] == 0) return;
+
+	shard->changes.push_back(*session);
+
+	if(removed) shard->changes.back().uid[0] = 0;
+}
+
+
+/**
+ * Evict the least recently used of a sample of a shard's sessions, the
+ * sample starts at a slot picked by the hash of the session being inserted.
+ * Must hold the shard's mutex.
+ * @param shard The full shard
+ * @param hashed Hash of the session being inserted
+ */
+void SessionManager::evict(shard_s* shard, uint64_t hashed)
+{
+	session_table_s* table = shard->table.load(std::memory_order_relaxed);
+	session_s* slot = tableSlots(table);
+	// bits above the ones picking the shard
+	uint32_t pos = (hashed >> 38) & table->mask;
+	uint32_t victim = 0;
+	int sampled = 0;
+
+	for(uint32_t i = 0; i <= table->mask && sampled < SESSION_EVICT_SAMPLES; i++)
+	{
+		if(slot[pos].id != 0) {
+			if(sampled == 0 || slot[pos].lastAccess < slot[victim].lastAccess) victim = pos;
+			sampled++;
+		}
+
+		pos = (pos + 1) & table->mask;
+	}
+
+	if(sampled == 0) return;
+
+	removeAt(shard, table, victim);
+	_evicted.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+/**
+ * Remove the session in a slot. The sessions probed past it are shifted back
+ * into the hole, so lookups never need tombstones. Must hold the shard's mutex.
+ * @param shard The shard holding the table
+ * @param table The shard's table
+ * @param hole Slot of the session to remove
+ */
+void SessionManager::removeAt(shard_s* shard, session_table_s* table, uint32_t hole)
+{
+	session_s* slot = tableSlots(table);
+	uint32_t next = hole, home;
+
+	logChange(shard, &slot[hole], true);
+
+	beginWrite(shard);
+
+	while(true) {
+		next = (next + 1) & table->mask;
+
+		if(slot[next].id == 0) break;
+
+		// a session may fill the hole unless its home slot lies between them
+		home = hash(slot[next].id) & table->mask;
+
+		if(((next - home) & table->mask) >= ((next - hole) & table->mask)) {
+			memcpy(&slot[hole], &slot[next], sizeof(session_s));
+			hole = next;
+		}
+	}
+
+	memset(&slot[hole], 0, sizeof(session_s));
+
+	endWrite(shard);
+
+	shard->count.store(shard->count.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+}
+
+
+/**
+ * Replace the uid for a narrow session
  * @param sessionId The id of the session to set uid
  * @param uid The string of the uid to replace with
  * @return 0 if successful, error code if not
  */
 int SessionManager::replaceUid(uint32_t sessionId, const char* uid)
 {
-	int uidLen;
-	session_s* session = getSession(sessionId);
+	session_token_s token = {0, sessionId};
+
+	return replaceUid(&token, uid);
+}
+
+
+/**
+ * Replace the uid for a session
+ * @param token The token of the session to set uid
+ * @param uid The string of the uid to replace with
+ * @return 0 if successful, error code if not
+ */
+int SessionManager::replaceUid(const session_token_s* token, const char* uid)
+{
+	uint32_t sessionId = token->lo;
+	uint64_t hashed = hash(sessionId);
+	shard_s* shard = shardOf(hashed);
+	session_s* session;
+	size_t uidLen = strlen(uid);
+
+	if(uidLen > DEFAULT_UID_LEN) return ERROR::PARAM_INVAL;
+	if(sessionId == 0) return ERROR::NO_SESSION;
+
+	std::lock_guard<std::mutex> lock(shard->mutex);
+
+	session = find(shard->table.load(std::memory_order_relaxed), sessionId, hashed);
+
+	if(!session || !matches(session, token) || expired(session, nowS())) return ERROR::NO_SESSION;
+
+	beginWrite(shard);
+	memcpy(session->uid, uid, uidLen+1);
+	session->lastAccess = nowS();
+	endWrite(shard);
+
+	logChange(shard, session, false);
+
+	return 0;
+}
+
+
+/**
+ * Move a shard's sessions into a table twice its size in one pass. Only the
+ * shard's writers wait, and for no more than a copy of the shard's share of
+ * the session cap, readers keep probing the old table, which does not change
+ * once replaced and is freed by reclaim. Must hold the shard's mutex.
+ * @param shard The shard to grow
+ */
+void SessionManager::grow(shard_s* shard)
+{
+	session_table_s* old = shard->table.load(std::memory_order_relaxed);
+	session_table_s* table = newTable((old->mask + 1) * 2);
+	session_s* oldSlot = tableSlots(old);
+	session_s* slot = tableSlots(table);
+	uint32_t pos;
+
+	for(uint32_t i = 0; i <= old->mask; i++)
+	{
+		if(oldSlot[i].id == 0) continue;
+
+		pos = hash(oldSlot[i].id) & table->mask;
+		while(slot[pos].id != 0) pos = (pos + 1) & table->mask;
+
+		memcpy(&slot[pos], &oldSlot[i], sizeof(session_s));
+	}
+
+	shard->table.store(table, std::memory_order_release);
+	shard->retired.push_back(old);
+}
+
+
+/**
+ * Free the tables a shard has outgrown once no lookup is in the shard. A
+ * lookup counts itself before loading the table, so one that started after
+ * the swap always probes the new table. Must hold the shard's mutex.
+ * @param shard The shard
+ */
+void SessionManager::reclaim(shard_s* shard)
+{
+	if(shard->retired.empty()) return;
+
+	// pairs with the fence in getSession, either it sees the new table or this sees it
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if(shard->readers.load(std::memory_order_acquire) != 0) return;
+
+	for(session_table_s* table : shard->retired) free(table);
+
+	shard->retired.clear();
+}
+
+
+/**
+ * Find a session's slot in a table. Safe to call while a writer changes the
+ * table, the probe is bounded and the caller checks the shard's sequence.
+ * @param table The table to probe
+ * @param sessionId The id to look for
+ * @param hashed Hash of the id
+ * @return The slot, null if not in the table
+ */
+session_s* SessionManager::find(session_table_s* table, uint32_t sessionId, uint64_t hashed)
+{
+	session_s* slot = tableSlots(table);
+	uint32_t pos = hashed & table->mask;
+
+	for(uint32_t i = 0; i <= table->mask; i++)
+	{
+		if(slot[pos].id == sessionId) return &slot[pos];
+		if(slot[pos].id == 0) return nullptr;
+
+		pos = (pos + 1) & table->mask;
+	}
+
+	return nullptr;
+}
+
+
+/**
+ * Mark a shard as being written, readers retry until endWrite. Must hold the
+ * shard's mutex.
+ * @param shard The shard
+ */
+void SessionManager::beginWrite(shard_s* shard)
+{
+	shard->seq.store(shard->seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+}
+
+
+/**
+ * Publish a shard's writes, see beginWrite
+ * @param shard The shard
+ */
+void SessionManager::endWrite(shard_s* shard)
+{
+	shard->seq.store(shard->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+
+/**
+ * Allocate an empty table, its slots follow it. Aligned to a cache line so
+ * a lookup touches one line per slot probed.
+ * @param numSlots Number of slots, a power of two
+ * @return The table
+ */
+session_table_s* SessionManager::newTable(uint32_t numSlots)
+{
+	size_t size = tableSize(numSlots);
+	session_table_s* table = (session_table_s*) aligned_alloc (SESSION_SLOT_SIZE, size);
+
+	memset(table, 0, size);
+
+	table->mask = numSlots - 1;
+
+	return table;
+}
+
+
+/**
+ * @param numSlots Number of slots
+ * @return Bytes taken by a table with that many slots
+ */
+size_t SessionManager::tableSize(uint32_t numSlots)
+{
+	return sizeof(session_table_s) + (size_t)numSlots * sizeof(session_s);
+}
+
+
+/**
+ * @param table A table
+ * @return The table's first slot
+ */
+session_s* SessionManager::tableSlots(session_table_s* table)
+{
+	return (session_s*)(table + 1);
+}
+
+
+/**
+ * Shard holding the sessions with a hash, picked by its high bits so the low
+ * bits are left for the slot
+ * @param hashed Hash of a session ID
+ * @return The shard
+ */
+SessionManager::shard_s* SessionManager::shardOf(uint64_t hashed)
+{
+	return &_shards[(hashed >> 32) % SESSION_SHARDS];
+}
+
+
+/**
+ * Whether a session has gone unused for longer than the TTL
+ * @param session The session
+ * @param now Current time from nowS
+ * @return True if expired
+ */
+bool SessionManager::expired(session_s* session, uint32_t now)
+{
+	return _ttl != 0 && now - session->lastAccess > _ttl;
+}
 
-	if(!session) return ERROR::NO_SESSION;
 
-	if(session->uid != nullptr) free(session->uid);
+/**
+ * Coarse monotonic clock, only read to the second
+ * @return Current monotonic time in seconds
+ */
+uint32_t SessionManager::nowS()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return ts.tv_sec;
+}
 
-	uidLen = strlen(uid);
 
-	session->uid = (char*) malloc (uidLen+1);
+/**
+ * Whether a token is the one of a session, compared without branching on
+ * the bytes so a wrong guess takes as long as a close one
+ * @param session The session found by the token's ID
+ * @param token The token looked up with
+ * @return True if they match
+ */
+bool SessionManager::matches(session_s* session, const session_token_s* token)
+{
+	return ((session->token.hi ^ token->hi) | (session->token.lo ^ token->lo)) == 0;
+}
 
-	strncpy(session->uid, uid, uidLen+1);
+
+/**
+ * Fill a buffer from the kernel's CSPRNG. Each thread fetches
+ * ENTROPY_BATCH_SIZE bytes at a time and hands them out, so most sessions
+ * are created without a system call. Bytes are wiped once handed out.
+ * @param buf Buffer to fill
+ * @param len Number of bytes, at most ENTROPY_BATCH_SIZE
+ */
+void SessionManager::randomBytes(void* buf, size_t len)
+{
+	thread_local unsigned char pool[ENTROPY_BATCH_SIZE];
+	thread_local size_t left = 0;
+	size_t filled = 0;
+	ssize_t got;
+
+	if(left < len) {
+		while(filled < ENTROPY_BATCH_SIZE) {
+			got = getrandom(pool + filled, ENTROPY_BATCH_SIZE - filled, 0);
+
+			if(got < 0) {
+				if(errno == EINTR) continue;
+				// never fall back to predictable tokens
+				abort();
+			}
+
+			filled += got;
+		}
+
+		left = ENTROPY_BATCH_SIZE;
+	}
+
+	left -= len;
+	memcpy(buf, pool + left, len);
+	memset(pool + left, 0, len);
+}
+
+
+/**
+ * Append a session record, its flags byte and token, then for a login the
+ * wall clock time of its last use and its length prefixed uid
+ * @param out Buffer to append to
+ * @param session The session
+ * @param removed Whether the record removes the session
+ * @param offset Wall clock time less the monotonic time, from wallOffset
+ */
+void SessionManager::encodeSession(std::vector<char>* out, session_s* session, bool removed, int64_t offset)
+{
+	uint8_t flags = removed ? RECORD_REMOVED : 0;
+	int64_t lastUsed = session->lastAccess + offset;
+	uint8_t uidLen = strlen(session->uid);
+
+	out->insert(out->end(), (char*)&flags, (char*)&flags + 1);
+	out->insert(out->end(), (char*)&session->token, (char*)&session->token + sizeof(session_token_s));
+
+	if(removed) return;
+
+	out->insert(out->end(), (char*)&lastUsed, (char*)&lastUsed + sizeof(lastUsed));
+	out->insert(out->end(), (char*)&uidLen, (char*)&uidLen + 1);
+	out->insert(out->end(), session->uid, session->uid + uidLen);
+}
+
+
+/**
+ * Read a session record written by encodeSession. A login that has gone
+ * unused for longer than the TTL, judged by the wall clock since the
+ * monotonic clock restarts with the machine, reads as a removal.
+ * @param buf The record
+ * @param size Bytes available at buf
+ * @param session Container for the session
+ * @param removed Container for whether the record removes the session
+ * @param offset Wall clock time less the monotonic time, from wallOffset
+ * @return Size of the record, -1 if it is cut short or malformed
+ */
+int SessionManager::decodeSession(const char* buf, size_t size, session_s* session, bool* removed, int64_t offset)
+{
+	size_t pos = 1 + sizeof(session_token_s);
+	int64_t lastUsed, wallNow = offset + nowS();
+	uint8_t uidLen;
+
+	if(size < pos) return -1;
+
+	memset(session, 0, sizeof(session_s));
+
+	*removed = buf[0] & RECORD_REMOVED;
+	memcpy(&session->token, buf + 1, sizeof(session_token_s));
+	session->id = session->token.lo;
+
+	if(session->id == 0) return -1;
+	if(*removed) return pos;
+
+	if(size < pos + sizeof(lastUsed) + 1) return -1;
+
+	memcpy(&lastUsed, buf + pos, sizeof(lastUsed));
+	uidLen = buf[pos + sizeof(lastUsed)];
+	pos += sizeof(lastUsed) + 1;
+
+	if(uidLen == 0 || uidLen > DEFAULT_UID_LEN || size < pos + uidLen) return -1;
+
+	memcpy(session->uid, buf + pos, uidLen);
+
+	if(_ttl != 0 && wallNow - lastUsed > (int64_t)_ttl) {
+		*removed = true;
+		return pos + uidLen;
+	}
+
+	// still live but used before this boot, as old as the monotonic clock allows
+	session->lastAccess = lastUsed > offset ? lastUsed - offset : 0;
+
+	return pos + uidLen;
+}
+
+
+/**
+ * Difference between the wall clock and the monotonic clock, converts the
+ * monotonic times sessions keep to ones that survive a reboot
+ * @return Wall clock seconds less monotonic seconds
+ */
+int64_t SessionManager::wallOffset()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+
+	return (int64_t)ts.tv_sec - nowS();
+}
+
+
+/**
+ * Read a whole file
+ * @param path The file
+ * @param contents Container for its contents
+ * @return 0 if read, -1 if not
+ */
+int SessionManager::readFile(const char* path, std::vector<char>* contents)
+{
+	struct stat st;
+	size_t got = 0;
+	ssize_t ret;
+	int fd;
+
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return -1;
+
+	if(fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	contents->resize(st.st_size);
+
+	while(got < contents->size()) {
+		ret = read(fd, contents->data() + got, contents->size() - got);
+
+		if(ret < 0 && errno == EINTR) continue;
+		if(ret <= 0) break;
+
+		got += ret;
+	}
+
+	close(fd);
+
+	contents->resize(got);
 
 	return 0;
 }
 
 
 /**
- * Free memory associated with session, including the pointer itself
- * @param session Pointer to session to free
+ * Write a whole buffer, retrying short writes
+ * @param fd File to write to
+ * @param buf Buffer to write
+ * @param size Bytes to write
+ * @return 0 if written, -1 if not
  */
-void SessionManager::freeSession(session_s* session)
+int SessionManager::writeAll(int fd, const void* buf, size_t size)
 {
-	if(session == nullptr) return;
+	size_t written = 0;
+	ssize_t ret;
+
+	while(written < size) {
+		ret = write(fd, (const char*)buf + written, size - written);
 
-	if(session->uid != nullptr) free(session->uid);
+		if(ret < 0 && errno == EINTR) continue;
+		if(ret <= 0) return -1;
 
-	free(session);
+		written += ret;
+	}
+
+	return 0;
 }
 
 
 /**
- * Create a hash to the table size based on session id
+ * Mix every bit of a session ID into every bit of the hash
  * @param sessionId The session ID to hash
- * @return A valid table position hashed from input
+ * @return The hash
  */
-uint16_t SessionManager::hash(uint32_t sessionId)
+uint64_t SessionManager::hash(uint32_t sessionId)
 {
-	return sessionId % _tableSize;
-}
\ No newline at end of file
+	uint64_t x = sessionId;
+
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+
+	return x;
+}
@@ -1,44 +1,187 @@
+#pragma once
 /**
  * Author: Ryan Steinwert
  *
  * Definition for server session manager class
  */
 
-#include <vector>
+#include <atomic>
 #include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include "definitions.h"
 
+// sessions are spread over this many shards, each one its own table
+#define SESSION_SHARDS 64
+
+// slots a shard starts with, a power of two
+#define DEFAULT_SHARD_SLOTS 16
+
+// sessions not looked up for this long expire, 0 never expires them
+#define DEFAULT_SESSION_TTL_S 1800
+
+// live sessions kept before the least recently used ones are evicted
+#define DEFAULT_MAX_SESSIONS 1048576
+
+// shards a sweep looks at by default, later sweeps carry on from the next one
+#define SESSION_SWEEP_SHARDS 4
+
+// sessions compared when picking one to evict, approximates LRU
+#define SESSION_EVICT_SAMPLES 16
+
+// changes since the last snapshot are appended to the snapshot path with this suffix
+#define SESSION_DELTA_SUFFIX ".delta"
+
+// size of a session slot, a slot never straddles two cache lines
+#define SESSION_SLOT_SIZE 64
+
 
 typedef struct session_t {
 	uint32_t id;
-	char* uid;
-	session_t* next;
+	// coarse monotonic seconds of the last lookup
+	uint32_t lastAccess;
+	// its ID in the low bits, the rest random for wide sessions, 0 for narrow
+	session_token_s token;
+	// empty until the session logs in, account uids are always DEFAULT_UID_LEN
+	char uid[DEFAULT_UID_LEN+1];
 } session_s;
 
+static_assert(sizeof(session_s) == SESSION_SLOT_SIZE, "session slots are one cache line");
+
+
+/**
+ * Open addressed slots of a shard, the slots follow the struct in the same
+ * allocation. A slot with id 0 is empty.
+ */
+typedef struct session_table_t {
+	// pads the struct so the slots after it start on a cache line
+	alignas(SESSION_SLOT_SIZE) uint32_t mask;
+} session_table_s;
+
 
 
+/**
+ * Session table safe to use from every thread. Sessions are spread over
+ * shards of linear probed slots, each with a mutex for writers and a
+ * sequence count readers check, so lookups never lock. A full shard grows
+ * on its own without stopping the others, readers keep using its old slots
+ * until the new ones are swapped in, and the old slots are freed once no
+ * lookup is left in the shard.
+ *
+ * Sessions expire once unused for the TTL, every lookup pushes that back.
+ * Expired sessions are hidden from lookups right away and removed by sweep,
+ * a few shards at a time.
+ * Each shard holds at most its share of the session cap, a full shard
+ * evicts the least recently used of a sample of its sessions.
+ *
+ * A session is found by the 32 bit ID in the low bits of its token, then the
+ * whole token has to match. Wide sessions have a random 128 bit token, so
+ * guessing an ID is not enough to take one over.
+ *
+ * Given a snapshot path, logged in sessions outlive the process. Each shard
+ * logs its logins and removals, flushChanges appends them to a delta file
+ * and snapshot writes the whole table and starts a new delta. restore loads
+ * both, a thread per group of shards, before any lookups.
+ */
 class SessionManager {
 public:
 	SessionManager();
-	SessionManager(uint16_t tableSize);
+	SessionManager(uint32_t shardSlots);
 	~SessionManager();
 
+	SessionManager(const SessionManager&) = delete;
+	SessionManager& operator=(const SessionManager&) = delete;
+
+	void setLimits(uint32_t ttl, size_t maxSessions);
+
 	uint32_t createSession();
+	int createSession(session_token_s* token);
 
-	session_s* getSession(uint32_t sessionId);
+	int getSession(uint32_t sessionId, session_s* session);
+	int getSession(const session_token_s* token, session_s* session);
 
 	int deleteSession(uint32_t sessionId);
+	int deleteSession(const session_token_s* token);
 
 	int replaceUid(uint32_t sessionId, const char* uid);
+	int replaceUid(const session_token_s* token, const char* uid);
+
+	size_t sweep(int numShards = SESSION_SWEEP_SHARDS);
+	size_t size();
+	size_t memoryUsage();
+
+	void dump(FILE* file);
+
+	void setSnapshotPath(const char* path);
+	int snapshot();
+	int flushChanges();
+	size_t restore(int numThreads);
 
 private:
-	uint16_t _tableSize;
-	session_s** _table;
+	typedef struct shard_t {
+		alignas(64) std::mutex mutex;
+		// odd while a writer is changing the slots
+		std::atomic<uint32_t> seq;
+		std::atomic<session_table_s*> table;
+		std::atomic<uint32_t> count;
+		// tables replaced by a larger one, readers may still be in them
+		std::vector<session_table_s*> retired;
+		// lookups in the shard, retired tables are freed once there are none
+		alignas(64) std::atomic<uint32_t> readers;
+		// logins and removals not yet flushed, a change without a uid removes
+		std::vector<session_s> changes;
+	} shard_s;
+
+	shard_s _shards[SESSION_SHARDS];
 
-	uint16_t hash(uint32_t sessionId);
+	uint32_t _ttl;
+	uint32_t _maxPerShard;
+
+	// next shard to sweep
+	int _sweepCursor;
+
+	std::atomic<uint64_t> _expired;
+	std::atomic<uint64_t> _evicted;
+
+	// no persistence when null
+	const char* _snapshotPath;
+	std::string _deltaPath;
+	int _deltaFd;
+	// pairs a delta with the snapshot it follows
+	uint64_t _generation;
+
+	shard_s* shardOf(uint64_t hashed);
+	session_s* find(session_table_s* table, uint32_t sessionId, uint64_t hashed);
 
 	int insert(session_s* session);
+	void grow(shard_s* shard);
+	void reclaim(shard_s* shard);
+	void evict(shard_s* shard, uint64_t hashed);
+	void removeAt(shard_s* shard, session_table_s* table, uint32_t hole);
+	bool expired(session_s* session, uint32_t now);
+	void logChange(shard_s* shard, session_s* session, bool removed);
+
+	void restoreShards(const char* sections, const uint64_t* sectionSizes, int first, int step);
+	void replayChanges(const char* delta, size_t size);
+
+	void beginWrite(shard_s* shard);
+	void endWrite(shard_s* shard);
+
+	static session_table_s* newTable(uint32_t numSlots);
+	static session_s* tableSlots(session_table_s* table);
+	static size_t tableSize(uint32_t numSlots);
+
+	static bool matches(session_s* session, const session_token_s* token);
+	static void randomBytes(void* buf, size_t len);
+	static uint64_t hash(uint32_t sessionId);
 
-	void freeSession(session_s* session);
+	static void encodeSession(std::vector<char>* out, session_s* session, bool removed, int64_t offset);
+	int decodeSession(const char* buf, size_t size, session_s* session, bool* removed, int64_t offset);
+	static int64_t wallOffset();
+	static int readFile(const char* path, std::vector<char>* contents);
+	static int writeAll(int fd, const void* buf, size_t size);
+	static uint32_t nowS();
 };
@@ -0,0 +1,237 @@
+/**
+ * Author: Ryan Steinwert
+ *
+ * Tests for timer wheel module
+ */
+
+#include <cstdio>
+#include <cstring>
+
+
+#include "../TimerWheel.h"
+
+// ticks covered by each of the two lowest levels
+#define LEVEL_0_TICKS ((uint64_t)TIMER_WHEEL_SLOTS)
+#define LEVEL_1_TICKS ((uint64_t)TIMER_WHEEL_SLOTS * TIMER_WHEEL_SLOTS)
+
+int armTests();
+int levelZeroTests();
+int levelOneTests();
+int cascadeTests();
+int blockEndTests();
+
+uint64_t fireTime(TimerWheel* wheel, timer_entry_s* timer, uint64_t fromMs, uint64_t limitMs);
+
+void printResult(FILE* file, int testResult);
+
+int main()
+{
+	FILE* out = stdout;
+
+
+	fprintf(out, "Arm tests: ");
+	printResult(out, armTests());
+
+	fprintf(out, "Level zero tests: ");
+	printResult(out, levelZeroTests());
+
+	fprintf(out, "Level one tests: ");
+	printResult(out, levelOneTests());
+
+	fprintf(out, "Cascade tests: ");
+	printResult(out, cascadeTests());
+
+	fprintf(out, "Block end tests: ");
+	printResult(out, blockEndTests());
+}
+
+
+/**
+ * Arming counts a timer once however often it is rearmed, cancelling
+ * removes it and cancelling a disarmed timer does nothing
+ */
+int armTests()
+{
+	TimerWheel wheel(0);
+	timer_entry_s first, second;
+
+	memset(&first, 0, sizeof(first));
+	memset(&second, 0, sizeof(second));
+
+	if(wheel.size() != 0 || wheel.timeout() != -1) return -1;
+
+	wheel.arm(&first, 500);
+	wheel.arm(&second, 700);
+	wheel.arm(&first, 900);
+
+	if(wheel.size() != 2 || wheel.timeout() != TIMER_TICK_MS) return -2;
+
+	wheel.cancel(&first);
+	wheel.cancel(&first);
+
+	if(wheel.size() != 1 || first.next != nullptr) return -3;
+
+	// only the timer still armed fires
+	if(wheel.expire(1000) != &second) return -4;
+	if(wheel.expire(1000) != nullptr) return -5;
+
+	if(wheel.size() != 0 || second.next != nullptr) return -6;
+
+	return 0;
+}
+
+
+/**
+ * A timer within the first level fires on the tick its deadline rounds up
+ * to, never before, and one already due fires on the next expire
+ */
+int levelZeroTests()
+{
+	TimerWheel wheel(0);
+	timer_entry_s timer;
+
+	memset(&timer, 0, sizeof(timer));
+
+	wheel.arm(&timer, 5 * TIMER_TICK_MS);
+	if(fireTime(&wheel, &timer, 0, LEVEL_0_TICKS * TIMER_TICK_MS) != 5 * TIMER_TICK_MS) return -1;
+
+	// rounded up to the next tick
+	wheel.arm(&timer, 10 * TIMER_TICK_MS + 1);
+	if(fireTime(&wheel, &timer, 5 * TIMER_TICK_MS, LEVEL_0_TICKS * TIMER_TICK_MS) != 11 * TIMER_TICK_MS) return -2;
+
+	// the last slot of the level
+	wheel.arm(&timer, (11 + LEVEL_0_TICKS - 1) * TIMER_TICK_MS);
+	if(fireTime(&wheel, &timer, 11 * TIMER_TICK_MS, 2 * LEVEL_0_TICKS * TIMER_TICK_MS) != (11 + LEVEL_0_TICKS - 1) * TIMER_TICK_MS) return -3;
+
+	wheel.arm(&timer, 0);
+	if(wheel.expire((11 + LEVEL_0_TICKS - 1) * TIMER_TICK_MS) != &timer) return -4;
+
+	return 0;
+}
+
+
+/**
+ * Timers past the first level fire on their tick once cascaded down
+ */
+int levelOneTests()
+{
+	TimerWheel wheel(0);
+	timer_entry_s timers[3];
+	uint64_t deadlines[3] = { LEVEL_0_TICKS + 3, 3 * LEVEL_0_TICKS + 7, LEVEL_1_TICKS - 1 };
+
+	memset(timers, 0, sizeof(timers));
+
+	for(int i = 0; i < 3; i++)
+	{
+		TimerWheel single(0);
+
+		single.arm(&timers[i], deadlines[i] * TIMER_TICK_MS);
+		if(fireTime(&single, &timers[i], 0, 2 * LEVEL_1_TICKS * TIMER_TICK_MS) != deadlines[i] * TIMER_TICK_MS) return -1 - i;
+	}
+
+	// all armed at once, they fire in deadline order
+	for(int i = 0; i < 3; i++) wheel.arm(&timers[i], deadlines[i] * TIMER_TICK_MS);
+
+	for(int i = 0; i < 3; i++)
+	{
+		if(fireTime(&wheel, &timers[i], i > 0 ? deadlines[i-1] * TIMER_TICK_MS : 0, 2 * LEVEL_1_TICKS * TIMER_TICK_MS) != deadlines[i] * TIMER_TICK_MS) return -4 - i;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Deadlines exactly on a level boundary fire when the level below wraps
+ * and its slot is cascaded, including one cascaded through two levels
+ */
+int cascadeTests()
+{
+	timer_entry_s timer;
+
+	memset(&timer, 0, sizeof(timer));
+
+	{
+		TimerWheel wheel(0);
+
+		wheel.arm(&timer, LEVEL_0_TICKS * TIMER_TICK_MS);
+		if(fireTime(&wheel, &timer, 0, 2 * LEVEL_0_TICKS * TIMER_TICK_MS) != LEVEL_0_TICKS * TIMER_TICK_MS) return -1;
+	}
+
+	{
+		TimerWheel wheel(0);
+
+		wheel.arm(&timer, 2 * LEVEL_0_TICKS * TIMER_TICK_MS);
+		if(fireTime(&wheel, &timer, 0, 3 * LEVEL_0_TICKS * TIMER_TICK_MS) != 2 * LEVEL_0_TICKS * TIMER_TICK_MS) return -2;
+	}
+
+	{
+		TimerWheel wheel(0);
+
+		// held on the third level, cascaded to the second and then the first
+		wheel.arm(&timer, (LEVEL_1_TICKS + 5) * TIMER_TICK_MS);
+		if(fireTime(&wheel, &timer, 0, 2 * LEVEL_1_TICKS * TIMER_TICK_MS) != (LEVEL_1_TICKS + 5) * TIMER_TICK_MS) return -3;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Deadlines armed near the end of a block, so their slot is in the next
+ * block of the level, or wraps the level above, still fire on their tick
+ */
+int blockEndTests()
+{
+	timer_entry_s timer;
+	uint64_t startTicks[3] = { LEVEL_0_TICKS - 1, 2 * LEVEL_0_TICKS - 2, LEVEL_1_TICKS - 2 };
+	uint64_t deltas[3] = { 1, LEVEL_0_TICKS + 1, 100 };
+
+	memset(&timer, 0, sizeof(timer));
+
+	for(int i = 0; i < 3; i++)
+	{
+		uint64_t start = startTicks[i] * TIMER_TICK_MS;
+		uint64_t deadline = (startTicks[i] + deltas[i]) * TIMER_TICK_MS;
+		TimerWheel wheel(start);
+
+		wheel.arm(&timer, deadline);
+		if(fireTime(&wheel, &timer, start, deadline + LEVEL_1_TICKS * TIMER_TICK_MS) != deadline) return -1 - i;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Step a wheel one tick at a time until a timer fires
+ * @param wheel The wheel to step
+ * @param timer The timer expected to fire
+ * @param fromMs Time to start stepping from
+ * @param limitMs Time to give up at
+ * @return Time the timer fired at, 0 if it did not or another timer fired first
+ */
+uint64_t fireTime(TimerWheel* wheel, timer_entry_s* timer, uint64_t fromMs, uint64_t limitMs)
+{
+	timer_entry_s* fired;
+
+	for(uint64_t nowMs = fromMs; nowMs <= limitMs; nowMs += TIMER_TICK_MS)
+	{
+		if((fired = wheel->expire(nowMs)) != nullptr) return fired == timer ? nowMs : 0;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Print success or FAILED based on given result of test
+ */
+void printResult(FILE* file, int testResult) 
+{
+    if(testResult == 0) {
+        fprintf(file, "success\n");
+    } else {
+        fprintf(file, "FAILED: %d\n", testResult);
+    }
+}
@@ -0,0 +1,137 @@
+/**
+ * Author: Ryan Steinwert
+ *
+ * Implementation for rotating TLS session ticket key ring
+ */
+
+#define DEFAULT_TICKET_KEY_LIFETIME 3600
+
+#include <cstring>
+
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+
+#include "TicketKeyRing.h"
+
+
+
+TicketKeyRing::TicketKeyRing(time_t lifetime) :
+	_lifetime(lifetime),
+	_current(0)
+{
+	for(int i = 0; i < TICKET_KEY_COUNT; i++)
+	{
+		_keys[i].valid = false;
+	}
+}
+
+
+TicketKeyRing::TicketKeyRing() : TicketKeyRing(DEFAULT_TICKET_KEY_LIFETIME)
+{
+}
+
+
+TicketKeyRing::~TicketKeyRing()
+{
+	// do not leave key material behind in freed memory, a plain memset is a dead store
+	OPENSSL_cleanse(_keys, sizeof(_keys));
+}
+
+
+/**
+ * Copy out the key used to encrypt new tickets, rotating it first if it has expired
+ * @param name Buffer of TICKET_KEY_NAME_SIZE for the key name
+ * @param aesKey Buffer of TICKET_AES_KEY_SIZE for the cipher key
+ * @param hmacKey Buffer of TICKET_HMAC_KEY_SIZE for the mac key
+ * @return 0 if successful, -1 if no key material could be generated
+ */
+int TicketKeyRing::encryptionKey(unsigned char* name, unsigned char* aesKey, unsigned char* hmacKey)
+{
+	int ret;
+	time_t now = time(nullptr);
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	ticket_key_s* key = _keys + _current;
+
+	if(!key->valid || now - key->created >= _lifetime) {
+		if((ret = rotateLocked(now)) != 0) return ret;
+		key = _keys + _current;
+	}
+
+	memcpy(name, key->name, TICKET_KEY_NAME_SIZE);
+	memcpy(aesKey, key->aesKey, TICKET_AES_KEY_SIZE);
+	memcpy(hmacKey, key->hmacKey, TICKET_HMAC_KEY_SIZE);
+
+	return 0;
+}
+
+
+/**
+ * Look up the key a ticket was encrypted with
+ * @param name Key name taken from the ticket
+ * @param aesKey Buffer of TICKET_AES_KEY_SIZE for the cipher key
+ * @param hmacKey Buffer of TICKET_HMAC_KEY_SIZE for the mac key
+ * @param renew Set true if the key is retired and the client should get a fresh ticket
+ * @return 0 if found, -1 if the key is unknown or expired
+ */
+int TicketKeyRing::decryptionKey(const unsigned char* name, unsigned char* aesKey, unsigned char* hmacKey, bool* renew)
+{
+	time_t now = time(nullptr);
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	for(int i = 0; i < TICKET_KEY_COUNT; i++)
+	{
+		ticket_key_s* key = _keys + i;
+
+		if(!key->valid || memcmp(key->name, name, TICKET_KEY_NAME_SIZE) != 0) continue;
+
+		// retired keys are honoured for the rest of the ring's window only
+		if(now - key->created >= _lifetime * TICKET_KEY_COUNT) return -1;
+
+		memcpy(aesKey, key->aesKey, TICKET_AES_KEY_SIZE);
+		memcpy(hmacKey, key->hmacKey, TICKET_HMAC_KEY_SIZE);
+
+		*renew = i != _current;
+
+		return 0;
+	}
+
+	return -1;
+}
+
+
+/**
+ * Force a new encryption key, older keys stay valid for decryption
+ * @return 0 if successful, -1 if no key material could be generated
+ */
+int TicketKeyRing::rotate()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	return rotateLocked(time(nullptr));
+}
+
+
+/**
+ * Replace the oldest key with freshly generated material, caller holds the mutex
+ * @param now Current time
+ * @return 0 if successful, -1 if no key material could be generated
+ */
+int TicketKeyRing::rotateLocked(time_t now)
+{
+	int next = _keys[_current].valid ? (_current + 1) % TICKET_KEY_COUNT : _current;
+	ticket_key_s* key = _keys + next;
+
+	if(RAND_bytes(key->name, TICKET_KEY_NAME_SIZE) != 1 ||
+	   RAND_bytes(key->aesKey, TICKET_AES_KEY_SIZE) != 1 ||
+	   RAND_bytes(key->hmacKey, TICKET_HMAC_KEY_SIZE) != 1) {
+		key->valid = false;
+		return -1;
+	}
+
+	key->created = now;
+	key->valid = true;
+	_current = next;
+
+	return 0;
+}
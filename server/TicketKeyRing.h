@@ -0,0 +1,49 @@
+#pragma once
+/**
+ * Author: Ryan Steinwert
+ *
+ * Definition for rotating TLS session ticket key ring
+ */
+
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+
+#define TICKET_KEY_NAME_SIZE 16
+#define TICKET_AES_KEY_SIZE 32
+#define TICKET_HMAC_KEY_SIZE 32
+
+// current key plus the retired keys still accepted for decryption
+#define TICKET_KEY_COUNT 3
+
+
+typedef struct ticket_key_t {
+	unsigned char name[TICKET_KEY_NAME_SIZE];
+	unsigned char aesKey[TICKET_AES_KEY_SIZE];
+	unsigned char hmacKey[TICKET_HMAC_KEY_SIZE];
+	time_t created;
+	bool valid;
+} ticket_key_s;
+
+
+
+class TicketKeyRing {
+public:
+	TicketKeyRing();
+	TicketKeyRing(time_t lifetime);
+	~TicketKeyRing();
+
+	int encryptionKey(unsigned char* name, unsigned char* aesKey, unsigned char* hmacKey);
+	int decryptionKey(const unsigned char* name, unsigned char* aesKey, unsigned char* hmacKey, bool* renew);
+
+	int rotate();
+
+private:
+	time_t _lifetime;
+	int _current;
+	ticket_key_s _keys[TICKET_KEY_COUNT];
+
+	std::mutex _mutex;
+
+	int rotateLocked(time_t now);
+};
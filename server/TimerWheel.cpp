@@ -0,0 +1,175 @@
+/**
+ * Author: Ryan Steinwert
+ *
+ * Implementation for hierarchical timer wheel
+ */
+
+#include "TimerWheel.h"
+
+
+
+/**
+ * Create an empty wheel
+ * @param nowMs Current monotonic time in milliseconds
+ */
+TimerWheel::TimerWheel(uint64_t nowMs) :
+	_tick(nowMs / TIMER_TICK_MS),
+	_count(0)
+{
+	for(int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+	{
+		for(int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+		{
+			_slots[level][i].prev = &_slots[level][i];
+			_slots[level][i].next = &_slots[level][i];
+		}
+	}
+}
+
+
+/**
+ * Arm a timer, rearming it if it is already armed
+ * @param timer The timer to arm
+ * @param expiresMs Monotonic time in milliseconds the timer fires at
+ */
+void TimerWheel::arm(timer_entry_s* timer, uint64_t expiresMs)
+{
+	cancel(timer);
+
+	// rounded up so a timer never fires early
+	timer->expires = (expiresMs + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+	place(timer);
+	_count++;
+}
+
+
+/**
+ * Disarm a timer, nothing is done if it is not armed
+ * @param timer The timer to cancel
+ */
+void TimerWheel::cancel(timer_entry_s* timer)
+{
+	if(timer->next == nullptr) return;
+
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->prev = timer->next = nullptr;
+
+	_count--;
+}
+
+
+/**
+ * Take the next expired timer, call until it returns null
+ * @param nowMs Current monotonic time in milliseconds
+ * @return An expired timer, already disarmed, or null if none are due
+ */
+timer_entry_s* TimerWheel::expire(uint64_t nowMs)
+{
+	timer_entry_s* slot;
+	timer_entry_s* timer;
+	uint64_t target = nowMs / TIMER_TICK_MS;
+
+	// nothing to cascade through
+	if(_count == 0) {
+		if(target > _tick) _tick = target;
+		return nullptr;
+	}
+
+	while(true) {
+		slot = &_slots[0][_tick & TIMER_WHEEL_MASK];
+
+		if(slot->next != slot) {
+			timer = slot->next;
+			cancel(timer);
+			return timer;
+		}
+
+		if(_tick >= target) return nullptr;
+
+		_tick++;
+
+		// each level wrapping pulls the next slot of the level above down
+		for(int level = 1; level < TIMER_WHEEL_LEVELS; level++)
+		{
+			if((_tick >> (TIMER_WHEEL_BITS * (level - 1))) & TIMER_WHEEL_MASK) break;
+			cascade(level);
+		}
+	}
+}
+
+
+/**
+ * @return Milliseconds a reactor may wait before calling expire, -1 if no timers are armed
+ */
+int TimerWheel::timeout()
+{
+	return _count > 0 ? TIMER_TICK_MS : -1;
+}
+
+
+/**
+ * @return Number of armed timers
+ */
+size_t TimerWheel::size()
+{
+	return _count;
+}
+
+
+/**
+ * Link a timer into the slot for its expiry, relative to the current tick
+ * @param timer Timer with its expiry tick set
+ */
+void TimerWheel::place(timer_entry_s* timer)
+{
+	timer_entry_s* slot;
+	uint64_t delta;
+	int level;
+
+	// already due, fires on the current tick
+	if(timer->expires < _tick) timer->expires = _tick;
+
+	delta = timer->expires - _tick;
+
+	// past the top level, held there until it comes into range
+	if(delta >> (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) {
+		delta = ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+		timer->expires = _tick + delta;
+	}
+
+	for(level = 0; level < TIMER_WHEEL_LEVELS - 1; level++)
+	{
+		if(delta < ((uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1)))) break;
+	}
+
+	slot = &_slots[level][(timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+
+	timer->prev = slot->prev;
+	timer->next = slot;
+	slot->prev->next = timer;
+	slot->prev = timer;
+}
+
+
+/**
+ * Move the timers in the current slot of a level down into the levels below
+ * @param level The level to cascade from
+ */
+void TimerWheel::cascade(int level)
+{
+	timer_entry_s* slot = &_slots[level][(_tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+	timer_entry_s* timer = slot->next;
+	timer_entry_s* next;
+
+	// detach the whole list first, placing may put timers back on this level
+	slot->prev = slot->next = slot;
+
+	while(timer != slot)
+	{
+		next = timer->next;
+		place(timer);
+		timer = next;
+	}
+}
@@ -0,0 +1,64 @@
+#pragma once
+/**
+ * Author: Ryan Steinwert
+ *
+ * Definition for hierarchical timer wheel, one per reactor thread
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+#define TIMER_TICK_MS 100
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// four levels span 2^24 ticks, about 19 days at 100ms
+#define TIMER_WHEEL_LEVELS 4
+
+
+/**
+ * Timer linked into a wheel slot, embedded in whatever it times. Armed while
+ * next is set.
+ */
+typedef struct timer_entry_t {
+	uint64_t expires;
+	void* data;
+	struct timer_entry_t* prev;
+	struct timer_entry_t* next;
+} timer_entry_s;
+
+
+
+/**
+ * Timers are kept in the slot of the level matching how far off they are and
+ * move down a level each time the level below wraps, so arming and cancelling
+ * are O(1) and each timer is only touched a few times before it fires.
+ * Not thread safe, a wheel belongs to a single reactor.
+ */
+class TimerWheel {
+public:
+	TimerWheel(uint64_t nowMs);
+
+	TimerWheel(const TimerWheel&) = delete;
+	TimerWheel& operator=(const TimerWheel&) = delete;
+
+	void arm(timer_entry_s* timer, uint64_t expiresMs);
+	void cancel(timer_entry_s* timer);
+
+	timer_entry_s* expire(uint64_t nowMs);
+	int timeout();
+
+	size_t size();
+
+private:
+	uint64_t _tick;
+	size_t _count;
+
+	// sentinel of each slot's circular list
+	timer_entry_s _slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+	void place(timer_entry_s* timer);
+	void cascade(int level);
+};
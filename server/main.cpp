@@ -4,33 +4,141 @@
  * Common sense social server main file
  */
 
-#define DEFAULT_NUM_THREADS 4
-
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
+#include <unistd.h>
 
+#include <pthread.h>
 #include <signal.h>
 
 #include "CSServer.h"
 
 
+/**
+ * Parse a rate limit option into the server options
+ * @param arg Limit as class:rate:burst, a rate of 0 disables the limit
+ * @param options Options to set the limit in
+ * @return 0 if parsed, -1 if not
+ */
+static int parseRateLimit(const char* arg, server_options_s* options)
+{
+    char name[16];
+    double rate, burst;
+    RATE_CLASS rateClass;
+
+    if(sscanf(arg, "%15[^:]:%lf:%lf", name, &rate, &burst) != 3) return -1;
+
+    if(strcmp(name, "auth") == 0) {
+        rateClass = RATE_CLASS::RATE_AUTH;
+    } else if(strcmp(name, "write") == 0) {
+        rateClass = RATE_CLASS::RATE_WRITE;
+    } else if(strcmp(name, "read") == 0) {
+        rateClass = RATE_CLASS::RATE_READ;
+    } else {
+        return -1;
+    }
+
+    options->rateLimits[rateClass].rate = rate;
+    options->rateLimits[rateClass].burst = burst;
+
+    return 0;
+}
+
+
 int main(int argc, char* argv[]) {
 
     int opt;
+    sigset_t signals;
+    server_options_s options;
 
     signal(SIGPIPE, SIG_IGN);
 
+    // taken by the server through a signalfd, blocked before any thread inherits the mask
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    options.argv = argv;
+
     
     // use getopt
-    while((opt = getopt(argc, argv, "")) != -1) {
+    while((opt = getopt(argc, argv, "c:q:m:t:l:s:u:i:a:e:n:j:rpk")) != -1) {
         switch(opt) {
+            case 'c':
+                // number of worker threads, 0 for one per online core
+                options.numThreads = atoi(optarg);
+                if(options.numThreads <= 0) options.numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+                break;
+            case 'q':
+                // depth of the pending connection queue
+                options.queueDepth = atoi(optarg);
+                break;
+            case 'm':
+                // connections served per worker before clients queue
+                options.maxConnections = atoi(optarg);
+                break;
+            case 't':
+                // task threads for tagged requests, 0 keeps them on the workers
+                options.numTaskThreads = atoi(optarg);
+                if(options.numTaskThreads < 0) options.numTaskThreads = 0;
+                break;
+            case 'l':
+                // rate limit as class:rate:burst, class is auth, write or read
+                if(parseRateLimit(optarg, &options) != 0) fprintf(stderr, "Ignoring rate limit %s\n", optarg);
+                break;
+            case 's':
+                // unix socket path serving stats
+                options.statsPath = optarg;
+                break;
+            case 'u':
+                // handoff socket, a new server started with the same path takes over the listeners
+                options.handoffPath = optarg;
+                break;
+            case 'i':
+                // plaintext unix socket for services on the same host
+                options.localPath = optarg;
+                break;
+            case 'a':
+                // peer uid on the local socket treated as admin, may be repeated
+                if(options.numAdminUids < MAX_ADMIN_UIDS) options.adminUids[options.numAdminUids++] = atoi(optarg);
+                else fprintf(stderr, "Ignoring admin uid %s\n", optarg);
+                break;
+            case 'e':
+                // seconds a session lives unused, 0 to never expire sessions
+                options.sessionTtl = atoi(optarg);
+                break;
+            case 'n':
+                // sessions kept before the least recently used are evicted
+                if(atol(optarg) > 0) options.maxSessions = atol(optarg);
+                break;
+            case 'j':
+                // session snapshot file, logged in sessions survive restarts
+                options.sessionPath = optarg;
+                break;
+            case 'r':
+                // shard per core, each worker listens with SO_REUSEPORT
+                options.reusePort = true;
+                break;
+            case 'p':
+                // pin workers to cores
+                options.pinThreads = true;
+                break;
+            case 'k':
+                // kernel TLS, item files are sent without copying through user space
+                options.ktls = true;
+                break;
             default:
                 break;
         }
     }
 
 
-    CSServer server(DEFAULT_NUM_THREADS);
+    CSServer server(options);
 
     server.startup();
 
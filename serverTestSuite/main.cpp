@@ -16,6 +16,7 @@
 #include <stdio.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <string.h>
 #include <stdint.h>
 #include <vector>
@@ -31,7 +32,10 @@
 #include <openssl/err.h>
 #include <openssl/pem.h>
 
+#include <zlib.h>
+
 #include "definitions.h"
+#include "dictionary.h"
 
 
 using namespace std;
@@ -48,12 +52,22 @@ uint32_t sessionID;
 void printResult(int testResult);
 uint64_t getInt(const char* src, uint16_t start, uint16_t size);
 void placeInt(void* voidBuf, uint64_t value, uint16_t start, uint16_t size);
+int placeVarint(char* dest, uint64_t value, uint16_t start);
+int readReply(char* dest, int size);
 
 
 int headerTest1();
 int loginTest1();
 int createAccountTests();
 int postTests();
+int requestIdTests();
+int getTests();
+int splitFrameTests();
+int rateLimitTests();
+int batchTests();
+int protocolV2Tests();
+int wideSessionTests();
+int localSocketTests(const char* path);
 
 
 int main(int argc, char* argv[])
@@ -160,6 +174,34 @@ int main(int argc, char* argv[])
    printf("Login test 1: ");
    printResult(loginTest1());
 
+   printf("Request ID tests: ");
+   printResult(requestIdTests());
+
+   printf("Get tests: ");
+   printResult(getTests());
+
+   printf("Split frame tests: ");
+   printResult(splitFrameTests());
+
+   printf("Rate limit tests: ");
+   printResult(rateLimitTests());
+
+   printf("Batch tests: ");
+   printResult(batchTests());
+
+   // switches the connection to v2 framing, keep it last on this connection
+   printf("Protocol v2 tests: ");
+   printResult(protocolV2Tests());
+
+   printf("Wide session tests: ");
+   printResult(wideSessionTests());
+
+   // plaintext local listener, only when the server was started with one
+   if(argc > 1) {
+      printf("Local socket tests: ");
+      printResult(localSocketTests(argv[1]));
+   }
+
    if(ssl != nullptr) SSL_free(ssl);
    close(sock);
    if(cert != nullptr) X509_free(cert);
@@ -278,6 +320,420 @@ int postTests()
 
 
 
+/**
+ * Send a tagged login and a tagged session request back to back, replies
+ * may come back in either order but must echo their request IDs
+ */
+int requestIdTests()
+{
+  int bytesRead, received, offset;
+  char commandBuf[HEADER_SIZE+REQUEST_ID_SIZE+STR_LEN_SIZE+SHORT_BUF_SIZE];
+  char replyBuf[2*(HEADER_SIZE+REQUEST_ID_SIZE+ERR_CODE_SIZE)];
+  bool seenLogin = false, seenSession = false;
+
+  placeInt(commandBuf, sessionID, 0, IDENT_SIZE);
+  placeInt(commandBuf, CMD::LOGIN | (HEADER_FLAGS::HAS_REQUEST_ID << 4), IDENT_SIZE, COMMAND_SIZE);
+  placeInt(commandBuf, 7, HEADER_SIZE, REQUEST_ID_SIZE);
+  if(SSL_write(ssl, commandBuf, HEADER_SIZE+REQUEST_ID_SIZE) <= 0) return -1;
+
+  memset(commandBuf, 0, sizeof(commandBuf));
+  placeInt(commandBuf, SHORT_BUF_SIZE, 0, STR_LEN_SIZE);
+  strncpy(commandBuf+STR_LEN_SIZE, "myusername", SHORT_BUF_SIZE);
+  if(SSL_write(ssl, commandBuf, STR_LEN_SIZE+SHORT_BUF_SIZE) <= 0) return -2;
+
+  strncpy(commandBuf+STR_LEN_SIZE, "password", SHORT_BUF_SIZE);
+  if(SSL_write(ssl, commandBuf, STR_LEN_SIZE+SHORT_BUF_SIZE) <= 0) return -3;
+
+  placeInt(commandBuf, 0, 0, IDENT_SIZE);
+  placeInt(commandBuf, CMD::GET_SESSION_ID | (HEADER_FLAGS::HAS_REQUEST_ID << 4), IDENT_SIZE, COMMAND_SIZE);
+  placeInt(commandBuf, 8, HEADER_SIZE, REQUEST_ID_SIZE);
+  if(SSL_write(ssl, commandBuf, HEADER_SIZE+REQUEST_ID_SIZE) <= 0) return -4;
+
+  // login reply carries an error code, the session reply does not
+  received = 0;
+  while(received < (int)sizeof(replyBuf) - ERR_CODE_SIZE) {
+    bytesRead = SSL_read(ssl, replyBuf + received, sizeof(replyBuf) - ERR_CODE_SIZE - received);
+    if(bytesRead <= 0) return -5;
+    received += bytesRead;
+  }
+
+  for(offset = 0; offset < received;) {
+    uint16_t command = getInt(replyBuf, offset + IDENT_SIZE, COMMAND_SIZE);
+    uint32_t requestID = getInt(replyBuf, offset + HEADER_SIZE, REQUEST_ID_SIZE);
+
+    if(!(command & (HEADER_FLAGS::HAS_REQUEST_ID << 4))) return -6;
+
+    if((command & 0xF00F) == CMD::LOGIN && requestID == 7) {
+      seenLogin = true;
+      offset += HEADER_SIZE+REQUEST_ID_SIZE+ERR_CODE_SIZE;
+    } else if((command & 0xF00F) == CMD::GET_SESSION_ID && requestID == 8) {
+      seenSession = true;
+      offset += HEADER_SIZE+REQUEST_ID_SIZE;
+    } else {
+      return -7;
+    }
+  }
+
+  return seenLogin && seenSession ? 0 : -8;
+}
+
+
+/**
+ * Get an item that does not exist, answered with an error instead of a stream
+ */
+int getTests()
+{
+  int bytesRead;
+  const char* path = "public/missing";
+  char commandBuf[HEADER_SIZE+STR_LEN_SIZE+SHORT_BUF_SIZE];
+
+  placeInt(commandBuf, sessionID, 0, IDENT_SIZE);
+  placeInt(commandBuf, CMD::GET, IDENT_SIZE, COMMAND_SIZE);
+  placeInt(commandBuf, strlen(path), HEADER_SIZE, STR_LEN_SIZE);
+  memcpy(commandBuf+HEADER_SIZE+STR_LEN_SIZE, path, strlen(path));
+  if(SSL_write(ssl, commandBuf, HEADER_SIZE+STR_LEN_SIZE+strlen(path)) <= 0) return -1;
+
+  bytesRead = SSL_read(ssl, commandBuf, HEADER_SIZE+ERR_CODE_SIZE);
+
+  if(bytesRead < HEADER_SIZE+ERR_CODE_SIZE) return -2;
+  if(getInt(commandBuf, IDENT_SIZE, COMMAND_SIZE) != CMD::GET) return -3;
+  if(getInt(commandBuf, HEADER_SIZE, ERR_CODE_SIZE) != ERROR::PATH_INVAL) return -4;
+
+  return 0;
+}
+
+
+/**
+ * Send a login with its fields cut mid string and a pause between the parts,
+ * the handler has to wait for the rest rather than misread the frame
+ */
+int splitFrameTests()
+{
+  int bytesRead, size;
+  char commandBuf[HEADER_SIZE+2*(STR_LEN_SIZE+SHORT_BUF_SIZE)];
+
+  memset(commandBuf, 0, sizeof(commandBuf));
+  placeInt(commandBuf, sessionID, 0, IDENT_SIZE);
+  placeInt(commandBuf, CMD::LOGIN, IDENT_SIZE, COMMAND_SIZE);
+
+  size = HEADER_SIZE;
+  placeInt(commandBuf, SHORT_BUF_SIZE, size, STR_LEN_SIZE);
+  strncpy(commandBuf+size+STR_LEN_SIZE, "myusername", SHORT_BUF_SIZE);
+  size += STR_LEN_SIZE+SHORT_BUF_SIZE;
+  placeInt(commandBuf, SHORT_BUF_SIZE, size, STR_LEN_SIZE);
+  strncpy(commandBuf+size+STR_LEN_SIZE, "password", SHORT_BUF_SIZE);
+  size += STR_LEN_SIZE+SHORT_BUF_SIZE;
+
+  if(SSL_write(ssl, commandBuf, HEADER_SIZE+STR_LEN_SIZE+5) <= 0) return -1;
+  usleep(50000);
+  if(SSL_write(ssl, commandBuf+HEADER_SIZE+STR_LEN_SIZE+5, 1) <= 0) return -2;
+  usleep(50000);
+  if(SSL_write(ssl, commandBuf+HEADER_SIZE+STR_LEN_SIZE+6, size-HEADER_SIZE-STR_LEN_SIZE-6) <= 0) return -3;
+
+  bytesRead = SSL_read(ssl, commandBuf, HEADER_SIZE+ERR_CODE_SIZE);
+
+  if(bytesRead < HEADER_SIZE+ERR_CODE_SIZE) return -4;
+  if(getInt(commandBuf, IDENT_SIZE, COMMAND_SIZE) != CMD::LOGIN) return -5;
+
+  return static_cast<int>(getInt(commandBuf, HEADER_SIZE, ERR_CODE_SIZE));
+}
+
+
+/**
+ * Send more logins back to back than the default auth burst allows, the
+ * extra ones are answered with RATE_LIMITED and every one is answered
+ */
+int rateLimitTests()
+{
+  int bytesRead, received, limited;
+  const int numLogins = 16;
+  char commandBuf[HEADER_SIZE+2*(STR_LEN_SIZE+SHORT_BUF_SIZE)];
+  char replyBuf[numLogins*(HEADER_SIZE+ERR_CODE_SIZE)];
+
+  memset(commandBuf, 0, sizeof(commandBuf));
+  placeInt(commandBuf, sessionID, 0, IDENT_SIZE);
+  placeInt(commandBuf, CMD::LOGIN, IDENT_SIZE, COMMAND_SIZE);
+  placeInt(commandBuf, SHORT_BUF_SIZE, HEADER_SIZE, STR_LEN_SIZE);
+  strncpy(commandBuf+HEADER_SIZE+STR_LEN_SIZE, "myusername", SHORT_BUF_SIZE);
+  placeInt(commandBuf, SHORT_BUF_SIZE, HEADER_SIZE+STR_LEN_SIZE+SHORT_BUF_SIZE, STR_LEN_SIZE);
+  strncpy(commandBuf+HEADER_SIZE+2*STR_LEN_SIZE+SHORT_BUF_SIZE, "password", SHORT_BUF_SIZE);
+
+  for(int i = 0; i < numLogins; i++) {
+    if(SSL_write(ssl, commandBuf, sizeof(commandBuf)) <= 0) return -1;
+  }
+
+  received = 0;
+  while(received < (int)sizeof(replyBuf)) {
+    bytesRead = SSL_read(ssl, replyBuf + received, sizeof(replyBuf) - received);
+    if(bytesRead <= 0) return -2;
+    received += bytesRead;
+  }
+
+  limited = 0;
+  for(int i = 0; i < numLogins; i++) {
+    if(getInt(replyBuf, i*(HEADER_SIZE+ERR_CODE_SIZE) + HEADER_SIZE, ERR_CODE_SIZE) == ERROR::RATE_LIMITED) limited++;
+  }
+
+  return limited > 0 ? 0 : -3;
+}
+
+
+/**
+ * Send a batch of a post and a delete, the reply carries a code for each
+ * operation whether or not it went through
+ */
+int batchTests()
+{
+  int size, received, bytesRead;
+  const char* path = "public/batch1";
+  const char* data = "batched post";
+  char commandBuf[HEADER_SIZE+1+2*(2+2*STR_LEN_SIZE+SHORT_BUF_SIZE)];
+  char replyBuf[HEADER_SIZE+ERR_CODE_SIZE+1+2*ERR_CODE_SIZE];
+
+  placeInt(commandBuf, sessionID, 0, IDENT_SIZE);
+  placeInt(commandBuf, CMD::BATCH, IDENT_SIZE, COMMAND_SIZE);
+  size = HEADER_SIZE;
+  placeInt(commandBuf, 2, size++, 1);
+
+  placeInt(commandBuf, BATCH_OP::BATCH_POST, size++, 1);
+  placeInt(commandBuf, FLAGS::TEXT_RESOURCE, size++, 1);
+  placeInt(commandBuf, PERM::PUBLIC, size++, 1);
+  placeInt(commandBuf, strlen(path), size, STR_LEN_SIZE);
+  memcpy(commandBuf+size+STR_LEN_SIZE, path, strlen(path));
+  size += STR_LEN_SIZE+strlen(path);
+  placeInt(commandBuf, strlen(data), size, STR_LEN_SIZE);
+  memcpy(commandBuf+size+STR_LEN_SIZE, data, strlen(data));
+  size += STR_LEN_SIZE+strlen(data);
+
+  placeInt(commandBuf, BATCH_OP::BATCH_DELETE, size++, 1);
+  placeInt(commandBuf, strlen(path), size, STR_LEN_SIZE);
+  memcpy(commandBuf+size+STR_LEN_SIZE, path, strlen(path));
+  size += STR_LEN_SIZE+strlen(path);
+
+  if(SSL_write(ssl, commandBuf, size) <= 0) return -1;
+
+  received = 0;
+  while(received < (int)sizeof(replyBuf)) {
+    bytesRead = SSL_read(ssl, replyBuf + received, sizeof(replyBuf) - received);
+    if(bytesRead <= 0) return -2;
+    received += bytesRead;
+  }
+
+  if(getInt(replyBuf, IDENT_SIZE, COMMAND_SIZE) != CMD::BATCH) return -3;
+  if(getInt(replyBuf, HEADER_SIZE, ERR_CODE_SIZE) != ERROR::SUCCESS) return -4;
+  if(getInt(replyBuf, HEADER_SIZE+ERR_CODE_SIZE, 1) != 2) return -5;
+
+  printf("Returned with [%lu, %lu]: ",
+         getInt(replyBuf, HEADER_SIZE+ERR_CODE_SIZE+1, ERR_CODE_SIZE),
+         getInt(replyBuf, HEADER_SIZE+ERR_CODE_SIZE+1+ERR_CODE_SIZE, ERR_CODE_SIZE));
+
+  return 0;
+}
+
+
+/**
+ * Switch to v2 framing and deflated bodies with a HELLO, then send a tagged
+ * GET_SESSION_ID and a GET of a missing item, plain and deflated, as v2
+ * frames and check their varint framed replies
+ */
+int protocolV2Tests()
+{
+  int size, bodySize;
+  const char* path = "public/missing";
+  char commandBuf[HEADER_SIZE+STR_LEN_SIZE+SHORT_BUF_SIZE];
+  char body[STR_LEN_SIZE+SHORT_BUF_SIZE];
+  char deflated[HEADER_SIZE+STR_LEN_SIZE+SHORT_BUF_SIZE];
+  uLongf deflatedSize;
+  z_stream stream;
+
+  placeInt(commandBuf, sessionID, 0, IDENT_SIZE);
+  placeInt(commandBuf, CMD::HELLO, IDENT_SIZE, COMMAND_SIZE);
+  placeInt(commandBuf, PROTOCOL::PROTOCOL_V2, HEADER_SIZE, 1);
+  placeInt(commandBuf, CAPABILITY::CAP_DEFLATE, HEADER_SIZE+1, 1);
+  if(SSL_write(ssl, commandBuf, HEADER_SIZE+2) <= 0) return -1;
+
+  // the HELLO reply still uses v1 framing
+  if(readReply(commandBuf, HEADER_SIZE+ERR_CODE_SIZE+2) != 0) return -2;
+  if(getInt(commandBuf, HEADER_SIZE, ERR_CODE_SIZE) != ERROR::SUCCESS) return -3;
+  if(getInt(commandBuf, HEADER_SIZE+ERR_CODE_SIZE, 1) != PROTOCOL::PROTOCOL_V2) return -4;
+  if(getInt(commandBuf, HEADER_SIZE+ERR_CODE_SIZE+1, 1) != CAPABILITY::CAP_DEFLATE) return -4;
+
+  // version, command, flags word, session ID, request ID 300
+  size = 1;
+  placeInt(commandBuf, PROTOCOL::PROTOCOL_V2, 0, 1);
+  size += placeVarint(commandBuf, CMD::GET_SESSION_ID, size);
+  size += placeVarint(commandBuf, FLAGS_V2::V2_HAS_REQUEST_ID, size);
+  placeInt(commandBuf, 0, size, IDENT_SIZE);
+  size += IDENT_SIZE;
+  size += placeVarint(commandBuf, 300, size);
+  if(SSL_write(ssl, commandBuf, size) <= 0) return -5;
+
+  if(readReply(commandBuf, size) != 0) return -6;
+  if(commandBuf[0] != PROTOCOL::PROTOCOL_V2 || (uint8_t)commandBuf[1] != 0x81 || commandBuf[2] != 0x20) return -7;
+  if(commandBuf[3] != FLAGS_V2::V2_HAS_REQUEST_ID || getInt(commandBuf, 4, IDENT_SIZE) == 0) return -8;
+  if((uint8_t)commandBuf[8] != 0xAC || commandBuf[9] != 0x02) return -9;
+
+  size = 1;
+  placeInt(commandBuf, PROTOCOL::PROTOCOL_V2, 0, 1);
+  size += placeVarint(commandBuf, CMD::GET, size);
+  size += placeVarint(commandBuf, 0, size);
+  placeInt(commandBuf, sessionID, size, IDENT_SIZE);
+  size += IDENT_SIZE;
+  size += placeVarint(commandBuf, strlen(path), size);
+  memcpy(commandBuf+size, path, strlen(path));
+  if(SSL_write(ssl, commandBuf, size+strlen(path)) <= 0) return -10;
+
+  // version, 2 byte command, flags word, session ID, one byte code
+  if(readReply(commandBuf, 1+2+1+IDENT_SIZE+1) != 0) return -11;
+  if(getInt(commandBuf, 1, 2) != 0x8140) return -12;
+  if(commandBuf[1+2+1+IDENT_SIZE] != ERROR::PATH_INVAL) return -13;
+
+  // the same GET with its body deflated against the shared dictionary
+  bodySize = placeVarint(body, strlen(path), 0);
+  memcpy(body+bodySize, path, strlen(path));
+  bodySize += strlen(path);
+
+  memset(&stream, 0, sizeof(stream));
+  if(deflateInit(&stream, Z_BEST_COMPRESSION) != Z_OK) return -14;
+  deflateSetDictionary(&stream, (const Bytef*)POST_DICTIONARY, sizeof(POST_DICTIONARY) - 1);
+
+  stream.next_in = (Bytef*)body;
+  stream.avail_in = bodySize;
+  stream.next_out = (Bytef*)deflated;
+  stream.avail_out = sizeof(deflated);
+  if(deflate(&stream, Z_FINISH) != Z_STREAM_END) return -15;
+  deflatedSize = stream.total_out;
+  deflateEnd(&stream);
+
+  size = 1;
+  placeInt(commandBuf, PROTOCOL::PROTOCOL_V2, 0, 1);
+  size += placeVarint(commandBuf, CMD::GET, size);
+  size += placeVarint(commandBuf, FLAGS_V2::V2_COMPRESSED, size);
+  placeInt(commandBuf, sessionID, size, IDENT_SIZE);
+  size += IDENT_SIZE;
+  size += placeVarint(commandBuf, bodySize, size);
+  size += placeVarint(commandBuf, deflatedSize, size);
+  if(SSL_write(ssl, commandBuf, size) <= 0) return -16;
+  if(SSL_write(ssl, deflated, deflatedSize) <= 0) return -17;
+
+  if(readReply(commandBuf, 1+2+1+IDENT_SIZE+1) != 0) return -18;
+  if(commandBuf[1+2+1+IDENT_SIZE] != ERROR::PATH_INVAL) return -19;
+
+  return 0;
+}
+
+
+/**
+ * On the v2 connection, ask for 128 bit session tokens, create a wide
+ * session and check a POST is only refused for lacking a session when sent
+ * with a wrong token. The narrow session keeps working as the token 0:ID.
+ */
+int wideSessionTests()
+{
+  int size, headerSize;
+  const char* path = "public/wide";
+  char commandBuf[HEADER_SIZE+SESSION_TOKEN_SIZE+STR_LEN_SIZE+SHORT_BUF_SIZE];
+  char token[SESSION_TOKEN_SIZE];
+  char legacy[SESSION_TOKEN_SIZE];
+  char wrong[SESSION_TOKEN_SIZE];
+
+  size = 1;
+  placeInt(commandBuf, PROTOCOL::PROTOCOL_V2, 0, 1);
+  size += placeVarint(commandBuf, CMD::HELLO, size);
+  size += placeVarint(commandBuf, 0, size);
+  placeInt(commandBuf, sessionID, size, IDENT_SIZE);
+  size += IDENT_SIZE;
+  placeInt(commandBuf, PROTOCOL::PROTOCOL_V2, size, 1);
+  placeInt(commandBuf, CAPABILITY::CAP_DEFLATE | CAPABILITY::CAP_WIDE_SESSION, size+1, 1);
+  if(SSL_write(ssl, commandBuf, size+2) <= 0) return -1;
+
+  // the HELLO reply is framed before the token is granted
+  if(readReply(commandBuf, size+1+2) != 0) return -2;
+  if(commandBuf[size] != ERROR::SUCCESS || commandBuf[size+1] != PROTOCOL::PROTOCOL_V2) return -3;
+  if(commandBuf[size+2] != (CAPABILITY::CAP_DEFLATE | CAPABILITY::CAP_WIDE_SESSION)) return -4;
+
+  size = 1;
+  placeInt(commandBuf, PROTOCOL::PROTOCOL_V2, 0, 1);
+  size += placeVarint(commandBuf, CMD::GET_SESSION_ID, size);
+  size += placeVarint(commandBuf, 0, size);
+  memset(commandBuf+size, 0, SESSION_TOKEN_SIZE);
+  size += SESSION_TOKEN_SIZE;
+  if(SSL_write(ssl, commandBuf, size) <= 0) return -5;
+
+  if(readReply(commandBuf, size) != 0) return -6;
+  memcpy(token, commandBuf+size-SESSION_TOKEN_SIZE, SESSION_TOKEN_SIZE);
+  if(getInt(token, 0, 8) == 0 || getInt(token, 12, IDENT_SIZE) == 0) return -7;
+
+  memcpy(wrong, token, SESSION_TOKEN_SIZE);
+  wrong[0] ^= 0x01;
+
+  memset(legacy, 0, SESSION_TOKEN_SIZE);
+  placeInt(legacy, sessionID, SESSION_TOKEN_SIZE-IDENT_SIZE, IDENT_SIZE);
+
+  const char* tokens[] = { token, wrong, legacy };
+
+  for(int i = 0; i < 3; i++)
+  {
+    size = 1;
+    placeInt(commandBuf, PROTOCOL::PROTOCOL_V2, 0, 1);
+    size += placeVarint(commandBuf, CMD::POST, size);
+    size += placeVarint(commandBuf, FLAGS::TEXT_RESOURCE << FLAGS_V2::V2_RESOURCE_SHIFT, size);
+    memcpy(commandBuf+size, tokens[i], SESSION_TOKEN_SIZE);
+    size += SESSION_TOKEN_SIZE;
+    headerSize = size;
+    placeInt(commandBuf, PERM::PUBLIC, size, 1);
+    size += 1;
+    size += placeVarint(commandBuf, strlen(path), size);
+    memcpy(commandBuf+size, path, strlen(path));
+    size += strlen(path);
+    size += placeVarint(commandBuf, 2, size);
+    memcpy(commandBuf+size, "hi", 2);
+    size += 2;
+    if(SSL_write(ssl, commandBuf, size) <= 0) return -8;
+
+    // header echoing the token, one byte code
+    if(readReply(commandBuf, headerSize+1) != 0) return -9;
+    if(memcmp(commandBuf+headerSize-SESSION_TOKEN_SIZE, tokens[i], SESSION_TOKEN_SIZE) != 0) return -10;
+    if((commandBuf[headerSize] == ERROR::NO_SESSION) != (tokens[i] == wrong)) return -11 - i;
+  }
+
+  return 0;
+}
+
+
+int localSocketTests(const char* path)
+{
+  int localSock, bytesRead, received;
+  struct sockaddr_un localAddr;
+  char commandBuf[HEADER_SIZE];
+
+  memset(&localAddr, 0, sizeof(localAddr));
+  localAddr.sun_family = AF_UNIX;
+  strncpy(localAddr.sun_path, path, sizeof(localAddr.sun_path) - 1);
+
+  localSock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(connect(localSock, (struct sockaddr *)&localAddr, sizeof(localAddr)) != 0) return -1;
+
+  // same frames as over TLS, written in the clear
+  placeInt(commandBuf, 0, 0, IDENT_SIZE);
+  placeInt(commandBuf, CMD::GET_SESSION_ID, IDENT_SIZE, COMMAND_SIZE);
+  if(write(localSock, commandBuf, HEADER_SIZE) != HEADER_SIZE) return -2;
+
+  received = 0;
+  while(received < HEADER_SIZE) {
+    bytesRead = read(localSock, commandBuf + received, HEADER_SIZE - received);
+    if(bytesRead <= 0) return -3;
+    received += bytesRead;
+  }
+
+  if(getInt(commandBuf, 0, IDENT_SIZE) == 0 || getInt(commandBuf, IDENT_SIZE, COMMAND_SIZE) != CMD::GET_SESSION_ID) return -4;
+
+  close(localSock);
+
+  return 0;
+}
+
+
 /**
  * Print success or FAILED based on given result of test
  */
@@ -304,7 +760,7 @@ uint64_t getInt(const char* src, uint16_t start, uint16_t size)
     uint64_t result = 0;
     // go from back to front, add based on powers of 8
     for(int i = (start+size)-1; i >= start; i--) {
-        result += static_cast<uint8_t>(src[i]) << 8*place;
+        result += static_cast<uint64_t>(static_cast<uint8_t>(src[i])) << 8*place;
         place++;
     }
 
@@ -327,4 +783,46 @@ void placeInt(void* voidBuf, uint64_t value, uint16_t start, uint16_t size)
         buffer[i] = (char)(value & 0xFF);
         value = value >> 8; 
     }
-}
\ No newline at end of file
+}
+
+
+/**
+ * Place a LEB128 varint into the given buffer
+ * @param dest Buffer to place into
+ * @param value Value to place
+ * @param start Start index for the varint in the buffer
+ * @return Number of bytes placed
+ */
+int placeVarint(char* dest, uint64_t value, uint16_t start)
+{
+    int size = 0;
+
+    while(value >= 0x80) {
+        dest[start + size++] = (char)((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+
+    dest[start + size++] = (char)value;
+
+    return size;
+}
+
+
+/**
+ * Read a whole reply of known size from the TLS connection
+ * @param dest Buffer to read into
+ * @param size Size of the reply
+ * @return 0 if read, -1 if the connection ended first
+ */
+int readReply(char* dest, int size)
+{
+    int bytesRead, received = 0;
+
+    while(received < size) {
+        bytesRead = SSL_read(ssl, dest + received, size - received);
+        if(bytesRead <= 0) return -1;
+        received += bytesRead;
+    }
+
+    return 0;
+}